@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 #ifdef _3DS
 #include <3ds.h>
 #elif defined(__SWITCH__)
@@ -30,14 +32,33 @@
 #define WHITE
 #endif
 
+/*! log level */
+typedef enum
+{
+  LOG_ERROR, /*!< something failed */
+  LOG_WARN,  /*!< something unexpected that was dealt with */
+  LOG_INFO,  /*!< normal operation */
+  LOG_DEBUG, /*!< per-command chatter */
+} log_level_t;
+
 void console_init(void);
+void console_exit(void);
 
 __attribute__((format(printf,1,2)))
 void console_set_status(const char *fmt, ...);
 
+__attribute__((format(printf,2,3)))
+void console_log(log_level_t level, const char *fmt, ...);
+
 __attribute__((format(printf,1,2)))
 void console_print(const char *fmt, ...);
 
+void console_xferlog(const char *record, size_t len);
+
+#define console_error(...) console_log(LOG_ERROR, __VA_ARGS__)
+#define console_warn(...)  console_log(LOG_WARN,  __VA_ARGS__)
+#define console_debug(...) console_log(LOG_DEBUG, __VA_ARGS__)
+
 __attribute__((format(printf,1,2)))
 void debug_print(const char *fmt, ...);
 
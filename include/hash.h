@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*! hash algorithm */
+typedef enum
+{
+  HASH_CRC32,  /*!< CRC-32 (ISO-HDLC, as used by XCRC) */
+  HASH_MD5,    /*!< MD5 */
+  HASH_SHA1,   /*!< SHA-1 */
+  HASH_SHA256, /*!< SHA-256 */
+} hash_algo_t;
+
+/*! number of hash algorithms */
+#define HASH_NUM_ALGOS 4
+
+/*! largest digest size in bytes */
+#define HASH_MAX_DIGEST 32
+
+/*! largest hex digest size including nul terminator */
+#define HASH_MAX_HEX (2*HASH_MAX_DIGEST + 1)
+
+/*! incremental hash context */
+typedef struct
+{
+  hash_algo_t algo;       /*!< hash algorithm */
+  uint64_t    length;     /*!< total bytes hashed */
+  uint32_t    state[8];   /*!< chaining state (state[0] is the crc) */
+  uint8_t     block[64];  /*!< partial input block */
+} hash_ctx_t;
+
+void        hash_init(hash_ctx_t *ctx, hash_algo_t algo);
+void        hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+size_t      hash_final(hash_ctx_t *ctx, char hex[HASH_MAX_HEX]);
+const char* hash_name(hash_algo_t algo);
+int         hash_lookup(const char *name, hash_algo_t *algo);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/*! values recorded exactly before the histogram starts halving precision */
+#define HIST_SUB_BUCKETS 256
+
+/*! number of counters, enough for values up to HIST_MAX */
+#define HIST_COUNTS      (26*(HIST_SUB_BUCKETS/2))
+
+/*! largest value recorded, bigger ones are clamped */
+#define HIST_MAX         ((UINT64_C(1) << 32) - 1)
+
+/*! high dynamic range histogram with two significant digits */
+typedef struct
+{
+  uint64_t count;   /*!< values recorded */
+  uint64_t sum;     /*!< sum of values recorded */
+  uint64_t max;     /*!< largest value recorded */
+  uint32_t *counts; /*!< HIST_COUNTS counters, allocated on first use */
+} hist_t;
+
+int      hist_record(hist_t *hist, uint64_t value);
+uint64_t hist_percentile(const hist_t *hist, double percentile);
+void     hist_free(hist_t *hist);
@@ -0,0 +1,37 @@
+#pragma once
+
+/*! static tracepoints for bpftrace, perf and systemtap
+ *
+ *  A tracepoint is a single nop until a tracer attaches to it, e.g.
+ *
+ *    bpftrace -e 'usdt:./ftpd:ftpd:command { printf("%s\n", str(arg1)); }'
+ *
+ *  They are built in whenever <sys/sdt.h> is available; build with
+ *  -DENABLE_PROBES=0 to leave them out. A double underscore in a probe name
+ *  is shown as a dash by the tracers.
+ */
+#ifndef ENABLE_PROBES
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define ENABLE_PROBES 1
+#endif
+#endif
+#endif
+
+#ifndef ENABLE_PROBES
+#define ENABLE_PROBES 0
+#endif
+
+#if ENABLE_PROBES
+#include <sys/sdt.h>
+
+#define FTP_PROBE1(name, a)          DTRACE_PROBE1(ftpd, name, a)
+#define FTP_PROBE2(name, a, b)       DTRACE_PROBE2(ftpd, name, a, b)
+#define FTP_PROBE3(name, a, b, c)    DTRACE_PROBE3(ftpd, name, a, b, c)
+#define FTP_PROBE4(name, a, b, c, d) DTRACE_PROBE4(ftpd, name, a, b, c, d)
+#else
+#define FTP_PROBE1(name, a)          do {} while(0)
+#define FTP_PROBE2(name, a, b)       do {} while(0)
+#define FTP_PROBE3(name, a, b, c)    do {} while(0)
+#define FTP_PROBE4(name, a, b, c, d) do {} while(0)
+#endif
@@ -2,9 +2,12 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _3DS
 #include <3ds.h>
@@ -25,6 +28,78 @@ static PrintConsole main_console;
 static bool disable_logging = false;
 #endif
 
+/*! most verbose level that is logged */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL       LOG_DEBUG
+#endif
+
+/*! errors and warnings logged per second from one call site */
+#define LOG_LIMIT_BURST 10
+
+/*! call sites tracked for rate limiting */
+#define LOG_LIMIT_SLOTS 32
+
+/*! rate limit state of one call site */
+typedef struct
+{
+  const char *fmt;       /*!< format string identifying the call site */
+  time_t     window;     /*!< second the count applies to */
+  unsigned   count;      /*!< messages logged in this window */
+  unsigned   suppressed; /*!< messages dropped in this window */
+} log_limit_t;
+
+/*! check a message against the rate limit of its call site
+ *
+ *  @param[in]  limits     rate limit table
+ *  @param[in]  level      log level
+ *  @param[in]  fmt        format string
+ *  @param[out] suppressed messages dropped from this call site before
+ *
+ *  @returns whether to log the message
+ */
+static bool
+console_limit(log_limit_t *limits,
+              log_level_t level,
+              const char  *fmt,
+              unsigned    *suppressed)
+{
+  log_limit_t *limit = &limits[((uintptr_t)fmt >> 3) % LOG_LIMIT_SLOTS];
+  time_t      now;
+
+  *suppressed = 0;
+
+  /* only repeated errors and warnings are a problem */
+  if(level > LOG_WARN)
+    return true;
+
+  now = time(NULL);
+  if(limit->fmt != fmt)
+  {
+    /* another call site took over the slot */
+    limit->fmt        = fmt;
+    limit->window     = now;
+    limit->count      = 0;
+    limit->suppressed = 0;
+  }
+  else if(limit->window != now)
+  {
+    /* start a new window */
+    *suppressed       = limit->suppressed;
+    limit->window     = now;
+    limit->count      = 0;
+    limit->suppressed = 0;
+  }
+
+  if(limit->count >= LOG_LIMIT_BURST)
+  {
+    ++limit->suppressed;
+    return false;
+  }
+
+  ++limit->count;
+  return true;
+}
+
 #if defined(_3DS)
 static PrintConsole tcp_console;
 
@@ -174,6 +249,57 @@ console_set_status(const char *fmt, ...)
   consoleSelect(&main_console);
 }
 
+/*! add text to the console
+ *
+ *  @param[in] level log level
+ *  @param[in] fmt   format string
+ *  @param[in] ap    format arguments
+ */
+static void
+console_vlog(log_level_t level,
+             const char  *fmt,
+             va_list     ap)
+{
+  static log_limit_t limits[LOG_LIMIT_SLOTS];
+  unsigned           suppressed;
+#ifdef ENABLE_LOGGING
+  va_list            ap2;
+#endif
+
+  if(level > LOG_LEVEL || !console_limit(limits, level, fmt, &suppressed))
+    return;
+
+  if(suppressed != 0)
+    printf("(%u similar messages suppressed)\n", suppressed);
+
+#ifdef ENABLE_LOGGING
+  va_copy(ap2, ap);
+#endif
+  vprintf(fmt, ap);
+#ifdef ENABLE_LOGGING
+  if(!disable_logging)
+    vfprintf(stderr, fmt, ap2);
+  va_end(ap2);
+#endif
+}
+
+/*! add text to the console
+ *
+ *  @param[in] level log level
+ *  @param[in] fmt   format string
+ *  @param[in] ...   format arguments
+ */
+void
+console_log(log_level_t level,
+            const char  *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  console_vlog(level, fmt, ap);
+  va_end(ap);
+}
+
 /*! add text to the console
  *
  *  @param[in] fmt format string
@@ -185,11 +311,7 @@ console_print(const char *fmt, ...)
   va_list ap;
 
   va_start(ap, fmt);
-  vprintf(fmt, ap);
-#ifdef ENABLE_LOGGING
-  if(!disable_logging)
-    vfprintf(stderr, fmt, ap);
-#endif
+  console_vlog(LOG_INFO, fmt, ap);
   va_end(ap);
 }
 
@@ -229,24 +351,991 @@ console_render(void)
 #endif
 }
 
+/*! deinitialize console subsystem */
+void
+console_exit(void)
+{
+}
+
+/*! append a record to the transfer log
+ *
+ *  @param[in] record record to append
+ *  @param[in] len    length of record
+ *
+ *  @note There is no transfer log on this platform.
+ */
+void
+console_xferlog(const char *record,
+                size_t     len)
+{
+}
+
 
 #else
 
-/* this is a lot easier when you have a real console */
+/* this is a lot easier when you have a real console, but writing to it can
+ * still block when stdout is a slow pipe, so messages are queued in a ring
+ * per thread and written by a flusher thread; transfer log records must not
+ * be lost, so they get their own queue and writer thread
+ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! bytes in each thread's log ring, a power of two */
+#define LOG_RING_SIZE       (4*1024*1024)
+
+/*! longest message, longer ones are cut short */
+#define LOG_MESSAGE_MAX     65536
+
+/*! milliseconds the flusher sleeps when there is nothing to write */
+#define LOG_FLUSH_INTERVAL  10
+
+/*! bytes the flusher collects before each write */
+#define LOG_OUTPUT_SIZE     (4*LOG_MESSAGE_MAX)
+
+/*! file transfer log records are appended to */
+#ifndef XFERLOG_PATH
+#define XFERLOG_PATH        "xferlog"
+#endif
+
+/*! size at which the transfer log is rotated */
+#ifndef XFERLOG_SIZE
+#define XFERLOG_SIZE        (64*1024*1024)
+#endif
+
+/*! rotated transfer logs kept, as XFERLOG_PATH.1 and up */
+#ifndef XFERLOG_KEEP
+#define XFERLOG_KEEP        4
+#endif
+
+/*! whether messages are queued as their raw arguments and formatted by the
+ *  flusher, which needs every format string to be a literal
+ */
+#ifndef LOG_BINARY
+#define LOG_BINARY          0
+#endif
+
+/*! log record type */
+enum
+{
+  LOG_RECORD_TEXT, /*!< formatted message */
+  LOG_RECORD_ARGS, /*!< format string and raw arguments */
+  LOG_RECORD_WRAP, /*!< rest of the ring is unused */
+};
+
+/*! log record header, followed by the message and padded to 8 bytes */
+typedef struct
+{
+  uint32_t size;  /*!< record size including this header */
+  uint8_t  level; /*!< log level */
+  uint8_t  type;  /*!< record type */
+  uint16_t pad;   /*!< padding bytes at the end */
+} log_record_t;
+
+/*! per-thread log ring, written only by its thread and read only by the
+ *  flusher
+ */
+typedef struct log_ring_t log_ring_t;
+struct log_ring_t
+{
+  log_ring_t  *next;                     /*!< next ring */
+  char        *data;                     /*!< LOG_RING_SIZE bytes */
+  uint64_t    head;                      /*!< bytes written */
+  uint64_t    tail;                      /*!< bytes read */
+  uint64_t    dropped;                   /*!< messages dropped for lack of space */
+  uint64_t    reported;                  /*!< dropped messages reported so far */
+  log_limit_t limits[LOG_LIMIT_SLOTS];   /*!< rate limits of this thread */
+  char        scratch[LOG_MESSAGE_MAX];  /*!< message being formatted */
+};
+
+/*! argument class of a conversion */
+typedef enum
+{
+  LOG_ARG_NONE,     /*!< no argument */
+  LOG_ARG_INT,      /*!< int */
+  LOG_ARG_LONG,     /*!< long */
+  LOG_ARG_LLONG,    /*!< long long */
+  LOG_ARG_INTMAX,   /*!< intmax_t */
+  LOG_ARG_SIZE,     /*!< size_t */
+  LOG_ARG_PTRDIFF,  /*!< ptrdiff_t */
+  LOG_ARG_DOUBLE,   /*!< double */
+  LOG_ARG_STRING,   /*!< string */
+  LOG_ARG_POINTER,  /*!< pointer */
+  LOG_ARG_UNKNOWN,  /*!< anything that can't be queued raw */
+} log_arg_t;
+
+/*! parsed conversion */
+typedef struct
+{
+  log_arg_t arg;       /*!< argument class */
+  unsigned  stars;     /*!< int arguments for * width and precision */
+  bool      precision; /*!< whether a precision was given */
+  bool      prec_star; /*!< whether the precision is an argument */
+} log_spec_t;
+
+/*! all rings */
+static log_ring_t   *rings = NULL;
+/*! this thread's ring */
+static __thread log_ring_t *ring = NULL;
+/*! flusher thread */
+static pthread_t    flusher;
+/*! whether the flusher is running */
+static bool         flushing = false;
+/*! tells the flusher to drain and stop */
+static bool         stopping = false;
+/*! transfer log */
+static int          xferlog_fd = -1;
+/*! size of the transfer log */
+static uint64_t     xferlog_size = 0;
+/*! transfer log writer thread */
+static pthread_t    xfer_writer;
+/*! protects the transfer log queue */
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+/*! signals queued transfer log records */
+static pthread_cond_t  xfer_cond = PTHREAD_COND_INITIALIZER;
+/*! signals the transfer log queue was taken */
+static pthread_cond_t  xfer_taken = PTHREAD_COND_INITIALIZER;
+/*! held while writing the transfer log */
+static pthread_mutex_t xfer_write_lock = PTHREAD_MUTEX_INITIALIZER;
+/*! queued transfer log records */
+static char         *xfer_queue = NULL;
+/*! bytes in the transfer log queue */
+static size_t       xfer_len = 0;
+/*! size of the transfer log queue */
+static size_t       xfer_cap = 0;
+/*! whether the transfer log writer is running */
+static bool         xfer_running = false;
+/*! tells the transfer log writer to drain and stop */
+static bool         xfer_stopping = false;
+
+/*! parse a conversion
+ *
+ *  @param[in]  p    format string just past the %
+ *  @param[out] spec parsed conversion
+ *
+ *  @returns format string just past the conversion
+ */
+static const char*
+log_parse_spec(const char *p,
+               log_spec_t *spec)
+{
+  unsigned length = 0;
+  char     mod    = 0;
+
+  spec->stars     = 0;
+  spec->precision = false;
+  spec->prec_star = false;
+
+  /* flags */
+  while(*p && strchr("-+ #0'", *p))
+    ++p;
+
+  /* width */
+  if(*p == '*')
+  {
+    ++spec->stars;
+    ++p;
+  }
+  while(*p >= '0' && *p <= '9')
+    ++p;
+
+  /* precision */
+  if(*p == '.')
+  {
+    spec->precision = true;
+    ++p;
+    if(*p == '*')
+    {
+      ++spec->stars;
+      spec->prec_star = true;
+      ++p;
+    }
+    while(*p >= '0' && *p <= '9')
+      ++p;
+  }
+
+  /* length */
+  while(*p && strchr("hlLqjzt", *p))
+  {
+    mod = *p++;
+    ++length;
+  }
+
+  switch(*p)
+  {
+    case '%':
+      spec->arg = LOG_ARG_NONE;
+      break;
+
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      if(mod == 'l' && length == 1)
+        spec->arg = LOG_ARG_LONG;
+      else if(mod == 'q' || (mod == 'l' && length == 2))
+        spec->arg = LOG_ARG_LLONG;
+      else if(mod == 'j')
+        spec->arg = LOG_ARG_INTMAX;
+      else if(mod == 'z')
+        spec->arg = LOG_ARG_SIZE;
+      else if(mod == 't')
+        spec->arg = LOG_ARG_PTRDIFF;
+      else if(mod == 0 || mod == 'h')
+        spec->arg = LOG_ARG_INT;
+      else
+        spec->arg = LOG_ARG_UNKNOWN;
+      break;
+
+    case 'c':
+      spec->arg = mod == 0 ? LOG_ARG_INT : LOG_ARG_UNKNOWN;
+      break;
+
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+      spec->arg = mod == 0 || mod == 'l' ? LOG_ARG_DOUBLE : LOG_ARG_UNKNOWN;
+      break;
+
+    case 's':
+      spec->arg = mod == 0 ? LOG_ARG_STRING : LOG_ARG_UNKNOWN;
+      break;
+
+    case 'p':
+      spec->arg = LOG_ARG_POINTER;
+      break;
+
+    default:
+      /* %n, %m, wide characters and anything else */
+      spec->arg = LOG_ARG_UNKNOWN;
+      return p;
+  }
+
+  return p + 1;
+}
+
+/*! queue the raw arguments of a message
+ *
+ *  @param[out] dst output buffer
+ *  @param[in]  cap output buffer size
+ *  @param[in]  fmt format string
+ *  @param[in]  ap  format arguments
+ *
+ *  @returns bytes used, or 0 if the message must be formatted instead
+ */
+static size_t
+log_pack(char       *dst,
+         size_t     cap,
+         const char *fmt,
+         va_list    ap)
+{
+  const char *p   = fmt;
+  size_t     len  = 0;
+  log_spec_t spec;
+  int        star[2];
+  unsigned   i;
+  int64_t    value;
+  double     real;
+  const char *str;
+  uint32_t   slen;
+
+  memcpy(dst, &fmt, sizeof(fmt));
+  len += sizeof(fmt);
+
+  while((p = strchr(p, '%')) != NULL)
+  {
+    p = log_parse_spec(p + 1, &spec);
+    if(spec.arg == LOG_ARG_UNKNOWN)
+      return 0;
+    if(spec.arg == LOG_ARG_NONE)
+      continue;
+
+    for(i = 0; i < spec.stars; ++i)
+      star[i] = va_arg(ap, int);
+
+    if(len + 2*sizeof(int) + sizeof(int64_t) > cap)
+      return 0;
+    for(i = 0; i < spec.stars; ++i)
+    {
+      memcpy(dst + len, &star[i], sizeof(int));
+      len += sizeof(int);
+    }
+
+    switch(spec.arg)
+    {
+      case LOG_ARG_INT:     value = va_arg(ap, int);                 break;
+      case LOG_ARG_LONG:    value = va_arg(ap, long);                break;
+      case LOG_ARG_LLONG:   value = va_arg(ap, long long);           break;
+      case LOG_ARG_INTMAX:  value = va_arg(ap, intmax_t);            break;
+      case LOG_ARG_SIZE:    value = va_arg(ap, size_t);              break;
+      case LOG_ARG_PTRDIFF: value = va_arg(ap, ptrdiff_t);           break;
+      case LOG_ARG_POINTER: value = (intptr_t)va_arg(ap, void*);     break;
+
+      case LOG_ARG_DOUBLE:
+        real = va_arg(ap, double);
+        memcpy(dst + len, &real, sizeof(real));
+        len += sizeof(real);
+        continue;
+
+      case LOG_ARG_STRING:
+        str = va_arg(ap, const char*);
+        if(str == NULL)
+          str = "(null)";
+
+        /* a precision may mean the string is not terminated */
+        if(spec.precision && !spec.prec_star)
+          return 0;
+        else if(spec.prec_star && star[spec.stars - 1] >= 0)
+          slen = strnlen(str, star[spec.stars - 1]);
+        else
+          slen = strlen(str);
+
+        if(len + sizeof(slen) + slen > cap)
+          return 0;
+        memcpy(dst + len, &slen, sizeof(slen));
+        memcpy(dst + len + sizeof(slen), str, slen);
+        len += sizeof(slen) + slen;
+        continue;
+
+      default:
+        return 0;
+    }
+
+    memcpy(dst + len, &value, sizeof(value));
+    len += sizeof(value);
+  }
+
+  return len;
+}
+
+/*! format a message from its queued arguments
+ *
+ *  @param[out] dst output buffer
+ *  @param[in]  cap output buffer size
+ *  @param[in]  src queued arguments
+ *
+ *  @returns bytes formatted
+ */
+static size_t
+log_unpack(char       *dst,
+           size_t     cap,
+           const char *src)
+{
+  const char *fmt, *p, *start;
+  size_t     len = 0;
+  log_spec_t spec;
+  char       conv[64];
+  int        star[2];
+  unsigned   i, n;
+  int64_t    value;
+  double     real;
+  uint32_t   slen;
+  int        rc = 0;
+
+  memcpy(&fmt, src, sizeof(fmt));
+  src += sizeof(fmt);
+
+  for(p = fmt; *p && len < cap - 1; )
+  {
+    /* copy literal text */
+    if(*p != '%')
+    {
+      dst[len++] = *p++;
+      continue;
+    }
+
+    start = p;
+    p = log_parse_spec(p + 1, &spec);
+    if(spec.arg == LOG_ARG_NONE)
+    {
+      dst[len++] = '%';
+      continue;
+    }
+
+    for(i = 0; i < spec.stars; ++i)
+    {
+      memcpy(&star[i], src, sizeof(int));
+      src += sizeof(int);
+    }
+
+    /* rebuild the conversion with the * arguments filled in */
+    n = 0;
+    for(i = 0; start < p && n < sizeof(conv) - 16; ++start)
+    {
+      if(*start == '*')
+        n += sprintf(conv + n, "%d", star[i++]);
+      else
+        conv[n++] = *start;
+    }
+    conv[n] = 0;
+
+    if(spec.arg == LOG_ARG_DOUBLE)
+    {
+      memcpy(&real, src, sizeof(real));
+      src += sizeof(real);
+      rc = snprintf(dst + len, cap - len, conv, real);
+    }
+    else if(spec.arg == LOG_ARG_STRING)
+    {
+      memcpy(&slen, src, sizeof(slen));
+      src += sizeof(slen);
+
+      /* print exactly the stored bytes, keeping width and flags */
+      conv[n - 1] = 0;
+      if(strchr(conv, '.') != NULL)
+        *strchr(conv, '.') = 0;
+      strcat(conv, ".*s");
+      rc = snprintf(dst + len, cap - len, conv, (int)slen, src);
+      src += slen;
+    }
+    else
+    {
+      memcpy(&value, src, sizeof(value));
+      src += sizeof(value);
+
+      switch(spec.arg)
+      {
+        case LOG_ARG_INT:     rc = snprintf(dst + len, cap - len, conv, (int)value);       break;
+        case LOG_ARG_LONG:    rc = snprintf(dst + len, cap - len, conv, (long)value);      break;
+        case LOG_ARG_LLONG:   rc = snprintf(dst + len, cap - len, conv, (long long)value); break;
+        case LOG_ARG_INTMAX:  rc = snprintf(dst + len, cap - len, conv, (intmax_t)value);  break;
+        case LOG_ARG_SIZE:    rc = snprintf(dst + len, cap - len, conv, (size_t)value);    break;
+        case LOG_ARG_PTRDIFF: rc = snprintf(dst + len, cap - len, conv, (ptrdiff_t)value); break;
+        case LOG_ARG_POINTER: rc = snprintf(dst + len, cap - len, conv, (void*)(intptr_t)value); break;
+        default:              rc = 0;                                                      break;
+      }
+    }
+
+    if(rc > 0)
+      len += rc;
+    if(len > cap - 1)
+      len = cap - 1;
+  }
+
+  return len;
+}
+
+/*! write out everything
+ *
+ *  @param[in] buffer data to write
+ *  @param[in] len    length of data
+ */
+static void
+log_write(const char *buffer,
+          size_t     len)
+{
+  ssize_t rc;
+
+  while(len > 0)
+  {
+    rc = write(STDOUT_FILENO, buffer, len);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return;
+
+    buffer += rc;
+    len    -= rc;
+  }
+}
+
+/*! append a record to the transfer log, rotating it when it gets too big
+ *
+ *  @param[in] record record to append
+ *  @param[in] len    length of record
+ */
+static void
+log_xfer_write(const char *record,
+               size_t     len)
+{
+  char        from[4096], to[4096];
+  struct stat st;
+  int         i;
+
+  if(xferlog_fd >= 0 && xferlog_size + len > XFERLOG_SIZE)
+  {
+    close(xferlog_fd);
+    xferlog_fd = -1;
+
+    /* shift the old logs up, dropping the oldest */
+    for(i = XFERLOG_KEEP - 1; i > 0; --i)
+    {
+      snprintf(from, sizeof(from), "%s.%d", XFERLOG_PATH, i);
+      snprintf(to,   sizeof(to),   "%s.%d", XFERLOG_PATH, i + 1);
+      rename(from, to);
+    }
+
+    snprintf(to, sizeof(to), "%s.1", XFERLOG_PATH);
+    if(XFERLOG_KEEP > 0)
+      rename(XFERLOG_PATH, to);
+    else
+      unlink(XFERLOG_PATH);
+  }
+
+  if(xferlog_fd < 0)
+  {
+    xferlog_fd = open(XFERLOG_PATH, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if(xferlog_fd < 0)
+    {
+      fprintf(stderr, "open '%s': %d %s\n", XFERLOG_PATH, errno, strerror(errno));
+      return;
+    }
+
+    xferlog_size = 0;
+    if(fstat(xferlog_fd, &st) == 0)
+      xferlog_size = st.st_size;
+  }
+
+  while(len > 0)
+  {
+    ssize_t rc = write(xferlog_fd, record, len);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return;
+
+    record       += rc;
+    len          -= rc;
+    xferlog_size += rc;
+  }
+}
+
+/*! get this thread's ring
+ *
+ *  @returns ring or NULL for error
+ */
+static log_ring_t*
+log_ring(void)
+{
+  log_ring_t *r;
+
+  if(ring != NULL)
+    return ring;
+
+  r = (log_ring_t*)calloc(1, sizeof(log_ring_t));
+  if(r == NULL)
+    return NULL;
+
+  r->data = (char*)malloc(LOG_RING_SIZE);
+  if(r->data == NULL)
+  {
+    free(r);
+    return NULL;
+  }
+
+  /* publish to the flusher */
+  r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&rings, &r->next, r, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  ring = r;
+  return r;
+}
+
+/*! queue a record
+ *
+ *  @param[in] r     ring
+ *  @param[in] level log level
+ *  @param[in] type  record type
+ *  @param[in] data  record contents
+ *  @param[in] len   length of record contents
+ *
+ *  @note This never waits; a record that does not fit is dropped.
+ */
+static void
+log_push(log_ring_t  *r,
+         log_level_t level,
+         uint8_t     type,
+         const char  *data,
+         size_t      len)
+{
+  log_record_t record;
+  uint64_t     tail   = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  uint64_t     head   = r->head;
+  size_t       offset = head & (LOG_RING_SIZE - 1);
+  size_t       size   = (sizeof(record) + len + 7) & ~(size_t)7;
+  size_t       skip   = 0;
+
+  /* records don't wrap around the end of the ring */
+  if(offset + size > LOG_RING_SIZE)
+    skip = LOG_RING_SIZE - offset;
+
+  if(head + skip + size - tail > LOG_RING_SIZE)
+  {
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if(skip != 0)
+  {
+    record.size  = skip;
+    record.level = level;
+    record.type  = LOG_RECORD_WRAP;
+    record.pad   = 0;
+    memcpy(r->data + offset, &record, sizeof(record));
+    head  += skip;
+    offset = 0;
+  }
+
+  record.size  = size;
+  record.level = level;
+  record.type  = type;
+  record.pad   = size - sizeof(record) - len;
+  memcpy(r->data + offset, &record, sizeof(record));
+  memcpy(r->data + offset + sizeof(record), data, len);
+
+  __atomic_store_n(&r->head, head + size, __ATOMIC_RELEASE);
+}
+
+/*! write out the queued records of a ring
+ *
+ *  @param[in]    r      ring
+ *  @param[in]    out    output buffer
+ *  @param[inout] outlen bytes in output buffer
+ *
+ *  @returns whether anything was written
+ */
+static bool
+log_drain(log_ring_t *r,
+          char       *out,
+          size_t     *outlen)
+{
+  log_record_t record;
+  uint64_t     head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint64_t     tail = r->tail;
+  uint64_t     dropped;
+  const char   *data;
+  size_t       len;
+
+  if(head == tail)
+    return false;
+
+  while(tail != head)
+  {
+    memcpy(&record, r->data + (tail & (LOG_RING_SIZE - 1)), sizeof(record));
+    data = r->data + (tail & (LOG_RING_SIZE - 1)) + sizeof(record);
+    len  = record.size - sizeof(record) - record.pad;
+
+    if(record.type != LOG_RECORD_WRAP)
+    {
+      /* a message can be as big as the whole output buffer */
+      if(*outlen + LOG_MESSAGE_MAX > LOG_OUTPUT_SIZE)
+      {
+        log_write(out, *outlen);
+        *outlen = 0;
+      }
+
+      if(record.type == LOG_RECORD_ARGS)
+        *outlen += log_unpack(out + *outlen, LOG_MESSAGE_MAX, data);
+      else
+      {
+        memcpy(out + *outlen, data, len);
+        *outlen += len;
+      }
+    }
+
+    tail += record.size;
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  /* a lost message is worth mentioning */
+  dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  if(dropped != r->reported && *outlen + 64 <= LOG_OUTPUT_SIZE)
+  {
+    *outlen += sprintf(out + *outlen, "(%" PRIu64 " messages dropped)\n",
+                       dropped - r->reported);
+    r->reported = dropped;
+  }
+
+  return true;
+}
+
+/*! flusher thread
+ *
+ *  @param[in] arg unused
+ *
+ *  @returns NULL
+ */
+static void*
+log_flusher(void *arg)
+{
+  static char           out[LOG_OUTPUT_SIZE];
+  const struct timespec interval = { 0, LOG_FLUSH_INTERVAL * 1000000L };
+  size_t                outlen   = 0;
+  log_ring_t            *r;
+  bool                  busy, stop;
+
+  (void)arg;
+
+  for(;;)
+  {
+    /* look at the stop flag first so the final pass sees everything */
+    stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+    busy = false;
+    for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+      if(log_drain(r, out, &outlen))
+        busy = true;
+    }
+
+    if(outlen != 0)
+    {
+      log_write(out, outlen);
+      outlen = 0;
+    }
+
+    if(stop)
+      return NULL;
+
+    if(!busy)
+      nanosleep(&interval, NULL);
+  }
+}
+
+/*! transfer log writer thread
+ *
+ *  @param[in] arg unused
+ *
+ *  @returns NULL
+ */
+static void*
+log_xfer_writer(void *arg)
+{
+  char   *buffer;
+  size_t len, cap;
+  bool   stop;
+
+  (void)arg;
+
+  pthread_mutex_lock(&xfer_lock);
+  for(;;)
+  {
+    while(xfer_len == 0 && !xfer_stopping)
+      pthread_cond_wait(&xfer_cond, &xfer_lock);
+
+    /* take the whole queue so writers never wait for the disk */
+    stop       = xfer_stopping;
+    buffer     = xfer_queue;
+    len        = xfer_len;
+    cap        = xfer_cap;
+    xfer_queue = NULL;
+    xfer_len   = 0;
+    xfer_cap   = 0;
+    pthread_cond_broadcast(&xfer_taken);
+
+    /* keep records in order with those written without the queue */
+    pthread_mutex_lock(&xfer_write_lock);
+    pthread_mutex_unlock(&xfer_lock);
+
+    if(len != 0)
+      log_xfer_write(buffer, len);
+
+    pthread_mutex_unlock(&xfer_write_lock);
+    pthread_mutex_lock(&xfer_lock);
+
+    /* reuse the buffer unless a new one was started meanwhile */
+    if(xfer_queue == NULL)
+    {
+      xfer_queue = buffer;
+      xfer_cap   = cap;
+    }
+    else
+      free(buffer);
+
+    if(stop && xfer_len == 0)
+      break;
+  }
+  pthread_mutex_unlock(&xfer_lock);
+
+  return NULL;
+}
+
+/*! queue a message
+ *
+ *  @param[in] level log level
+ *  @param[in] fmt   format string
+ *  @param[in] ap    format arguments
+ */
+static void
+console_vlog(log_level_t level,
+             const char  *fmt,
+             va_list     ap)
+{
+  log_ring_t *r;
+  va_list    ap2;
+  unsigned   suppressed;
+  size_t     len;
+  int        rc;
+
+  if(level > LOG_LEVEL)
+    return;
+
+  r = log_ring();
+  if(r == NULL || !flushing)
+  {
+    /* no flusher to hand it to */
+    vprintf(fmt, ap);
+    return;
+  }
+
+  if(!console_limit(r->limits, level, fmt, &suppressed))
+    return;
+
+  if(suppressed != 0)
+  {
+    rc = sprintf(r->scratch, "(%u similar messages suppressed)\n", suppressed);
+    log_push(r, level, LOG_RECORD_TEXT, r->scratch, rc);
+  }
+
+  if(LOG_BINARY)
+  {
+    /* keep ap for the text fallback */
+    va_copy(ap2, ap);
+    len = log_pack(r->scratch, sizeof(r->scratch), fmt, ap2);
+    va_end(ap2);
+    if(len != 0)
+    {
+      log_push(r, level, LOG_RECORD_ARGS, r->scratch, len);
+      return;
+    }
+  }
+
+  rc = vsnprintf(r->scratch, sizeof(r->scratch), fmt, ap);
+  if(rc < 0)
+    return;
+
+  len = rc;
+  if(len >= sizeof(r->scratch))
+    len = sizeof(r->scratch) - 1;
+
+  log_push(r, level, LOG_RECORD_TEXT, r->scratch, len);
+}
 
 void
 console_init(void)
 {
+  int rc;
+
+  rc = pthread_create(&flusher, NULL, log_flusher, NULL);
+  if(rc != 0)
+  {
+    fprintf(stderr, "pthread_create: %d %s\n", rc, strerror(rc));
+    return;
+  }
+
+  flushing = true;
+
+  rc = pthread_create(&xfer_writer, NULL, log_xfer_writer, NULL);
+  if(rc != 0)
+  {
+    fprintf(stderr, "pthread_create: %d %s\n", rc, strerror(rc));
+    return;
+  }
+
+  xfer_running = true;
+}
+
+void
+console_exit(void)
+{
+  if(xfer_running)
+  {
+    /* write out the queued transfer log records */
+    pthread_mutex_lock(&xfer_lock);
+    xfer_stopping = true;
+    pthread_cond_signal(&xfer_cond);
+    pthread_mutex_unlock(&xfer_lock);
+
+    pthread_join(xfer_writer, NULL);
+    xfer_running  = false;
+    xfer_stopping = false;
+
+    free(xfer_queue);
+    xfer_queue = NULL;
+    xfer_cap   = 0;
+  }
+
+  if(!flushing)
+    return;
+
+  /* write out what is left */
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  pthread_join(flusher, NULL);
+  flushing = false;
+  stopping = false;
+}
+
+void
+console_xferlog(const char *record,
+                size_t     len)
+{
+  size_t cap;
+  char   *queue;
+
+  pthread_mutex_lock(&xfer_lock);
+  if(!xfer_running)
+  {
+    /* no writer to hand it to */
+    log_xfer_write(record, len);
+    pthread_mutex_unlock(&xfer_lock);
+    return;
+  }
+
+  /* the queue grows rather than lose a record */
+  if(xfer_len + len > xfer_cap)
+  {
+    cap = xfer_cap != 0 ? xfer_cap : 4096;
+    while(cap < xfer_len + len)
+      cap *= 2;
+
+    queue = (char*)realloc(xfer_queue, cap);
+    if(queue == NULL)
+    {
+      /* out of memory, so wait for the records before it and write it
+       * ourselves */
+      while(xfer_len != 0)
+        pthread_cond_wait(&xfer_taken, &xfer_lock);
+
+      pthread_mutex_lock(&xfer_write_lock);
+      pthread_mutex_unlock(&xfer_lock);
+      log_xfer_write(record, len);
+      pthread_mutex_unlock(&xfer_write_lock);
+      return;
+    }
+
+    xfer_queue = queue;
+    xfer_cap   = cap;
+  }
+
+  memcpy(xfer_queue + xfer_len, record, len);
+  xfer_len += len;
+
+  pthread_cond_signal(&xfer_cond);
+  pthread_mutex_unlock(&xfer_lock);
 }
 
 void
 console_set_status(const char *fmt, ...)
 {
   va_list ap;
+  char    buffer[256];
+
   va_start(ap, fmt);
-  vprintf(fmt, ap);
+  vsnprintf(buffer, sizeof(buffer), fmt, ap);
+  va_end(ap);
+  console_log(LOG_INFO, "%s\n", buffer);
+}
+
+void
+console_log(log_level_t level,
+            const char  *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  console_vlog(level, fmt, ap);
   va_end(ap);
-  fputc('\n', stdout);
 }
 
 void
@@ -254,7 +1343,7 @@ console_print(const char *fmt, ...)
 {
   va_list ap;
   va_start(ap, fmt);
-  vprintf(fmt, ap);
+  console_vlog(LOG_INFO, fmt, ap);
   va_end(ap);
 }
 
@@ -273,4 +1362,3 @@ void console_render(void)
 {
 }
 #endif
-
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <malloc.h>
 #include <math.h>
 #include <netinet/in.h>
@@ -23,6 +24,15 @@
 #include <sys/statvfs.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/fs.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#endif
 #ifdef _3DS
 #include <3ds.h>
 #define lstat stat
@@ -34,6 +44,9 @@
 #define BIT(x) (1<<(x))
 #endif
 #include "console.h"
+#include "hash.h"
+#include "hist.h"
+#include "probe.h"
 
 #define POLL_UNKNOWN    (~(POLLIN|POLLPRI|POLLOUT))
 
@@ -50,6 +63,206 @@
 #define CMD_BUFFERSIZE  4096
 #endif
 
+/*! bytes hashed per loop iteration before yielding to other sessions */
+#define HASH_QUANTUM    (8*XFER_BUFFERSIZE)
+
+/*! bytes copied per loop iteration by SITE CPTO before yielding */
+#define COPY_QUANTUM    (4*1024*1024)
+
+/*! directory entries removed per loop iteration by SITE RMTREE */
+#define RMTREE_QUANTUM  128
+
+/*! bytes a data transfer may move per loop iteration */
+#ifndef TRANSFER_QUANTUM
+#define TRANSFER_QUANTUM      (4*XFER_BUFFERSIZE)
+#endif
+
+/*! milliseconds a data transfer may run per loop iteration */
+#define TRANSFER_QUANTUM_TIME 5
+
+/*! quantums per loop iteration for file transfers and for listings */
+#define TRANSFER_WEIGHT_FILE  1
+#define TRANSFER_WEIGHT_LIST  4
+
+/*! bytes per second for all transfers together, 0 for unlimited */
+#ifndef RATE_GLOBAL
+#define RATE_GLOBAL     0
+#endif
+
+/*! bytes per second for the transfers of one client address, 0 for unlimited */
+#ifndef RATE_HOST
+#define RATE_HOST       0
+#endif
+
+/*! bytes per second for one session, 0 for unlimited */
+#ifndef RATE_SESSION
+#define RATE_SESSION    0
+#endif
+
+/*! milliseconds of traffic a rate limit lets through at once */
+#define RATE_BURST_TIME 100
+
+/*! milliseconds over which STAT measures the current transfer rate */
+#define RATE_SAMPLE_TIME 1000
+
+/*! idle file handles and stat results kept for reuse */
+#define FILE_CACHE_ENTRIES 64
+
+/*! milliseconds a cached stat result is trusted */
+#define FILE_CACHE_TTL     1000
+
+/*! milliseconds an unused file handle stays open */
+#define FILE_CACHE_IDLE    10000
+
+/*! bytes to keep requested from disk ahead of a file transfer */
+#define READAHEAD_WINDOW (4*1024*1024)
+
+/*! smallest and largest readahead window once the send rate is known */
+#define READAHEAD_MIN    (512*1024)
+#define READAHEAD_MAX    (64*1024*1024)
+
+/*! milliseconds of transfer a readahead window should cover */
+#define READAHEAD_TIME   1000
+
+/*! files at least this large drop pages behind the transfer */
+#define DROPBEHIND_SIZE  (256*1024*1024)
+
+/*! bytes sent between drops of the pages behind a transfer */
+#define DROPBEHIND_CHUNK (8*1024*1024)
+
+/*! durability of uploads before the 226 reply */
+#define SYNC_NONE       0 /*!< leave writeback to the OS */
+#define SYNC_CLOSE      1 /*!< fsync each upload */
+#define SYNC_GROUP      2 /*!< sync finished uploads in batches */
+#ifndef STORE_SYNC
+#define STORE_SYNC      SYNC_NONE
+#endif
+
+/*! whether STOR stages uploads and publishes them atomically when done */
+#ifndef STORE_ATOMIC
+#define STORE_ATOMIC    0
+#endif
+
+/*! milliseconds between group commits */
+#define GROUP_COMMIT_INTERVAL 50
+
+/*! bytes written between starting writeback of an upload, 0 to disable */
+#define WRITEBACK_CHUNK (8*1024*1024)
+
+/*! files at least this large are transferred with O_DIRECT, 0 to disable */
+#ifndef DIRECT_IO_SIZE
+#define DIRECT_IO_SIZE  0
+#endif
+
+/*! file offset, length and memory alignment for O_DIRECT */
+#define DIRECT_IO_ALIGN      4096
+
+/*! size of the aligned buffers used for O_DIRECT transfers */
+#define DIRECT_IO_BUFFERSIZE (1024*1024)
+
+/*! idle aligned buffers kept for reuse */
+#define DIRECT_IO_POOL       8
+
+/*! files at least this large are sent from a memory mapping, 0 to disable */
+#ifndef MMAP_SIZE
+#define MMAP_SIZE       0
+#endif
+
+/*! bytes of a file mapped at once, a multiple of MMAP_ALIGN */
+#define MMAP_WINDOW     (32*1024*1024)
+
+/*! file offset alignment of mapped windows, the size of a huge page */
+#define MMAP_ALIGN      (2*1024*1024)
+
+/*! whether RETR lends file data to the kernel with MSG_ZEROCOPY */
+#ifndef SEND_ZEROCOPY
+#define SEND_ZEROCOPY   0
+#endif
+
+/*! total bytes of small files kept in memory for RETR, 0 to disable */
+#ifndef CACHE_SIZE
+#define CACHE_SIZE      0
+#endif
+
+/*! largest file kept in memory for RETR */
+#ifndef CACHE_FILESIZE
+#define CACHE_FILESIZE  (256*1024)
+#endif
+
+/*! whether to hash uploads inline and keep the digest in an xattr */
+#ifndef STORE_HASH
+#ifdef __linux__
+#define STORE_HASH      1
+#else
+#define STORE_HASH      0
+#endif
+#endif
+
+/*! whether replies on the control connection skip Nagle's delay */
+#ifndef SOCK_NODELAY
+#define SOCK_NODELAY    1
+#endif
+
+/*! whether listings hold back partial segments until the next send */
+#ifndef SOCK_MORE
+#define SOCK_MORE       1
+#endif
+
+/*! whether data sockets leave buffer sizing to the kernel instead of
+ *  SOCK_BUFFERSIZE
+ */
+#ifndef SOCK_AUTOTUNE
+#ifdef __linux__
+#define SOCK_AUTOTUNE   1
+#else
+#define SOCK_AUTOTUNE   0
+#endif
+#endif
+
+/*! unsent bytes a data socket holds before it stops polling writable,
+ *  0 for the kernel default
+ */
+#ifndef SOCK_NOTSENT_LOWAT
+#define SOCK_NOTSENT_LOWAT 0
+#endif
+
+/*! congestion control for client connections, "" for the kernel default */
+#ifndef SOCK_CONGESTION
+#define SOCK_CONGESTION ""
+#endif
+
+/*! TCP Fast Open queue length of the listen socket, 0 to disable */
+#ifndef LISTEN_FASTOPEN
+#define LISTEN_FASTOPEN 0
+#endif
+
+/*! transfer log record format */
+#define XFERLOG_NONE    0 /*!< no transfer log */
+#define XFERLOG_WUFTPD  1 /*!< wu-ftpd xferlog lines, file transfers only */
+#define XFERLOG_JSON    2 /*!< JSON lines */
+#ifndef XFERLOG_FORMAT
+#define XFERLOG_FORMAT  XFERLOG_NONE
+#endif
+
+/*! port of the HTTP metrics endpoint, 0 to disable */
+#ifndef METRICS_PORT
+#define METRICS_PORT    0
+#endif
+
+/*! address the metrics endpoint listens on */
+#ifndef METRICS_ADDR
+#define METRICS_ADDR    INADDR_LOOPBACK
+#endif
+
+/*! metrics requests served at once */
+#define METRICS_CLIENTS 4
+
+/*! seconds a metrics request may take */
+#define METRICS_TIMEOUT 5
+
+/*! distinct command and reply code pairs counted for transfers */
+#define METRICS_TRANSFERS 64
+
 #ifdef _3DS
 #define SOCU_ALIGN      0x1000
 #define SOCU_BUFFERSIZE 0x100000
@@ -61,6 +274,40 @@
 #define DATA_PORT       0 /* ephemeral port */
 #endif
 
+/*! connections the listen socket queues until they are accepted */
+#ifndef LISTEN_BACKLOG
+#ifdef __linux__
+#define LISTEN_BACKLOG  128
+#else
+#define LISTEN_BACKLOG  5
+#endif
+#endif
+
+/*! connections accepted per loop iteration */
+#ifdef __linux__
+#define ACCEPT_BATCH    16
+#else
+#define ACCEPT_BATCH    1
+#endif
+
+/*! most sessions at once, 0 for unlimited */
+#ifndef MAX_SESSIONS
+#define MAX_SESSIONS    0
+#endif
+
+/*! most sessions from one client address, 0 for unlimited */
+#ifndef MAX_SESSIONS_PER_HOST
+#define MAX_SESSIONS_PER_HOST   0
+#endif
+
+/*! most sessions from one subnet, 0 for unlimited */
+#ifndef MAX_SESSIONS_PER_SUBNET
+#define MAX_SESSIONS_PER_SUBNET 0
+#endif
+
+/*! prefix length of the subnets for MAX_SESSIONS_PER_SUBNET */
+#define SUBNET_PREFIX   24
+
 typedef struct ftp_session_t ftp_session_t;
 
 #define FTP_DECLARE(x) static void x(ftp_session_t *session, const char *args)
@@ -71,6 +318,7 @@ FTP_DECLARE(CDUP);
 FTP_DECLARE(CWD);
 FTP_DECLARE(DELE);
 FTP_DECLARE(FEAT);
+FTP_DECLARE(HASH);
 FTP_DECLARE(HELP);
 FTP_DECLARE(LIST);
 FTP_DECLARE(MDTM);
@@ -86,11 +334,13 @@ FTP_DECLARE(PASV);
 FTP_DECLARE(PORT);
 FTP_DECLARE(PWD);
 FTP_DECLARE(QUIT);
+FTP_DECLARE(RANG);
 FTP_DECLARE(REST);
 FTP_DECLARE(RETR);
 FTP_DECLARE(RMD);
 FTP_DECLARE(RNFR);
 FTP_DECLARE(RNTO);
+FTP_DECLARE(SITE);
 FTP_DECLARE(SIZE);
 FTP_DECLARE(STAT);
 FTP_DECLARE(STOR);
@@ -99,6 +349,10 @@ FTP_DECLARE(STRU);
 FTP_DECLARE(SYST);
 FTP_DECLARE(TYPE);
 FTP_DECLARE(USER);
+FTP_DECLARE(XCRC);
+FTP_DECLARE(XMD5);
+FTP_DECLARE(XSHA1);
+FTP_DECLARE(XSHA256);
 
 /*! session state */
 typedef enum
@@ -125,6 +379,11 @@ typedef enum
   SESSION_SEND   = BIT(4), /*!< data transfer in sink mode */
   SESSION_RENAME = BIT(5), /*!< last command was RNFR and buffer contains path */
   SESSION_URGENT = BIT(6), /*!< in telnet urgent mode */
+  SESSION_XHASH  = BIT(7), /*!< hash was requested by XCRC/XMD5/XSHA* */
+  SESSION_HASHED = BIT(8), /*!< uploaded data is being hashed */
+  SESSION_COPY   = BIT(9), /*!< last command was SITE CPFR and buffer contains path */
+  SESSION_UNIQUE = BIT(10), /*!< data transfer is a STOU to xfer_path */
+  SESSION_ZEROCOPY = BIT(11), /*!< data transfer sends with MSG_ZEROCOPY */
 } session_flags_t;
 
 /*! ftp_xfer_dir mode */
@@ -144,8 +403,141 @@ typedef enum
   SESSION_MLST_MODIFY    = BIT(2),
   SESSION_MLST_PERM      = BIT(3),
   SESSION_MLST_UNIX_MODE = BIT(4),
+  SESSION_MLST_HASH      = BIT(5),
 } session_mlst_flags_t;
 
+/*! directory being removed by SITE RMTREE */
+typedef struct
+{
+  DIR    *dp;     /*!< open directory */
+  size_t pathlen; /*!< length of the directory's path in the session buffer */
+} ftp_tree_dir_t;
+
+/*! state of a SITE RMTREE */
+typedef struct
+{
+  ftp_tree_dir_t *dirs;     /*!< stack of open directories */
+  size_t         depth;     /*!< number of open directories */
+  size_t         capacity;  /*!< capacity of the stack */
+  uint64_t       files;     /*!< files removed so far */
+  uint64_t       removed;   /*!< directories removed so far */
+} ftp_tree_t;
+
+typedef struct ftp_cache_t ftp_cache_t;
+
+/*! contents of a small file kept in memory */
+struct ftp_cache_t
+{
+  char        *path;      /*!< path of the file */
+  char        *data;      /*!< file contents */
+  dev_t       dev;        /*!< device of the file */
+  ino_t       ino;        /*!< inode of the file */
+  off_t       size;       /*!< size of the file */
+  time_t      mtime;      /*!< modification time of the file */
+#ifdef __linux__
+  long        mtime_nsec; /*!< nanoseconds of the modification time */
+#endif
+  unsigned    refs;       /*!< number of sessions sending this file */
+  bool        stale;      /*!< removed from the cache while still in use */
+  ftp_cache_t *prev;      /*!< link to more recently used entry */
+  ftp_cache_t *next;      /*!< link to less recently used entry */
+};
+
+#ifdef __linux__
+typedef struct ftp_file_t ftp_file_t;
+
+/*! read-only file handle and metadata shared by sessions using the same path */
+struct ftp_file_t
+{
+  char        *path; /*!< path of the file */
+  int         fd;    /*!< file descriptor; read with pread only, -1 if not open */
+  struct stat st;    /*!< lstat data of path */
+  uint64_t    stamp; /*!< when st was taken, in monotonic milliseconds */
+  uint64_t    used;  /*!< when the entry was last used, in monotonic milliseconds */
+  unsigned    refs;  /*!< number of sessions using this handle */
+  bool        stale; /*!< removed from the list while still in use */
+  ftp_file_t  *next; /*!< link to next handle */
+};
+
+/*! byte range of an upload */
+typedef struct
+{
+  uint64_t start; /*!< first byte */
+  uint64_t end;   /*!< one past the last byte */
+} ftp_range_t;
+
+typedef struct ftp_upload_t ftp_upload_t;
+
+/*! write handle coordinating sessions that store segments of one file */
+struct ftp_upload_t
+{
+  char         *path;      /*!< path being stored */
+  int          fd;         /*!< file descriptor; written with pwrite */
+  bool         append;     /*!< private O_APPEND handle for APPE */
+  bool         prealloc;   /*!< space was reserved with fallocate */
+  bool         finalized;  /*!< the last writer has finished the file */
+  bool         atomic;     /*!< staged and published under path when done */
+  bool         unique;     /*!< publishing must not replace an existing file */
+  char         *tmppath;   /*!< hidden staging name, NULL for O_TMPFILE */
+  unsigned     refs;       /*!< number of sessions writing */
+  unsigned     segments;   /*!< number of sessions that have joined */
+  unsigned     received;   /*!< number of sessions that received their segment */
+  uint64_t     size;       /*!< expected size from ALLO, 0 if unknown */
+  ftp_range_t  *ranges;    /*!< completed ranges, sorted and merged */
+  size_t       num_ranges; /*!< number of completed ranges */
+  ftp_upload_t *next;      /*!< link to next upload */
+};
+#endif
+
+#ifdef __linux__
+/*! token bucket for a rate limit */
+typedef struct
+{
+  uint64_t rate;   /*!< bytes per second, 0 for unlimited */
+  uint64_t tokens; /*!< bytes that may be moved now */
+  uint64_t stamp;  /*!< when tokens were last added, in milliseconds */
+} ftp_bucket_t;
+
+typedef struct ftp_host_t ftp_host_t;
+
+/*! sessions connected from one client address */
+struct ftp_host_t
+{
+  struct in_addr addr;   /*!< client address */
+  unsigned       refs;   /*!< number of sessions */
+  ftp_bucket_t   bucket; /*!< rate limit shared by the sessions */
+  ftp_host_t     *next;  /*!< link to next host */
+};
+
+/*! metrics endpoint client */
+typedef struct
+{
+  int    fd;            /*!< socket, -1 for unused */
+  time_t timestamp;     /*!< when the client connected */
+  char   request[1024]; /*!< request received so far */
+  size_t reqlen;        /*!< length of request received so far */
+  char   *response;     /*!< response to send */
+  size_t resplen;       /*!< length of response */
+  size_t resppos;       /*!< bytes of response sent */
+} ftp_metrics_client_t;
+
+/*! number of transfers of a command that ended with a reply code */
+typedef struct
+{
+  const char *command; /*!< transfer command */
+  int        code;     /*!< final reply code */
+  uint64_t   count;    /*!< number of transfers */
+} ftp_transfer_count_t;
+
+/*! growable text buffer */
+typedef struct
+{
+  char   *data; /*!< contents */
+  size_t len;   /*!< length of contents */
+  size_t cap;   /*!< allocated size */
+} ftp_text_t;
+#endif
+
 /*! ftp session */
 struct ftp_session_t
 {
@@ -157,10 +549,12 @@ struct ftp_session_t
   int                  pasv_fd;    /*!< listen socket for PASV */
   int                  data_fd;    /*!< socket for data transfer */
   time_t               timestamp;  /*!< time from last command */
+  time_t               state_time; /*!< time the current state was entered */
   session_flags_t      flags;      /*!< session flags */
   xfer_dir_mode_t      dir_mode;   /*!< dir transfer mode */
   session_mlst_flags_t mlst_flags; /*!< session MLST flags */
   session_state_t      state;      /*!< session state */
+  hash_algo_t          hash_algo;  /*!< algorithm selected by OPTS HASH */
   ftp_session_t        *next;      /*!< link to next session */
   ftp_session_t        *prev;      /*!< link to prev session */
 
@@ -173,8 +567,55 @@ struct ftp_session_t
   size_t   cmd_buffersize;
   uint64_t filepos;                      /*! persistent file position between callbacks */
   uint64_t filesize;                     /*! persistent file size between callbacks */
+  uint64_t rangeend;                     /*! end of RANG byte range (exclusive), 0 for none */
+  uint64_t allocsize;                    /*! upload size hint from ALLO, 0 for none */
+  int64_t  deficit;                      /*! bytes the transfer may still move this round */
+  unsigned weight;                       /*! quantums the transfer gets per round */
+  hash_ctx_t hash;                       /*! persistent hash context between callbacks */
+  char     xfer_path[4096];              /*! path as requested for the current transfer */
   FILE     *fp;                          /*! persistent open file pointer between callbacks */
+  ftp_cache_t *cache;                    /*! cached file contents between callbacks */
+  int      copy_src;                     /*! source of SITE CPTO between callbacks */
+  int      copy_dst;                     /*! destination of SITE CPTO between callbacks */
+#ifdef __linux__
+  bool     copy_range;                   /*! copy_file_range works for this copy */
+  ftp_file_t *file;                      /*! shared read handle between callbacks */
+  ftp_upload_t *upload;                  /*! shared write handle between callbacks */
+  uint64_t uploadstart;                  /*! offset where this upload segment began */
+  uint64_t writeback;                    /*! end of upload data submitted for writeback */
+  uint64_t writeback_done;               /*! end of upload data known to be written back */
+  int      commit;                       /*! group commit state: 1 waiting, 0 durable, -1 failed */
+  uint64_t readahead;                    /*! end of readahead requested so far */
+  uint64_t readwindow;                   /*! readahead window scaled to the send rate */
+  uint64_t ratepos;                      /*! file position when the send rate was sampled */
+  uint64_t ratestamp;                    /*! when the send rate was sampled, in milliseconds */
+  uint64_t dropbehind;                   /*! end of pages dropped behind the transfer */
+  int      direct_fd;                    /*! private O_DIRECT descriptor, -1 for none */
+  char     *iobuf;                       /*! aligned transfer buffer for O_DIRECT */
+  char     *map;                         /*! mapped window of the file being sent */
+  uint64_t mapstart;                     /*! file offset of the mapped window */
+  size_t   maplen;                       /*! length of the mapped window */
+  uint32_t zc_sent;                      /*! MSG_ZEROCOPY sends made on the data socket */
+  uint32_t zc_done;                      /*! MSG_ZEROCOPY sends the kernel has released */
+  ftp_host_t *host;                      /*! sessions from the same client address */
+  struct in_addr client;                 /*! client address */
+  const char *account;                   /*! transfer command awaiting its log record, NULL for none */
+  char     account_path[4096];           /*! path of the logged transfer */
+  uint64_t account_start;                /*! when the logged transfer began, in milliseconds */
+  uint64_t account_offset;               /*! REST offset of the logged transfer */
+  uint64_t account_bytes;                /*! bytes moved by the logged transfer */
+  int      timed;                        /*! index in ftp_commands of the command being timed, -1 for none */
+  uint64_t timed_start;                  /*! when the timed command was parsed, in nanoseconds */
+  uint64_t timed_first;                  /*! when its first data byte moved, in nanoseconds, 0 for not yet */
+  uint64_t rate_start;                   /*! when the data transfer began, in milliseconds */
+  uint64_t rate_stamp;                   /*! when the transfer rate was sampled, in milliseconds */
+  uint64_t rate_bytes;                   /*! bytes moved when the transfer rate was sampled */
+  uint64_t rate;                         /*! transfer rate over the last sample, in bytes per second */
+  ftp_bucket_t bucket;                   /*! rate limit of this session */
+  uint64_t resume;                       /*! when a throttled transfer may continue */
+#endif
   DIR      *dp;                          /*! persistent open directory pointer between callbacks */
+  ftp_tree_t *tree;                      /*! persistent SITE RMTREE state between callbacks */
 };
 
 /*! ftp command descriptor */
@@ -198,6 +639,7 @@ static ftp_command_t ftp_commands[] =
   FTP_COMMAND(CWD),
   FTP_COMMAND(DELE),
   FTP_COMMAND(FEAT),
+  FTP_COMMAND(HASH),
   FTP_COMMAND(HELP),
   FTP_COMMAND(LIST),
   FTP_COMMAND(MDTM),
@@ -213,11 +655,13 @@ static ftp_command_t ftp_commands[] =
   FTP_COMMAND(PORT),
   FTP_COMMAND(PWD),
   FTP_COMMAND(QUIT),
+  FTP_COMMAND(RANG),
   FTP_COMMAND(REST),
   FTP_COMMAND(RETR),
   FTP_COMMAND(RMD),
   FTP_COMMAND(RNFR),
   FTP_COMMAND(RNTO),
+  FTP_COMMAND(SITE),
   FTP_COMMAND(SIZE),
   FTP_COMMAND(STAT),
   FTP_COMMAND(STOR),
@@ -226,15 +670,42 @@ static ftp_command_t ftp_commands[] =
   FTP_COMMAND(SYST),
   FTP_COMMAND(TYPE),
   FTP_COMMAND(USER),
+  FTP_COMMAND(XCRC),
   FTP_ALIAS(XCUP, CDUP),
   FTP_ALIAS(XCWD, CWD),
+  FTP_COMMAND(XMD5),
   FTP_ALIAS(XMKD, MKD),
   FTP_ALIAS(XPWD, PWD),
   FTP_ALIAS(XRMD, RMD),
+  FTP_COMMAND(XSHA1),
+  FTP_COMMAND(XSHA256),
 };
 /*! number of ftp commands */
 static const size_t num_ftp_commands = sizeof(ftp_commands)/sizeof(ftp_commands[0]);
 
+#define SITE_DECLARE(x) static void SITE_##x(ftp_session_t *session, const char *args)
+SITE_DECLARE(ALLO);
+SITE_DECLARE(CPFR);
+SITE_DECLARE(CPTO);
+SITE_DECLARE(HELP);
+SITE_DECLARE(RMTREE);
+SITE_DECLARE(STATS);
+
+/*! site command list */
+static ftp_command_t site_commands[] =
+{
+/*! site command */
+#define SITE_COMMAND(x) { #x, SITE_##x, }
+  SITE_COMMAND(ALLO),
+  SITE_COMMAND(CPFR),
+  SITE_COMMAND(CPTO),
+  SITE_COMMAND(HELP),
+  SITE_COMMAND(RMTREE),
+  SITE_COMMAND(STATS),
+};
+/*! number of site commands */
+static const size_t num_site_commands = sizeof(site_commands)/sizeof(site_commands[0]);
+
 static void update_free_space(void);
 
 /*! compare ftp command descriptors
@@ -282,6 +753,68 @@ static in_port_t          data_port = DATA_PORT;
 #endif
 /*! list of ftp sessions */
 static ftp_session_t      *sessions = NULL;
+/*! number of sessions */
+static unsigned           num_sessions = 0;
+/*! most sessions at once */
+static unsigned           peak_sessions = 0;
+/*! connections accepted */
+static uint64_t           sessions_accepted = 0;
+/*! connections turned away because the server was full */
+static uint64_t           rejected_full = 0;
+/*! connections turned away by MAX_SESSIONS_PER_HOST */
+static uint64_t           rejected_host = 0;
+/*! connections turned away by MAX_SESSIONS_PER_SUBNET */
+static uint64_t           rejected_subnet = 0;
+#ifdef __linux__
+/*! list of shared read handles and stat results */
+static ftp_file_t         *files = NULL;
+/*! number of entries in the files list */
+static size_t             num_files = 0;
+/*! list of uploads in progress */
+static ftp_upload_t       *uploads = NULL;
+/*! time of the last group commit, in monotonic milliseconds */
+static uint64_t           commit_stamp = 0;
+/*! client addresses with sessions */
+static ftp_host_t         *hosts = NULL;
+/*! rate limit of all transfers */
+static ftp_bucket_t       global_bucket;
+/*! pacing rate of data sockets, 0 for none */
+static unsigned int       pacing_rate = 0;
+/*! idle aligned buffers for O_DIRECT transfers */
+static char               *pool[DIRECT_IO_POOL];
+/*! number of idle aligned buffers */
+static size_t             pool_count = 0;
+/*! metrics endpoint listen socket */
+static int                metrics_fd = -1;
+/*! metrics endpoint clients */
+static ftp_metrics_client_t metrics_clients[METRICS_CLIENTS];
+/*! bytes received by transfers */
+static uint64_t           bytes_in = 0;
+/*! bytes sent by transfers */
+static uint64_t           bytes_out = 0;
+/*! directory entries sent by listings */
+static uint64_t           listing_entries = 0;
+/*! finished transfers by command and reply code */
+static ftp_transfer_count_t transfer_counts[METRICS_TRANSFERS];
+/*! number of transfer_counts in use */
+static size_t             num_transfer_counts = 0;
+/*! microseconds from parsing each command to its final reply */
+static hist_t             command_latency[sizeof(ftp_commands)/sizeof(ftp_commands[0])];
+/*! microseconds from parsing each transfer command to its first data byte */
+static hist_t             transfer_ttfb[sizeof(ftp_commands)/sizeof(ftp_commands[0])];
+/*! microseconds from the first data byte of each transfer command to its final reply */
+static hist_t             transfer_time[sizeof(ftp_commands)/sizeof(ftp_commands[0])];
+#endif
+/*! cached files, most recently used first */
+static ftp_cache_t        *cache_head = NULL;
+/*! least recently used cached file */
+static ftp_cache_t        *cache_tail = NULL;
+/*! bytes of cached file contents */
+static uint64_t           cache_bytes = 0;
+/*! RETRs served from the cache */
+static uint64_t           cache_hits = 0;
+/*! RETRs of cacheable files that had to be loaded */
+static uint64_t           cache_misses = 0;
 /*! socket buffersize */
 static int                sock_buffersize = SOCK_BUFFERSIZE;
 /*! server start time */
@@ -318,7 +851,7 @@ ftp_set_socket_nonblocking(int fd)
   flags = fcntl(fd, F_GETFL, 0);
   if(flags == -1)
   {
-    console_print(RED "fcntl: %d %s\n" RESET, errno, strerror(errno));
+    console_error(RED "fcntl: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
 
@@ -326,13 +859,56 @@ ftp_set_socket_nonblocking(int fd)
   rc = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
   if(rc != 0)
   {
-    console_print(RED "fcntl: %d %s\n" RESET, errno, strerror(errno));
+    console_error(RED "fcntl: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
 
   return 0;
 }
 
+#ifdef __linux__
+/*! set the congestion control of a socket
+ *
+ *  @param[in] fd socket
+ *
+ *  @note Connections accepted from a listen socket inherit its setting.
+ */
+static void
+ftp_set_socket_congestion(int fd)
+{
+  int rc;
+
+  if(strlen(SOCK_CONGESTION) == 0)
+    return;
+
+  rc = setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+                  SOCK_CONGESTION, strlen(SOCK_CONGESTION));
+  if(rc != 0)
+    console_warn(YELLOW "setsockopt: TCP_CONGESTION %s %d %s\n" RESET,
+                 SOCK_CONGESTION, errno, strerror(errno));
+}
+#endif
+
+/*! set control socket options
+ *
+ *  @param[in] fd socket
+ */
+static void
+ftp_set_cmd_socket_options(int fd)
+{
+#ifdef __linux__
+  int rc, yes = 1;
+
+  /* replies are whole lines, so send them right away */
+  if(SOCK_NODELAY)
+  {
+    rc = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if(rc != 0)
+      console_warn(YELLOW "setsockopt: TCP_NODELAY %d %s\n" RESET, errno, strerror(errno));
+  }
+#endif
+}
+
 /*! set socket options
  *
  *  @param[in] fd socket
@@ -344,24 +920,54 @@ ftp_set_socket_options(int fd)
 {
   int rc;
 
-  /* increase receive buffer size */
-  rc = setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
-                  &sock_buffersize, sizeof(sock_buffersize));
-  if(rc != 0)
+#ifdef __linux__
+  if(!SOCK_AUTOTUNE)
+#endif
   {
-    console_print(RED "setsockopt: SO_RCVBUF %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    /* increase receive buffer size */
+    rc = setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                    &sock_buffersize, sizeof(sock_buffersize));
+    if(rc != 0)
+    {
+      console_error(RED "setsockopt: SO_RCVBUF %d %s\n" RESET, errno, strerror(errno));
+      return -1;
+    }
+
+    /* increase send buffer size */
+    rc = setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                    &sock_buffersize, sizeof(sock_buffersize));
+    if(rc != 0)
+    {
+      console_error(RED "setsockopt: SO_SNDBUF %d %s\n" RESET, errno, strerror(errno));
+      return -1;
+    }
   }
 
-  /* increase send buffer size */
-  rc = setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
-                  &sock_buffersize, sizeof(sock_buffersize));
-  if(rc != 0)
+#ifdef __linux__
+  /* don't let unsent data pile up behind the congestion window */
+  if(SOCK_NOTSENT_LOWAT != 0)
   {
-    console_print(RED "setsockopt: SO_SNDBUF %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    int lowat = SOCK_NOTSENT_LOWAT;
+
+    rc = setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    if(rc != 0)
+      console_warn(YELLOW "setsockopt: TCP_NOTSENT_LOWAT %d %s\n" RESET, errno, strerror(errno));
   }
 
+  ftp_set_socket_congestion(fd);
+#endif
+
+#if defined(__linux__) && defined(SO_MAX_PACING_RATE)
+  /* let the kernel pace sends to the rate limit instead of bursting */
+  if(pacing_rate != 0)
+  {
+    rc = setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                    &pacing_rate, sizeof(pacing_rate));
+    if(rc != 0)
+      console_warn(YELLOW "setsockopt: SO_MAX_PACING_RATE %d %s\n" RESET, errno, strerror(errno));
+  }
+#endif
+
   return 0;
 }
 
@@ -387,17 +993,17 @@ ftp_closesocket(int  fd,
     rc = getpeername(fd, (struct sockaddr*)&addr, &addrlen);
     if(rc != 0)
     {
-      console_print(RED "getpeername: %d %s\n" RESET, errno, strerror(errno));
-      console_print(YELLOW "closing connection to fd=%d\n" RESET, fd);
+      console_error(RED "getpeername: %d %s\n" RESET, errno, strerror(errno));
+      console_warn(YELLOW "closing connection to fd=%d\n" RESET, fd);
     }
     else
-      console_print(YELLOW "closing connection to %s:%u\n" RESET,
-                    inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+      console_warn(YELLOW "closing connection to %s:%u\n" RESET,
+                   inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
 
     /* shutdown connection */
     rc = shutdown(fd, SHUT_WR);
     if(rc != 0)
-      console_print(RED "shutdown: %d %s\n" RESET, errno, strerror(errno));
+      console_error(RED "shutdown: %d %s\n" RESET, errno, strerror(errno));
 
     /* wait for client to close connection */
     pollinfo.fd      = fd;
@@ -405,7 +1011,7 @@ ftp_closesocket(int  fd,
     pollinfo.revents = 0;
     rc = poll(&pollinfo, 1, 250);
     if(rc < 0)
-      console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
+      console_error(RED "poll: %d %s\n" RESET, errno, strerror(errno));
   }
 
   /* set linger to 0 */
@@ -415,13 +1021,13 @@ ftp_closesocket(int  fd,
   rc = setsockopt(fd, SOL_SOCKET, SO_LINGER,
                   &linger, sizeof(linger));
   if(rc != 0)
-    console_print(RED "setsockopt: SO_LINGER %d %s\n" RESET,
+    console_error(RED "setsockopt: SO_LINGER %d %s\n" RESET,
                   errno, strerror(errno));
 
   /* close socket */
   rc = close(fd);
   if(rc != 0)
-    console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+    console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
 }
 
 /*! close command socket on ftp session
@@ -447,9 +1053,9 @@ ftp_session_close_pasv(ftp_session_t *session)
   /* close pasv socket */
   if(session->pasv_fd >= 0)
   {
-    console_print(YELLOW "stop listening on %s:%u\n" RESET,
-                  inet_ntoa(session->pasv_addr.sin_addr),
-                  ntohs(session->pasv_addr.sin_port));
+    console_warn(YELLOW "stop listening on %s:%u\n" RESET,
+                 inet_ntoa(session->pasv_addr.sin_addr),
+                 ntohs(session->pasv_addr.sin_port));
 
     ftp_closesocket(session->pasv_fd, false);
   }
@@ -473,3375 +1079,7958 @@ ftp_session_close_data(ftp_session_t *session)
   session->flags &= ~(SESSION_RECV|SESSION_SEND);
 }
 
-/*! close open file for ftp session
+#ifdef __linux__
+/*! get monotonic time
  *
- *  @param[in] session ftp session
+ *  @returns milliseconds
+ */
+static uint64_t
+ftp_file_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*! get the current monotonic time with full resolution
+ *
+ *  @returns nanoseconds
+ */
+static uint64_t
+ftp_clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*! free a file handle
+ *
+ *  @param[in] file file handle
  */
 static void
-ftp_session_close_file(ftp_session_t *session)
+ftp_file_free(ftp_file_t *file)
 {
-  int rc;
+  if(file->fd >= 0 && close(file->fd) != 0)
+    console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
+  free(file->path);
+  free(file);
+}
 
-  if(session->fp != NULL)
+/*! remove a file handle from the list
+ *
+ *  @param[in] file file handle
+ *
+ *  @note The handle is freed once the last session using it is done.
+ */
+static void
+ftp_file_remove(ftp_file_t *file)
+{
+  ftp_file_t **p;
+
+  /* unlink from the handle list */
+  for(p = &files; *p != file; p = &(*p)->next)
+    ;
+  *p = file->next;
+  --num_files;
+
+  if(file->refs == 0)
+    ftp_file_free(file);
+  else
+    file->stale = true;
+}
+
+/*! drop least recently used idle handles
+ *
+ *  @param[in] max number of entries to keep
+ */
+static void
+ftp_file_trim(size_t max)
+{
+  ftp_file_t *file, *victim;
+
+  while(num_files > max)
   {
-    rc = fclose(session->fp);
-    if(rc != 0)
-      console_print(RED "fclose: %d %s\n" RESET, errno, strerror(errno));
+    victim = NULL;
+    for(file = files; file != NULL; file = file->next)
+    {
+      if(file->refs == 0 && (victim == NULL || file->used < victim->used))
+        victim = file;
+    }
+
+    if(victim == NULL)
+      return;
+
+    ftp_file_remove(victim);
   }
+}
 
-  session->fp      = NULL;
-  session->filepos = 0;
+/*! drop handles that have not been used for a while
+ *
+ *  @note Keeps idle descriptors from pinning files deleted behind our back.
+ */
+static void
+ftp_file_expire(void)
+{
+  static uint64_t last = 0;
+  ftp_file_t      *file, *next;
+  uint64_t        now = ftp_file_now();
+
+  /* don't walk the list on every loop iteration */
+  if(now - last < FILE_CACHE_TTL)
+    return;
+  last = now;
+
+  for(file = files; file != NULL; file = next)
+  {
+    next = file->next;
+    if(file->refs == 0 && now - file->used >= FILE_CACHE_IDLE)
+      ftp_file_remove(file);
+  }
 }
 
-/*! open file for reading for ftp session
+/*! look up the handle of a path, refreshing its stat data when it is old
  *
- *  @param[in] session ftp session
+ *  @param[in] path path to look up
  *
- *  @returns -1 for error
+ *  @returns file handle or NULL with errno set
  */
-static int
-ftp_session_open_file_read(ftp_session_t *session)
+static ftp_file_t*
+ftp_file_lookup(const char *path)
 {
-  int         rc;
+  ftp_file_t  *file;
   struct stat st;
+  uint64_t    now = ftp_file_now();
+  int         rc;
 
-  /* open file in read mode */
-  session->fp = fopen(session->buffer, "rb");
-  if(session->fp == NULL)
+  for(file = files; file != NULL; file = file->next)
   {
-    console_print(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    return -1;
+    if(strcmp(file->path, path) == 0)
+      break;
   }
 
-  /* it's okay if this fails */
-  errno = 0;
-  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
-  if(rc != 0)
+  if(file != NULL && now - file->stamp < FILE_CACHE_TTL)
   {
-    console_print(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+    file->used = now;
+    return file;
   }
 
-  /* get the file size */
-  rc = fstat(fileno(session->fp), &st);
-  if(rc != 0)
+  if(lstat(path, &st) != 0)
   {
-    console_print(RED "fstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    return -1;
+    rc = errno;
+    if(file != NULL)
+      ftp_file_remove(file);
+    errno = rc;
+    return NULL;
   }
-  session->filesize = st.st_size;
 
-  if(session->filepos != 0)
+  /* the path now names another file */
+  if(file != NULL && (file->st.st_dev != st.st_dev || file->st.st_ino != st.st_ino))
   {
-    rc = fseek(session->fp, session->filepos, SEEK_SET);
-    if(rc != 0)
+    if(file->refs != 0)
+      ftp_file_remove(file);
+    else
     {
-      console_print(RED "fseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-      return -1;
+      if(file->fd >= 0 && close(file->fd) != 0)
+        console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
+      file->fd = -1;
     }
   }
 
-  return 0;
-}
+  if(file == NULL || file->stale)
+  {
+    ftp_file_trim(FILE_CACHE_ENTRIES - 1);
 
-/*! read from an open file for ftp session
- *
- *  @param[in] session ftp session
- *
- *  @returns bytes read
- */
-static ssize_t
-ftp_session_read_file(ftp_session_t *session)
-{
-  ssize_t rc;
+    file = (ftp_file_t*)calloc(1, sizeof(ftp_file_t));
+    if(file == NULL)
+    {
+      console_error(RED "failed to allocate file handle\n" RESET);
+      errno = ENOMEM;
+      return NULL;
+    }
 
-  /* read file at current position */
-  rc = fread(session->buffer, 1, sizeof(session->buffer), session->fp);
-  if(rc < 0)
-  {
-    console_print(RED "fread: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
-  }
+    file->path = strdup(path);
+    if(file->path == NULL)
+    {
+      console_error(RED "failed to allocate file handle\n" RESET);
+      free(file);
+      errno = ENOMEM;
+      return NULL;
+    }
+    file->fd = -1;
 
-  /* adjust file position */
-  session->filepos += rc;
+    /* link to the handle list */
+    file->next = files;
+    files      = file;
+    ++num_files;
+  }
 
-  return rc;
+  file->st    = st;
+  file->stamp = now;
+  file->used  = now;
+  return file;
 }
 
-/*! open file for writing for ftp session
+/*! get a shared read handle
  *
- *  @param[in] session ftp session
- *  @param[in] append  whether to append
+ *  @param[in] path path to open
  *
- *  @returns -1 for error
+ *  @returns shared handle or NULL for error
  *
- *  @note truncates file
+ *  @note Symbolic links get a private handle so that a retargeted link is
+ *        never served from a descriptor of its old target. The stat data of
+ *        the handle is refreshed from the descriptor, so it describes the
+ *        file that will be read even if it changed within FILE_CACHE_TTL.
  */
-static int
-ftp_session_open_file_write(ftp_session_t *session,
-                            bool          append)
+static ftp_file_t*
+ftp_file_get(const char *path)
 {
-  int        rc;
-  const char *mode = "wb";
+  ftp_file_t  *file;
+  struct stat st;
+  int         fd, rc;
 
-  if(append)
-    mode = "ab";
-  else if(session->filepos != 0)
-    mode = "r+b";
+  file = ftp_file_lookup(path);
+  if(file == NULL)
+  {
+    console_error(RED "lstat '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    return NULL;
+  }
 
-  /* open file in write mode */
-  session->fp = fopen(session->buffer, mode);
-  if(session->fp == NULL)
+  if(file->fd >= 0)
   {
-    console_print(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    return -1;
+    /* it may have been rewritten in place since it was looked at */
+    if(fstat(file->fd, &st) != 0)
+    {
+      console_error(RED "fstat '%s': %d %s\n" RESET, path, errno, strerror(errno));
+      return NULL;
+    }
+
+    file->st = st;
+    ++file->refs;
+    return file;
   }
 
-  update_free_space();
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+  {
+    console_error(RED "open '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    return NULL;
+  }
 
-  /* it's okay if this fails */
-  errno = 0;
-  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
-  if(rc != 0)
+  if(fstat(fd, &st) != 0)
   {
-    console_print(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+    console_error(RED "fstat '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    close(fd);
+    return NULL;
   }
 
-  /* check if this had REST but not APPE */
-  if(session->filepos != 0 && !append)
+  /* transfers read front to back; let the kernel read ahead further */
+  rc = posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if(rc != 0)
+    console_error(RED "posix_fadvise: %d %s\n" RESET, rc, strerror(rc));
+
+  if(S_ISLNK(file->st.st_mode))
   {
-    /* seek to the REST offset */
-    rc = fseek(session->fp, session->filepos, SEEK_SET);
-    if(rc != 0)
+    file = (ftp_file_t*)calloc(1, sizeof(ftp_file_t));
+    if(file == NULL)
     {
-      console_print(RED "fseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-      return -1;
+      console_error(RED "failed to allocate file handle\n" RESET);
+      close(fd);
+      return NULL;
     }
+    file->stale = true;
   }
 
-  return 0;
+  /* describe the file that was opened, not the one that was looked at */
+  file->st = st;
+  file->fd = fd;
+  ++file->refs;
+  return file;
 }
 
-/*! write to an open file for ftp session
+/*! release a shared read handle
  *
- *  @param[in] session ftp session
+ *  @param[in] file shared handle
  *
- *  @returns bytes written
+ *  @note Idle handles stay open for the next session that wants the file.
  */
-static ssize_t
-ftp_session_write_file(ftp_session_t *session)
+static void
+ftp_file_put(ftp_file_t *file)
 {
-  ssize_t rc;
+  if(--file->refs != 0)
+    return;
 
-  /* write to file at current position */
-  rc = fwrite(session->buffer + session->bufferpos,
-              1, session->buffersize - session->bufferpos,
-              session->fp);
-  if(rc < 0)
-  {
-    console_print(RED "fwrite: %d %s\n" RESET, errno, strerror(errno));
+  if(file->stale)
+    ftp_file_free(file);
+  else
+    ftp_file_trim(FILE_CACHE_ENTRIES);
+}
+#endif
+
+/*! get file status through the shared metadata cache
+ *
+ *  @param[in]  path   path to stat
+ *  @param[out] st     stat data
+ *  @param[in]  follow whether to follow a symbolic link
+ *
+ *  @returns -1 for error
+ *
+ *  @note Results are reused for FILE_CACHE_TTL milliseconds unless the path
+ *        is changed through this server, which invalidates them.
+ */
+static int
+ftp_file_stat(const char  *path,
+              struct stat *st,
+              bool        follow)
+{
+#ifdef __linux__
+  ftp_file_t *file;
+
+  file = ftp_file_lookup(path);
+  if(file == NULL)
     return -1;
-  }
-  else if(rc == 0)
-    console_print(RED "fwrite: wrote 0 bytes\n" RESET);
 
-  /* adjust file position */
-  session->filepos += rc;
+  if(follow && S_ISLNK(file->st.st_mode))
+    return stat(path, st);
 
-  update_free_space();
-  return rc;
+  *st = file->st;
+  return 0;
+#else
+  if(follow)
+    return stat(path, st);
+  return lstat(path, st);
+#endif
 }
 
-/*! close current working directory for ftp session
+/*! forget cached handles and metadata of a path and everything below it
  *
- *   @param[in] session ftp session
+ *  @param[in] path path that changed
  */
 static void
-ftp_session_close_cwd(ftp_session_t *session)
+ftp_file_invalidate(const char *path)
 {
-  int rc;
+#ifdef __linux__
+  ftp_file_t *file, *next;
+  size_t     len = strlen(path);
 
-  /* close open directory pointer */
-  if(session->dp != NULL)
+  for(file = files; file != NULL; file = next)
   {
-    rc = closedir(session->dp);
-    if(rc != 0)
-      console_print(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
+    next = file->next;
+    if(strncmp(file->path, path, len) == 0
+    && (file->path[len] == 0 || file->path[len] == '/'))
+      ftp_file_remove(file);
   }
-  session->dp = NULL;
+#endif
 }
 
-/*! open current working directory for ftp session
+#ifdef __linux__
+/*! hint the kernel to read ahead of a file transfer
  *
  *  @param[in] session ftp session
  *
- *  @return -1 for failure
+ *  @note Each session keeps its own window, so concurrent segments of one
+ *        file each get their range brought in even though they share a
+ *        descriptor. The window covers about READAHEAD_TIME of the measured
+ *        send rate, so slow clients don't hold pages they won't need for
+ *        minutes and fast ones don't stall on the disk.
  */
-static int
-ftp_session_open_cwd(ftp_session_t *session)
+static void
+ftp_session_readahead(ftp_session_t *session)
 {
-  /* open current working directory */
-  session->dp = opendir(session->cwd);
-  if(session->dp == NULL)
+  uint64_t start, end, rate;
+  uint64_t now = ftp_file_now();
+  int      rc;
+
+  /* sample the send rate a few times per window */
+  if(now - session->ratestamp >= READAHEAD_TIME/4)
   {
-    console_print(RED "opendir '%s': %d %s\n" RESET, session->cwd, errno, strerror(errno));
-    return -1;
+    if(session->ratestamp != 0)
+    {
+      rate = (session->filepos - session->ratepos) * 1000 / (now - session->ratestamp);
+
+      session->readwindow = rate * READAHEAD_TIME / 1000;
+      if(session->readwindow < READAHEAD_MIN)
+        session->readwindow = READAHEAD_MIN;
+      else if(session->readwindow > READAHEAD_MAX)
+        session->readwindow = READAHEAD_MAX;
+    }
+
+    session->ratepos   = session->filepos;
+    session->ratestamp = now;
   }
 
-  return 0;
+  /* drop what we sent of very large files unless someone else is reading */
+  if(session->filesize >= DROPBEHIND_SIZE && session->file->refs == 1
+  && session->filepos >= session->dropbehind + DROPBEHIND_CHUNK)
+  {
+    rc = posix_fadvise(session->file->fd, session->dropbehind,
+                       session->filepos - session->dropbehind, POSIX_FADV_DONTNEED);
+    if(rc != 0)
+      console_error(RED "posix_fadvise: %d %s\n" RESET, rc, strerror(rc));
+
+    session->dropbehind = session->filepos;
+  }
+
+  /* keep at least half a window in flight */
+  if(session->readahead >= session->filepos + session->readwindow/2)
+    return;
+
+  start = session->readahead;
+  if(start < session->filepos)
+    start = session->filepos;
+
+  end = session->filepos + session->readwindow;
+  if(session->rangeend != 0 && end > session->rangeend)
+    end = session->rangeend;
+  if(end > session->filesize)
+    end = session->filesize;
+  if(end <= start)
+    return;
+
+  rc = posix_fadvise(session->file->fd, start, end - start, POSIX_FADV_WILLNEED);
+  if(rc != 0)
+    console_error(RED "posix_fadvise: %d %s\n" RESET, rc, strerror(rc));
+
+  session->readahead = end;
 }
 
-/*! set state for ftp session
+/*! map the window of a file transfer that holds the current position
  *
  *  @param[in] session ftp session
- *  @param[in] state   state to set
- *  @param[in] flags   flags
+ *
+ *  @returns -1 for error
+ *
+ *  @note Windows start on a huge page boundary so that the kernel can back
+ *        them with huge pages where the filesystem supports it. Pages are
+ *        not populated up front; ftp_session_readahead keeps them coming
+ *        in at the send rate instead of stalling the loop on the disk.
  */
-static void
-ftp_session_set_state(ftp_session_t     *session,
-                      session_state_t   state,
-                      set_state_flags_t flags)
+static int
+ftp_session_map(ftp_session_t *session)
 {
-  session->state = state;
+  uint64_t start;
+  size_t   len;
 
-  /* close pasv and data sockets */
-  if(flags & CLOSE_PASV)
-    ftp_session_close_pasv(session);
-  if(flags & CLOSE_DATA)
-    ftp_session_close_data(session);
+  if(session->map != NULL
+  && session->filepos >= session->mapstart
+  && session->filepos <  session->mapstart + session->maplen)
+    return 0;
 
-  if(state == COMMAND_STATE)
+  if(session->map != NULL && munmap(session->map, session->maplen) != 0)
+    console_error(RED "munmap: %d %s\n" RESET, errno, strerror(errno));
+  session->map = NULL;
+
+  start = session->filepos & ~(uint64_t)(MMAP_ALIGN - 1);
+  len   = MMAP_WINDOW;
+  if(session->filesize - start < len)
+    len = session->filesize - start;
+
+  session->map = (char*)mmap(NULL, len, PROT_READ, MAP_SHARED, session->file->fd, start);
+  if(session->map == MAP_FAILED)
   {
-    /* close file/cwd */
-    ftp_session_close_file(session);
-    ftp_session_close_cwd(session);
+    console_error(RED "mmap: %d %s\n" RESET, errno, strerror(errno));
+    session->map = NULL;
+    return -1;
   }
+
+  session->mapstart = start;
+  session->maplen   = len;
+
+  /* these are only hints */
+  madvise(session->map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(session->map, len, MADV_HUGEPAGE);
+#endif
+
+  return 0;
 }
 
-/*! fill directory entry
+/*! read MSG_ZEROCOPY completions from the data socket error queue
  *
  *  @param[in] session ftp session
- *  @param[in] st      stat data
- *  @param[in] path    path to fill
- *  @param[in] len     path length
- *  @param[in] type    type fact
  *
- *  @returns errno
+ *  @returns -1 if the socket has a real error pending
+ *
+ *  @note When the kernel had to copy the data after all, as it does over
+ *        loopback or to devices without scatter-gather, the rest of the
+ *        transfer goes back to plain sends, which are cheaper then.
  */
 static int
-ftp_session_fill_dirent_type(ftp_session_t *session, const struct stat *st,
-                             const char *path, size_t len, const char *type)
+ftp_session_zerocopy_reap(ftp_session_t *session)
 {
-  session->buffersize = 0;
+  char                     control[128];
+  struct msghdr            msg;
+  struct cmsghdr           *cm;
+  struct sock_extended_err *serr;
+  int                      err = 0;
+  socklen_t                len = sizeof(err);
 
-  if(session->dir_mode == XFER_DIR_MLSD
-  || session->dir_mode == XFER_DIR_MLST)
+  for(;;)
   {
-    if(session->dir_mode == XFER_DIR_MLST)
-      session->buffer[session->buffersize++] = ' ';
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
 
-    if(session->mlst_flags & SESSION_MLST_TYPE)
+    if(recvmsg(session->data_fd, &msg, MSG_ERRQUEUE) < 0)
     {
-      /* type fact */
-      if(!type)
-      {
-        type = "???";
-        if(S_ISREG(st->st_mode))
-          type = "file";
-        else if(S_ISDIR(st->st_mode))
-          type = "dir";
-#if !defined(_3DS) && !defined(__SWITCH__)
-        else if(S_ISLNK(st->st_mode))
-          type = "os.unix=symlink";
-        else if(S_ISCHR(st->st_mode))
-          type = "os.unix=character";
-        else if(S_ISBLK(st->st_mode))
-          type = "os.unix=block";
-        else if(S_ISFIFO(st->st_mode))
-          type = "os.unix=fifo";
-        else if(S_ISSOCK(st->st_mode))
-          type = "os.unix=socket";
-#endif
-      }
-
-      session->buffersize +=
-        sprintf(session->buffer + session->buffersize, "Type=%s;", type);
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      console_error(RED "recvmsg: %d %s\n" RESET, errno, strerror(errno));
+      return -1;
     }
 
-    if(session->mlst_flags & SESSION_MLST_SIZE)
+    for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
     {
-      /* size fact */
-      session->buffersize +=
-        sprintf(session->buffer + session->buffersize, "Size=%lld;",
-                (signed long long)st->st_size);
-    }
+      if(cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+        continue;
 
-    if(session->mlst_flags & SESSION_MLST_MODIFY)
-    {
-      /* mtime fact */
-      struct tm *tm = gmtime(&st->st_mtime);
-      if(tm == NULL)
-        return errno;
+      serr = (struct sock_extended_err*)CMSG_DATA(cm);
+      if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
 
-      session->buffersize +=
-        strftime(session->buffer + session->buffersize,
-                 sizeof(session->buffer) - session->buffersize,
-                 "Modify=%Y%m%d%H%M%S;", tm);
-      if(session->buffersize == 0)
-        return EOVERFLOW;
+      /* completions cover the sends [ee_info, ee_data] in order */
+      session->zc_done = serr->ee_data + 1;
+      if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        session->flags &= ~SESSION_ZEROCOPY;
     }
+  }
 
-    if(session->mlst_flags & SESSION_MLST_PERM)
-    {
-      /* permission fact */
-      strcpy(session->buffer + session->buffersize, "Perm=");
-      session->buffersize += strlen("Perm=");
-
-      /* append permission */
-      if(S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'a';
+  if(getsockopt(session->data_fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+    return -1;
 
-      /* create permission */
-      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'c';
+  return 0;
+}
 
-      /* delete permission */
-      session->buffer[session->buffersize++] = 'd';
+/*! check whether the kernel still holds memory lent by MSG_ZEROCOPY
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to wait before reusing or releasing the memory
+ */
+static bool
+ftp_session_zerocopy_busy(ftp_session_t *session)
+{
+  if(session->zc_sent == session->zc_done)
+    return false;
 
-      /* chdir permission */
-      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IXUSR))
-        session->buffer[session->buffersize++] = 'e';
+  /* a broken connection will never release it; the next send fails */
+  if(ftp_session_zerocopy_reap(session) != 0)
+    return false;
 
-      /* rename permission */
-      session->buffer[session->buffersize++] = 'f';
+  return session->zc_sent != session->zc_done;
+}
 
-      /* list permission */
-      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IRUSR))
-        session->buffer[session->buffersize++] = 'l';
-
-      /* mkdir permission */
-      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'm';
+/*! set up a token bucket
+ *
+ *  @param[in] bucket token bucket
+ *  @param[in] rate   bytes per second, 0 for unlimited
+ */
+static void
+ftp_bucket_init(ftp_bucket_t *bucket,
+                uint64_t     rate)
+{
+  bucket->rate   = rate;
+  bucket->tokens = 0;
+  bucket->stamp  = ftp_file_now();
+}
 
-      /* delete permission */
-      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'p';
+/*! add the tokens a bucket earned since it was last filled
+ *
+ *  @param[in] bucket token bucket
+ *  @param[in] now    current time in milliseconds
+ *
+ *  @note A bucket holds at most RATE_BURST_TIME worth of tokens, but always
+ *        enough for a whole transfer buffer.
+ */
+static void
+ftp_bucket_fill(ftp_bucket_t *bucket,
+                uint64_t     now)
+{
+  uint64_t burst  = bucket->rate * RATE_BURST_TIME / 1000;
+  uint64_t earned = (now - bucket->stamp) * bucket->rate / 1000;
 
-      /* read permission */
-      if(S_ISREG(st->st_mode) && (st->st_mode & S_IRUSR))
-        session->buffer[session->buffersize++] = 'r';
+  /* wait until at least a whole byte was earned */
+  if(earned == 0)
+    return;
 
-      /* write permission */
-      if(S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'w';
+  if(burst < XFER_BUFFERSIZE)
+    burst = XFER_BUFFERSIZE;
 
-      session->buffer[session->buffersize++] = ';';
-    }
+  bucket->tokens += earned;
+  if(bucket->tokens > burst)
+    bucket->tokens = burst;
+  bucket->stamp = now;
+}
 
-    if(session->mlst_flags & SESSION_MLST_UNIX_MODE)
-    {
-      /* unix mode fact */
-      mode_t mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID;
-      session->buffersize +=
-        sprintf(session->buffer + session->buffersize, "UNIX.mode=0%lo;",
-                (unsigned long)(st->st_mode & mask));
-    }
+/*! get the entry for a client address
+ *
+ *  @param[in] addr client address
+ *
+ *  @returns host entry or NULL for error
+ */
+static ftp_host_t*
+ftp_host_get(struct in_addr addr)
+{
+  ftp_host_t *host;
 
-    /* make sure space precedes name */
-    if(session->buffer[session->buffersize-1] != ' ')
-      session->buffer[session->buffersize++] = ' ';
-  }
-  else if(session->dir_mode != XFER_DIR_NLST)
+  for(host = hosts; host != NULL; host = host->next)
   {
-    if(session->dir_mode == XFER_DIR_STAT)
-      session->buffer[session->buffersize++] = ' ';
-
-    /* perms nlinks owner group size */
-    session->buffersize +=
-      sprintf(session->buffer + session->buffersize,
-              "%c%c%c%c%c%c%c%c%c%c %lu 3DS 3DS %lld ",
-              S_ISREG(st->st_mode)  ? '-' :
-              S_ISDIR(st->st_mode)  ? 'd' :
-#if !defined(_3DS) && !defined(__SWITCH__)
-              S_ISLNK(st->st_mode)  ? 'l' :
-              S_ISCHR(st->st_mode)  ? 'c' :
-              S_ISBLK(st->st_mode)  ? 'b' :
-              S_ISFIFO(st->st_mode) ? 'p' :
-              S_ISSOCK(st->st_mode) ? 's' :
-#endif
-              '?',
-              st->st_mode & S_IRUSR ? 'r' : '-',
-              st->st_mode & S_IWUSR ? 'w' : '-',
-              st->st_mode & S_IXUSR ? 'x' : '-',
-              st->st_mode & S_IRGRP ? 'r' : '-',
-              st->st_mode & S_IWGRP ? 'w' : '-',
-              st->st_mode & S_IXGRP ? 'x' : '-',
-              st->st_mode & S_IROTH ? 'r' : '-',
-              st->st_mode & S_IWOTH ? 'w' : '-',
-              st->st_mode & S_IXOTH ? 'x' : '-',
-              (unsigned long)st->st_nlink,
-              (signed long long)st->st_size);
-
-    /* timestamp */
-    struct tm *tm = gmtime(&st->st_mtime);
-    if(tm)
-    {
-      const char *fmt = "%b %e %Y ";
-      if(session->timestamp > st->st_mtime
-      && session->timestamp - st->st_mtime < (60*60*24*365/2))
-      {
-        fmt = "%b %e %H:%M ";
-      }
-
-      session->buffersize +=
-        strftime(session->buffer + session->buffersize,
-                 sizeof(session->buffer) - session->buffersize,
-                 fmt, tm);
-    }
-    else
+    if(host->addr.s_addr == addr.s_addr)
     {
-      session->buffersize +=
-        sprintf(session->buffer + session->buffersize, "Jan 1 1970 ");
+      ++host->refs;
+      return host;
     }
   }
 
-  if(session->buffersize + len + 2 > sizeof(session->buffer))
+  host = (ftp_host_t*)calloc(1, sizeof(ftp_host_t));
+  if(host == NULL)
   {
-    /* buffer will overflow */
-    return EOVERFLOW;
+    console_error(RED "failed to allocate host\n" RESET);
+    return NULL;
   }
 
-  /* copy path */
-  memcpy(session->buffer+session->buffersize, path, len);
-  len = session->buffersize + len;
-  session->buffer[len++] = '\r';
-  session->buffer[len++] = '\n';
-  session->buffersize = len;
+  host->addr = addr;
+  host->refs = 1;
+  ftp_bucket_init(&host->bucket, RATE_HOST);
 
-  return 0;
+  /* link to the host list */
+  host->next = hosts;
+  hosts      = host;
+
+  return host;
 }
 
-/*! fill directory entry
- *
- *  @param[in] session ftp session
- *  @param[in] st      stat data
- *  @param[in] path    path to fill
- *  @param[in] len     path length
+/*! release the entry for a client address
  *
- *  @returns errno
+ *  @param[in] host host entry
  */
-static int
-ftp_session_fill_dirent(ftp_session_t *session, const struct stat *st,
-                        const char *path, size_t len)
+static void
+ftp_host_put(ftp_host_t *host)
 {
-  return ftp_session_fill_dirent_type(session, st, path, len, NULL);
+  ftp_host_t **p;
+
+  if(--host->refs != 0)
+    return;
+
+  /* unlink from the host list */
+  for(p = &hosts; *p != host; p = &(*p)->next)
+    ;
+  *p = host->next;
+
+  free(host);
 }
 
-/*! transfer loop
- *
- *  Try to transfer as much data as the sockets will allow without blocking
+/*! get the pacing rate for data sockets
  *
- *  @param[in] session ftp session
+ *  @returns the tightest rate limit, 0 for unlimited
  */
-static void
-ftp_session_transfer(ftp_session_t *session)
+static unsigned int
+ftp_pacing_rate(void)
 {
-  int rc;
-  do
+  uint64_t rates[] = { RATE_GLOBAL, RATE_HOST, RATE_SESSION };
+  uint64_t rate = 0;
+  size_t   i;
+
+  for(i = 0; i < sizeof(rates)/sizeof(rates[0]); ++i)
   {
-    rc = session->transfer(session);
-  } while(rc == 0);
+    if(rates[i] != 0 && (rate == 0 || rates[i] < rate))
+      rate = rates[i];
+  }
+
+  if(rate > UINT_MAX)
+    rate = UINT_MAX;
+  return rate;
 }
 
-/*! encode a path
- *
- *  @param[in]     path   path to encode
- *  @param[in,out] len    path length
- *  @param[in]     quotes whether to encode quotes
- *
- *  @returns encoded path
+/*! record a completed range of an upload
  *
- *  @note The caller must free the returned path
+ *  @param[in] upload upload handle
+ *  @param[in] start  first byte written
+ *  @param[in] end    one past the last byte written
  */
-static char*
-encode_path(const char *path,
-            size_t     *len,
-            bool       quotes)
+static void
+ftp_upload_complete(ftp_upload_t *upload,
+                    uint64_t     start,
+                    uint64_t     end)
 {
-  bool   enc = false;
-  size_t i, diff = 0;
-  char   *out, *p = (char*)path;
+  ftp_range_t *ranges;
+  size_t      i, j;
 
-  /* check for \n that needs to be encoded */
-  if(memchr(p, '\n', *len) != NULL)
-    enc = true;
+  if(end <= start)
+    return;
 
-  if(quotes)
+  ranges = (ftp_range_t*)realloc(upload->ranges,
+                                 (upload->num_ranges + 1) * sizeof(ftp_range_t));
+  if(ranges == NULL)
   {
-    /* check for " that needs to be encoded */
-    p = (char*)path;
-    do
-    {
-      p = memchr(p, '"', path + *len - p);
-      if(p != NULL)
-      {
-        ++p;
-        ++diff;
-      }
-    } while(p != NULL);
+    console_error(RED "failed to allocate upload range\n" RESET);
+    return;
   }
+  upload->ranges = ranges;
 
-  /* check if an encode was needed */
-  if(!enc && diff == 0)
-    return strdup(path);
-
-  /* allocate space for encoded path */
-  p = out = (char*)malloc(*len + diff);
-  if(out == NULL)
-    return NULL;
+  /* insert in order of start */
+  for(i = 0; i < upload->num_ranges && ranges[i].start < start; ++i)
+    ;
+  memmove(&ranges[i+1], &ranges[i], (upload->num_ranges - i) * sizeof(ftp_range_t));
+  ranges[i].start = start;
+  ranges[i].end   = end;
+  ++upload->num_ranges;
 
-  /* copy the path while performing encoding */
-  for(i = 0; i < *len; ++i)
+  /* merge overlapping and adjacent ranges */
+  for(i = 0, j = 1; j < upload->num_ranges; ++j)
   {
-    if(*path == '\n')
+    if(ranges[j].start <= ranges[i].end)
     {
-      /* encoded \n is \0 */
-      *p++ = 0;
-    }
-    else if(quotes && *path == '"')
-    {
-      /* encoded " is "" */
-      *p++ = '"';
-      *p++ = '"';
+      if(ranges[j].end > ranges[i].end)
+        ranges[i].end = ranges[j].end;
     }
     else
-      *p++ = *path;
-    ++path;
+      ranges[++i] = ranges[j];
   }
-
-  *len += diff;
-  return out;
+  upload->num_ranges = i + 1;
 }
 
-/*! decode a path
+/*! build a hidden name next to an upload
  *
- *  @param[in] session ftp session
- *  @param[in] len     command length
+ *  @param[in]  path   path of the upload
+ *  @param[out] name   hidden name
+ *  @param[in]  size   size of name
+ *  @param[in]  suffix suffix to use, NULL for a unique one
+ *
+ *  @returns -1 if the name does not fit
  */
-static void
-decode_path(ftp_session_t *session,
-            size_t        len)
+static int
+ftp_upload_tmpname(const char *path,
+                   char       *name,
+                   size_t     size,
+                   const char *suffix)
 {
-  size_t i;
+  static unsigned counter = 0;
+  const char      *base = strrchr(path, '/') + 1;
+  int             rc;
 
-  /* decode \0 from the first command */
-  for(i = 0; i < len; ++i)
+  if(suffix != NULL)
+    rc = snprintf(name, size, "%.*s.%s.%s", (int)(base - path), path, base, suffix);
+  else
+    rc = snprintf(name, size, "%.*s.%s.%u.%u", (int)(base - path), path, base,
+                  (unsigned)getpid(), ++counter);
+  if(rc < 0 || (size_t)rc >= size)
   {
-    /* this is an encoded \n */
-    if(session->cmd_buffer[i] == 0)
-      session->cmd_buffer[i] = '\n';
+    errno = ENAMETOOLONG;
+    return -1;
   }
+
+  return 0;
 }
 
-/*! fill cdir directory entry
+/*! give an O_TMPFILE upload a name
  *
- *  @param[in] session ftp session
- *  @param[in] path    path to fill
+ *  @param[in] upload upload handle
+ *  @param[in] name   name to link
  *
- *  @returns errno
+ *  @returns -1 for error
  */
 static int
-ftp_session_fill_dirent_cdir(ftp_session_t *session, const char *path)
+ftp_upload_link(ftp_upload_t *upload,
+                const char   *name)
 {
-  int         rc;
-  struct stat st;
-  char        *buffer;
-  size_t      len;
-
-  rc = stat(path, &st);
-  /* double-check this was a directory */
-  if(rc == 0 && !S_ISDIR(st.st_mode))
-  {
-    /* shouldn't happen but just in case */
-    rc = -1;
-    errno = ENOTDIR;
-  }
-  if(rc != 0)
-    return errno;
+  char proc[32];
 
-  /* encode \n in path */
-  len = strlen(path);
-  buffer = encode_path(path, &len, false);
-  if(!buffer)
-    return ENOMEM;
+  if(linkat(upload->fd, "", AT_FDCWD, name, AT_EMPTY_PATH) == 0)
+    return 0;
 
-  /* fill dirent with listed directory as type=cdir */
-  rc = ftp_session_fill_dirent_type(session, &st, buffer, len, "cdir");
-  free(buffer);
+  /* AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH; procfs does not */
+  if(errno != ENOENT && errno != EPERM)
+    return -1;
 
-  return rc;
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", upload->fd);
+  return linkat(AT_FDCWD, proc, AT_FDCWD, name, AT_SYMLINK_FOLLOW);
 }
 
-/*! send a response on the command socket
+/*! publish a staged upload under its path
  *
- *  @param[in] session ftp session
- *  @param[in] buffer  buffer to send
- *  @param[in] len     buffer length
+ *  @param[in] upload upload handle
+ *
+ *  @returns -1 for error
+ *
+ *  @note Readers see either the old file or the complete new one. A unique
+ *        upload fails instead of replacing a file that appeared meanwhile.
  */
-static void
-ftp_send_response_buffer(ftp_session_t *session,
-                         const char    *buffer,
-                         size_t        len)
+static int
+ftp_upload_publish(ftp_upload_t *upload)
 {
-  ssize_t rc, to_send;
+  char name[4096];
+  int  tries;
 
-  if(session->cmd_fd < 0)
-    return;
+  ftp_file_invalidate(upload->path);
 
-  /* send response */
-  to_send = len;
-  console_print(GREEN "%s" RESET, buffer);
-  rc = send(session->cmd_fd, buffer, to_send, 0);
-  if(rc < 0)
+  if(upload->tmppath != NULL)
   {
-    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
+    /* link keeps an existing file; rename replaces it */
+    if(upload->unique)
+    {
+      if(link(upload->tmppath, upload->path) != 0)
+      {
+        console_error(RED "link '%s': %d %s\n" RESET, upload->path, errno, strerror(errno));
+        return -1;
+      }
+
+      if(unlink(upload->tmppath) != 0)
+        console_error(RED "unlink '%s': %d %s\n" RESET, upload->tmppath, errno, strerror(errno));
+    }
+    else if(rename(upload->tmppath, upload->path) != 0)
+    {
+      console_error(RED "rename '%s': %d %s\n" RESET, upload->path, errno, strerror(errno));
+      return -1;
+    }
+
+    free(upload->tmppath);
+    upload->tmppath = NULL;
+    return 0;
   }
-  else if(rc != to_send)
+
+  if(upload->unique)
   {
-    console_print(RED "only sent %u/%u bytes\n" RESET,
-                  (unsigned int)rc, (unsigned int)to_send);
-    ftp_session_close_cmd(session);
+    if(ftp_upload_link(upload, upload->path) != 0)
+    {
+      console_error(RED "linkat '%s': %d %s\n" RESET, upload->path, errno, strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
+  /* linkat can't replace a file, so link a hidden name and rename it */
+  for(tries = 0; tries < 16; ++tries)
+  {
+    if(ftp_upload_tmpname(upload->path, name, sizeof(name), NULL) != 0)
+      break;
+
+    if(ftp_upload_link(upload, name) == 0)
+    {
+      if(rename(name, upload->path) == 0)
+        return 0;
+
+      console_error(RED "rename '%s': %d %s\n" RESET, upload->path, errno, strerror(errno));
+      unlink(name);
+      return -1;
+    }
+    else if(errno != EEXIST)
+      break;
   }
+
+  console_error(RED "linkat '%s': %d %s\n" RESET, upload->path, errno, strerror(errno));
+  return -1;
 }
 
-__attribute__((format(printf,3,4)))
-/*! send ftp response to ftp session's peer
+/*! sync the directory an upload was published in
  *
- *  @param[in] session ftp session
- *  @param[in] code    response code
- *  @param[in] fmt     format string
- *  @param[in] ...     format arguments
+ *  @param[in] upload upload handle
+ *
+ *  @returns -1 for error
  */
-static void
-ftp_send_response(ftp_session_t *session,
-                  int           code,
-                  const char    *fmt, ...)
+static int
+ftp_upload_sync_dir(ftp_upload_t *upload)
 {
-  static char buffer[CMD_BUFFERSIZE];
-  ssize_t     rc;
-  va_list     ap;
+  char *slash = strrchr(upload->path, '/');
+  int  fd, rc;
 
-  if(session->cmd_fd < 0)
-    return;
+  *slash = 0;
+  fd = open(slash == upload->path ? "/" : upload->path,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  *slash = '/';
+  if(fd < 0)
+  {
+    console_error(RED "open: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
 
-  /* print response code and message to buffer */
-  va_start(ap, fmt);
-  if(code > 0)
-    rc = sprintf(buffer, "%d ", code);
-  else
-    rc = sprintf(buffer, "%d-", -code);
-  rc += vsnprintf(buffer+rc, sizeof(buffer)-rc, fmt, ap);
-  va_end(ap);
+  rc = fsync(fd);
+  if(rc != 0)
+    console_error(RED "fsync: %d %s\n" RESET, errno, strerror(errno));
 
-  if(rc >= sizeof(buffer))
+  close(fd);
+  return rc;
+}
+
+/*! finalize an upload once the last writer has left
+ *
+ *  @param[in] upload upload handle
+ *
+ *  @returns -1 if a staged upload could not be published
+ *
+ *  @note If the completed ranges cover the size announced by ALLO the file is
+ *        truncated to that size; otherwise only unused preallocated blocks are
+ *        released. Uploads that were written in several segments are synced.
+ *        Staged uploads are published only once every segment was received
+ *        and the ranges cover the file, up to the size announced by ALLO.
+ *        They are synced before they get their name, so that it never
+ *        refers to a partial file after a crash.
+ */
+static int
+ftp_upload_finalize(ftp_upload_t *upload)
+{
+  struct stat st;
+  uint64_t    size = 0;
+  bool        complete;
+
+  upload->finalized = true;
+
+  complete = upload->num_ranges == 1 && upload->ranges[0].start == 0;
+  if(complete)
+    size = upload->ranges[0].end;
+
+  if(!upload->append && upload->size != 0 && complete && size >= upload->size)
   {
-    /* couldn't fit message; just send code */
-    console_print(RED "%s: buffersize too small\n" RESET, __func__);
-    if(code > 0)
-      rc = sprintf(buffer, "%d \r\n", code);
+    /* drop anything left over from a previous, longer file */
+    if(ftruncate(upload->fd, size) != 0)
+      console_error(RED "ftruncate: %d %s\n" RESET, errno, strerror(errno));
+  }
+  else if(upload->prealloc)
+  {
+    /* release preallocated blocks that were not written */
+    if(fstat(upload->fd, &st) != 0)
+      console_error(RED "fstat: %d %s\n" RESET, errno, strerror(errno));
+    else if(ftruncate(upload->fd, st.st_size) != 0)
+      console_error(RED "ftruncate: %d %s\n" RESET, errno, strerror(errno));
+  }
+
+  if(upload->atomic)
+  {
+    if(upload->received != upload->segments || !complete
+    || (upload->size != 0 && size < upload->size))
+      return -1;
+
+    if(fsync(upload->fd) != 0)
+    {
+      console_error(RED "fsync: %d %s\n" RESET, errno, strerror(errno));
+      return -1;
+    }
+
+    if(ftp_upload_publish(upload) != 0)
+      return -1;
+
+    /* make the name durable too */
+    if(STORE_SYNC != SYNC_NONE)
+      return ftp_upload_sync_dir(upload);
+    return 0;
+  }
+
+  if(upload->segments > 1)
+  {
+    if(!complete)
+    {
+      console_warn(YELLOW "'%s' is missing segments\n" RESET, upload->path);
+      return 0;
+    }
+
+    if(fsync(upload->fd) != 0)
+      console_error(RED "fsync: %d %s\n" RESET, errno, strerror(errno));
     else
-      rc = sprintf(buffer, "%d-\r\n", -code);
+      console_print(CYAN "'%s' complete from %u segments\n" RESET,
+                    upload->path, upload->segments);
   }
 
-  ftp_send_response_buffer(session, buffer, rc);
+  return 0;
 }
 
-/*! destroy ftp session
+/*! open a staging file for an atomic upload
  *
- *  @param[in] session ftp session
+ *  @param[in] upload upload handle
  *
- *  @returns the next session in the list
+ *  @returns -1 for error
  */
-static ftp_session_t*
-ftp_session_destroy(ftp_session_t *session)
+static int
+ftp_upload_stage(ftp_upload_t *upload)
 {
-  ftp_session_t *next = session->next;
+  char *slash = strrchr(upload->path, '/');
 
-  /* close all sockets/files */
-  ftp_session_close_cmd(session);
-  ftp_session_close_pasv(session);
-  ftp_session_close_data(session);
-  ftp_session_close_file(session);
-  ftp_session_close_cwd(session);
+  /* an unnamed file in the target directory */
+  *slash = 0;
+  upload->fd = open(slash == upload->path ? "/" : upload->path,
+                    O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  *slash = '/';
+  if(upload->fd >= 0)
+    return 0;
 
-  /* unlink from sessions list */
-  if(session->next)
-    session->next->prev = session->prev;
-  if(session == sessions)
-    sessions = session->next;
-  else
-  {
-    session->prev->next = session->next;
-    if(session == sessions->prev)
-      sessions->prev = session->prev;
-  }
+  /* not every filesystem supports O_TMPFILE; use a hidden name instead */
+  upload->tmppath = (char*)malloc(strlen(upload->path) + 16);
+  if(upload->tmppath == NULL)
+    return -1;
 
-  /* deallocate */
-  free(session);
+  if(ftp_upload_tmpname(upload->path, upload->tmppath,
+                        strlen(upload->path) + 16, "XXXXXX") != 0)
+    return -1;
 
-  return next;
+  upload->fd = mkostemp(upload->tmppath, O_CLOEXEC);
+  if(upload->fd < 0)
+    return -1;
+
+  /* mkostemp creates files only we can read */
+  if(fchmod(upload->fd, 0644) != 0)
+    console_error(RED "fchmod: %d %s\n" RESET, errno, strerror(errno));
+
+  return 0;
 }
 
-/*! allocate new ftp session
+/*! get a write handle for an upload
  *
- *  @param[in] listen_fd socket to accept connection from
+ *  @param[in] path    path to store
+ *  @param[in] append  whether to append
+ *  @param[in] offset  REST offset
+ *  @param[in] segment whether the STOR came with REST or ALLO
+ *  @param[in] unique  whether this is a STOU, which is always staged
+ *
+ *  @returns upload handle or NULL for error
+ *
+ *  @note A STOR with REST or ALLO joins an upload of the same path that is
+ *        already in progress instead of truncating it, so that several
+ *        sessions can store disjoint ranges of one file concurrently; if
+ *        that upload is staged, they write into the staging file. A plain
+ *        STOR truncates the file as usual. With STORE_ATOMIC, a STOR at
+ *        offset 0 is staged unless other sessions are writing the file in
+ *        place, as publishing would throw their data away.
  */
-static void
-ftp_session_new(int listen_fd)
+static ftp_upload_t*
+ftp_upload_get(const char *path,
+               bool       append,
+               uint64_t   offset,
+               bool       segment,
+               bool       unique)
 {
-  ssize_t            rc;
-  int                new_fd;
-  ftp_session_t      *session;
-  struct sockaddr_in addr;
-  socklen_t          addrlen = sizeof(addr);
+  ftp_upload_t *upload;
+  int          flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  bool         atomic;
 
-  /* accept connection */
-  new_fd = accept(listen_fd, (struct sockaddr*)&addr, &addrlen);
-  if(new_fd < 0)
+  /* find an upload of this path in progress */
+  for(upload = uploads; upload != NULL; upload = upload->next)
   {
-    console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
-    return;
+    if(!upload->append && !upload->unique && strcmp(upload->path, path) == 0)
+      break;
   }
 
-  console_print(CYAN "accepted connection from %s:%u\n" RESET,
-                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-
-  /* allocate a new session */
-  session = (ftp_session_t*)calloc(1, sizeof(ftp_session_t));
-  if(session == NULL)
+  if(upload != NULL && !append && segment && !unique)
   {
-    console_print(RED "failed to allocate session\n" RESET);
-    ftp_closesocket(new_fd, true);
-    return;
+    /* join it */
+    ++upload->refs;
+    ++upload->segments;
+    upload->finalized = false;
+    return upload;
   }
 
-  /* initialize session */
-  strcpy(session->cwd, "/");
-  session->peer_addr.sin_addr.s_addr = INADDR_ANY;
-  session->cmd_fd     = new_fd;
-  session->pasv_fd    = -1;
-  session->data_fd    = -1;
-  session->mlst_flags = SESSION_MLST_TYPE
-                      | SESSION_MLST_SIZE
-                      | SESSION_MLST_MODIFY
-                      | SESSION_MLST_PERM;
-  session->state      = COMMAND_STATE;
+  atomic = unique || (STORE_ATOMIC && !append && offset == 0 && upload == NULL);
 
-  /* link to the sessions list */
-  if(sessions == NULL)
+  if(append)
+    flags |= O_APPEND;
+  else if(offset == 0)
+    flags |= O_TRUNC;
+
+  upload = (ftp_upload_t*)calloc(1, sizeof(ftp_upload_t));
+  if(upload == NULL)
   {
-    sessions = session;
-    session->prev = session;
+    console_error(RED "failed to allocate upload\n" RESET);
+    return NULL;
   }
-  else
+
+  upload->path = strdup(path);
+  if(upload->path == NULL)
   {
-    sessions->prev->next = session;
-    session->prev        = sessions->prev;
-    sessions->prev       = session;
+    console_error(RED "failed to allocate upload\n" RESET);
+    free(upload);
+    return NULL;
   }
 
-  /* copy socket address to pasv address */
-  addrlen = sizeof(session->pasv_addr);
-  rc = getsockname(new_fd, (struct sockaddr*)&session->pasv_addr, &addrlen);
-  if(rc != 0)
+  if(atomic)
   {
-    console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 451, "Failed to get connection info\r\n");
-    ftp_session_destroy(session);
-    return;
+    if(ftp_upload_stage(upload) != 0)
+    {
+      console_error(RED "staging '%s': %d %s\n" RESET, path, errno, strerror(errno));
+      free(upload->tmppath);
+      free(upload->path);
+      free(upload);
+      return NULL;
+    }
+  }
+  else
+  {
+    upload->fd = open(path, flags, 0644);
+    if(upload->fd < 0)
+    {
+      console_error(RED "open '%s': %d %s\n" RESET, path, errno, strerror(errno));
+      free(upload->path);
+      free(upload);
+      return NULL;
+    }
   }
 
-  session->cmd_fd = new_fd;
+  upload->atomic   = atomic;
+  upload->unique   = unique;
+  upload->append   = append;
+  upload->refs     = 1;
+  upload->segments = 1;
 
-  /* send initiator response */
-  ftp_send_response(session, 220, "Hello!\r\n");
+  /* link to the upload list */
+  upload->next = uploads;
+  uploads      = upload;
+
+  return upload;
 }
 
-/*! accept PASV connection for ftp session
- *
- *  @param[in] session ftp session
+/*! release a write handle for an upload
  *
- *  @returns -1 for failure
+ *  @param[in] upload upload handle
  */
-static int
-ftp_session_accept(ftp_session_t *session)
+static void
+ftp_upload_put(ftp_upload_t *upload)
 {
-  int                rc, new_fd;
-  struct sockaddr_in addr;
-  socklen_t          addrlen = sizeof(addr);
+  ftp_upload_t **p;
 
-  if(session->flags & SESSION_PASV)
-  {
-    /* clear PASV flag */
-    session->flags &= ~SESSION_PASV;
+  /* this segment changed the file */
+  ftp_file_invalidate(upload->path);
 
-    /* tell the peer that we're ready to accept the connection */
-    ftp_send_response(session, 150, "Ready\r\n");
+  if(--upload->refs != 0)
+    return;
 
-    /* accept connection from peer */
-    new_fd = accept(session->pasv_fd, (struct sockaddr*)&addr, &addrlen);
-    if(new_fd < 0)
-    {
-      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 425, "Failed to establish connection\r\n");
-      return -1;
-    }
+  if(!upload->finalized)
+    ftp_upload_finalize(upload);
 
-    /* set the socket to non-blocking */
-    rc = ftp_set_socket_nonblocking(new_fd);
-    if(rc != 0)
-    {
-      ftp_closesocket(new_fd, true);
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 425, "Failed to establish connection\r\n");
-      return -1;
-    }
+  /* unlink from the upload list */
+  for(p = &uploads; *p != upload; p = &(*p)->next)
+    ;
+  *p = upload->next;
 
-    console_print(CYAN "accepted connection from %s:%u\n" RESET,
-                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+  if(close(upload->fd) != 0)
+    console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
 
-    /* we are ready to transfer data */
-    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
-    session->data_fd = new_fd;
+  /* throw away a staged upload that was never published */
+  if(upload->tmppath != NULL && unlink(upload->tmppath) != 0)
+    console_error(RED "unlink '%s': %d %s\n" RESET, upload->tmppath, errno, strerror(errno));
 
-    return 0;
-  }
-  else
-  {
-    /* peer didn't send PASV command */
-    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
-    return -1;
-  }
+  free(upload->tmppath);
+  free(upload->ranges);
+  free(upload->path);
+  free(upload);
 }
 
-/*! connect to peer for ftp session
+/*! write back an upload as it is received
  *
  *  @param[in] session ftp session
  *
- *  @returns -1 for failure
+ *  @note Waiting for the previous chunk before starting the next keeps at
+ *        most about two chunks of each upload dirty, instead of letting the
+ *        page cache fill up and stall everyone in one big writeback.
  */
-static int
-ftp_session_connect(ftp_session_t *session)
+static void
+ftp_session_writeback(ftp_session_t *session)
 {
-  int rc;
-
-  /* clear PORT flag */
-  session->flags &= ~SESSION_PORT;
+  int fd = session->upload->fd;
 
-  /* create a new socket */
-  session->data_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(session->data_fd < 0)
+  /* wait for the chunk we started last time */
+  if(session->writeback > session->writeback_done)
   {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    if(sync_file_range(fd, session->writeback_done,
+                       session->writeback - session->writeback_done,
+                       SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                       | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+      console_error(RED "sync_file_range: %d %s\n" RESET, errno, strerror(errno));
+    session->writeback_done = session->writeback;
   }
 
-  /* set socket options */
-  rc = ftp_set_socket_options(session->data_fd);
-  if(rc != 0)
+  /* start writing out what we just received */
+  if(sync_file_range(fd, session->writeback, session->filepos - session->writeback,
+                     SYNC_FILE_RANGE_WRITE) != 0)
+    console_error(RED "sync_file_range: %d %s\n" RESET, errno, strerror(errno));
+  session->writeback = session->filepos;
+}
+
+/*! make a finished upload durable according to STORE_SYNC
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error, 0 if durable, 1 if waiting for a group commit
+ */
+static int
+ftp_session_sync(ftp_session_t *session)
+{
+  switch(STORE_SYNC)
   {
-    ftp_closesocket(session->data_fd, false);
-    session->data_fd = -1;
-    return -1;
+    case SYNC_CLOSE:
+      if(fsync(session->upload->fd) != 0)
+      {
+        console_error(RED "fsync: %d %s\n" RESET, errno, strerror(errno));
+        return -1;
+      }
+      return 0;
+
+    case SYNC_GROUP:
+      session->commit = 1;
+      return 1;
   }
 
-  /* set socket to non-blocking */
-  rc = ftp_set_socket_nonblocking(session->data_fd);
-  if(rc != 0)
-    return -1;
+  return 0;
+}
 
-  /* connect to peer */
-  rc = connect(session->data_fd, (struct sockaddr*)&session->peer_addr,
-               sizeof(session->peer_addr));
-  if(rc != 0)
+/*! sync all uploads waiting for a group commit
+ */
+static void
+ftp_group_commit(void)
+{
+  ftp_session_t *session, *other;
+  int           rc;
+
+  for(session = sessions; session != NULL; session = session->next)
   {
-    if(errno != EINPROGRESS)
+    if(session->commit <= 0)
+      continue;
+
+    rc = fdatasync(session->upload->fd);
+    if(rc != 0)
+      console_error(RED "fdatasync: %d %s\n" RESET, errno, strerror(errno));
+
+    /* segments of the same upload share its file */
+    for(other = session; other != NULL; other = other->next)
     {
-      console_print(RED "connect: %d %s\n" RESET, errno, strerror(errno));
-      ftp_closesocket(session->data_fd, false);
-      session->data_fd = -1;
-      return -1;
+      if(other->commit > 0 && other->upload == session->upload)
+        other->commit = rc == 0 ? 0 : -1;
     }
   }
-  else
-  {
-    console_print(CYAN "connected to %s:%u\n" RESET,
-                  inet_ntoa(session->peer_addr.sin_addr),
-                  ntohs(session->peer_addr.sin_port));
-
-    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
-    ftp_send_response(session, 150, "Ready\r\n");
-  }
 
-  return 0;
+  commit_stamp = ftp_file_now();
 }
 
-/*! read command for ftp session
+/*! preallocate space for an upload
  *
  *  @param[in] session ftp session
- *  @param[in] events  poll events
+ *
+ *  @note The file size is left alone so that appends and readers behave as
+ *        before; unused blocks are released when the upload is finalized.
  */
 static void
-ftp_session_read_command(ftp_session_t *session,
-                         int           events)
+ftp_session_preallocate(ftp_session_t *session)
 {
-  char          *buffer, *args, *next = NULL;
-  size_t        i, len;
-  int           atmark;
-  ssize_t       rc;
-  ftp_command_t key, *command;
+  ftp_upload_t *upload = session->upload;
+  off_t        offset  = session->filepos;
+  struct stat  st;
 
-  /* check out-of-band data */
-  if(events & POLLPRI)
+  /* appends start at the end of the file */
+  if(upload->append)
   {
-    session->flags |= SESSION_URGENT;
-
-    /* check if we are at the urgent marker */
-    atmark = sockatmark(session->cmd_fd);
-    if(atmark < 0)
+    if(fstat(upload->fd, &st) != 0)
     {
-      console_print(RED "sockatmark: %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_close_cmd(session);
+      console_error(RED "fstat: %d %s\n" RESET, errno, strerror(errno));
       return;
     }
+    offset = st.st_size;
+  }
+  else if(offset + session->allocsize > upload->size)
+    upload->size = offset + session->allocsize;
 
-    if(!atmark)
-    {
-      /* discard in-band data */
-      rc = recv(session->cmd_fd, session->cmd_buffer, sizeof(session->cmd_buffer), 0);
-      if(rc < 0 && errno != EWOULDBLOCK)
-      {
-        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-        ftp_session_close_cmd(session);
-      }
+  if(fallocate(upload->fd, FALLOC_FL_KEEP_SIZE, offset, session->allocsize) != 0)
+  {
+    /* not every filesystem can do this; just write as usual */
+    if(errno != EOPNOTSUPP)
+      console_error(RED "fallocate: %d %s\n" RESET, errno, strerror(errno));
+    return;
+  }
 
-      return;
-    }
+  upload->prealloc = true;
+}
+#endif
 
-    /* retrieve the urgent data */
-    rc = recv(session->cmd_fd, session->cmd_buffer, sizeof(session->cmd_buffer), MSG_OOB);
-    if(rc < 0)
-    {
-      /* EWOULDBLOCK means out-of-band data is on the way */
-      if(errno == EWOULDBLOCK)
-        return;
+/*! check whether a cached file is still current
+ *
+ *  @param[in] entry cached file
+ *  @param[in] st    current stat data of the file
+ *
+ *  @returns whether the cached contents can be used
+ */
+static bool
+ftp_cache_valid(const ftp_cache_t *entry,
+                const struct stat *st)
+{
+  return entry->dev == st->st_dev && entry->ino == st->st_ino
+      && entry->size == st->st_size && entry->mtime == st->st_mtime
+#ifdef __linux__
+      && entry->mtime_nsec == st->st_mtim.tv_nsec
+#endif
+      ;
+}
 
-      /* error retrieving out-of-band data */
-      console_print(RED "recv (oob): %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_close_cmd(session);
-      return;
-    }
+/*! free a cached file
+ *
+ *  @param[in] entry cached file
+ */
+static void
+ftp_cache_free(ftp_cache_t *entry)
+{
+  free(entry->data);
+  free(entry->path);
+  free(entry);
+}
 
-    /* reset the command buffer */
-    session->cmd_buffersize = 0;
-    return;
+/*! remove a file from the cache
+ *
+ *  @param[in] entry cached file
+ *
+ *  @note The entry is freed once the last session sending it is done.
+ */
+static void
+ftp_cache_remove(ftp_cache_t *entry)
+{
+  /* unlink from the cache list */
+  if(entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache_head = entry->next;
+  if(entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache_tail = entry->prev;
+
+  cache_bytes -= entry->size;
+
+  if(entry->refs == 0)
+    ftp_cache_free(entry);
+  else
+    entry->stale = true;
+}
+
+/*! load a file into the cache
+ *
+ *  @param[in] path path to load
+ *  @param[in] st   stat data for path
+ *
+ *  @returns cached file or NULL if it could not be cached
+ */
+static ftp_cache_t*
+ftp_cache_load(const char        *path,
+               const struct stat *st)
+{
+  ftp_cache_t *entry, *victim;
+  struct stat fst;
+  FILE        *fp;
+  size_t      rc;
+
+  /* evict least recently used files to make room */
+  victim = cache_tail;
+  while(victim != NULL && cache_bytes + st->st_size > CACHE_SIZE)
+  {
+    entry  = victim;
+    victim = victim->prev;
+    if(entry->refs == 0)
+      ftp_cache_remove(entry);
   }
+  if(cache_bytes + st->st_size > CACHE_SIZE)
+    return NULL;
 
-  /* prepare to receive data */
-  buffer = session->cmd_buffer + session->cmd_buffersize;
-  len    = sizeof(session->cmd_buffer) - session->cmd_buffersize;
-  if(len == 0)
+  entry = (ftp_cache_t*)calloc(1, sizeof(ftp_cache_t));
+  if(entry == NULL)
+    return NULL;
+
+  entry->path = strdup(path);
+  entry->data = (char*)malloc(st->st_size);
+  if(entry->path == NULL || entry->data == NULL)
   {
-    /* error retrieving command */
-    console_print(RED "Exceeded command buffer size\n" RESET);
-    ftp_session_close_cmd(session);
-    return;
+    ftp_cache_free(entry);
+    return NULL;
   }
 
-  /* retrieve command data */
-  rc = recv(session->cmd_fd, buffer, len, 0);
-  if(rc < 0)
+  fp = fopen(path, "rb");
+  if(fp == NULL)
   {
-    /* error retrieving command */
-    console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
-    return;
+    console_error(RED "fopen '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    ftp_cache_free(entry);
+    return NULL;
   }
-  if(rc == 0)
+
+  /* make sure we read the file we looked at */
+  if(fstat(fileno(fp), &fst) != 0)
   {
-    /* peer closed connection */
-    debug_print("peer closed connection\n");
-    ftp_session_close_cmd(session);
-    return;
+    console_error(RED "fstat '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    fclose(fp);
+    ftp_cache_free(entry);
+    return NULL;
   }
+
+  entry->dev   = fst.st_dev;
+  entry->ino   = fst.st_ino;
+  entry->size  = fst.st_size;
+  entry->mtime = fst.st_mtime;
+#ifdef __linux__
+  entry->mtime_nsec = fst.st_mtim.tv_nsec;
+#endif
+
+  rc = 0;
+  if(ftp_cache_valid(entry, st))
+    rc = fread(entry->data, 1, entry->size, fp);
+  fclose(fp);
+
+  if(rc != (size_t)entry->size)
+  {
+    ftp_cache_free(entry);
+    return NULL;
+  }
+
+  /* link to the front of the cache list */
+  entry->next = cache_head;
+  if(cache_head != NULL)
+    cache_head->prev = entry;
   else
+    cache_tail = entry;
+  cache_head = entry;
+
+  cache_bytes += entry->size;
+  return entry;
+}
+
+/*! get a small file from the cache
+ *
+ *  @param[in] path path to get
+ *  @param[in] st   stat data for path
+ *
+ *  @returns cached file or NULL if the file is not cacheable
+ */
+static ftp_cache_t*
+ftp_cache_get(const char        *path,
+              const struct stat *st)
+{
+  ftp_cache_t *entry;
+
+  if(CACHE_SIZE == 0 || !S_ISREG(st->st_mode)
+  || st->st_size == 0 || st->st_size > CACHE_FILESIZE)
+    return NULL;
+
+  for(entry = cache_head; entry != NULL; entry = entry->next)
   {
-    session->cmd_buffersize += rc;
-    len                      = sizeof(session->cmd_buffer) - session->cmd_buffersize;
+    if(strcmp(entry->path, path) != 0)
+      continue;
 
-    if(session->flags & SESSION_URGENT)
+    if(!ftp_cache_valid(entry, st))
     {
-      /* look for telnet data mark */
-      for(i = 0; i < session->cmd_buffersize; ++i)
-      {
-        if((unsigned char)session->cmd_buffer[i] == 0xF2)
-        {
-          /* ignore all data that precedes the data mark */
-          if(i < session->cmd_buffersize - 1)
-            memmove(session->cmd_buffer, session->cmd_buffer + i + 1, len - i - 1);
-          session->cmd_buffersize -= i + 1;
-          session->flags &= ~SESSION_URGENT;
-          break;
-        }
-      }
+      /* the file changed since we cached it */
+      ftp_cache_remove(entry);
+      break;
     }
 
-    /* loop through commands */
-    while(true)
+    /* move to the front of the cache list */
+    if(entry != cache_head)
     {
-      /* must have at least enough data for the delimiter */
-      if(session->cmd_buffersize < 1)
-        return;
+      entry->prev->next = entry->next;
+      if(entry->next != NULL)
+        entry->next->prev = entry->prev;
+      else
+        cache_tail = entry->prev;
 
-      /* look for \r\n or \n delimiter */
-      for(i = 0; i < session->cmd_buffersize; ++i)
-      {
-        if(i < session->cmd_buffersize-1
-        && session->cmd_buffer[i]   == '\r'
-        && session->cmd_buffer[i+1] == '\n')
-        {
-          /* we found a \r\n delimiter */
-          session->cmd_buffer[i] = 0;
-          next = &session->cmd_buffer[i+2];
-          break;
-        }
-        else if(session->cmd_buffer[i] == '\n')
-        {
-          /* we found a \n delimiter */
-          session->cmd_buffer[i] = 0;
-          next = &session->cmd_buffer[i+1];
-          break;
-        }
-      }
+      entry->prev      = NULL;
+      entry->next      = cache_head;
+      cache_head->prev = entry;
+      cache_head       = entry;
+    }
 
-      /* check if a delimiter was found */
-      if(i == session->cmd_buffersize)
-        return;
+    ++cache_hits;
+    ++entry->refs;
+    return entry;
+  }
 
-      /* decode the command */
-      decode_path(session, i);
+  ++cache_misses;
+  entry = ftp_cache_load(path, st);
+  if(entry != NULL)
+    ++entry->refs;
 
-      /* split command from arguments */
-      args = buffer = session->cmd_buffer;
-      while(*args && !isspace((int)*args))
-        ++args;
-      if(*args)
-        *args++ = 0;
+  return entry;
+}
 
-      /* look up the command */
-      key.name = buffer;
-      command = bsearch(&key, ftp_commands,
-                        num_ftp_commands, sizeof(ftp_command_t),
-                        ftp_command_cmp);
+/*! release a file from the cache
+ *
+ *  @param[in] entry cached file
+ */
+static void
+ftp_cache_put(ftp_cache_t *entry)
+{
+  if(--entry->refs == 0 && entry->stale)
+    ftp_cache_free(entry);
+}
 
-      /* update command timestamp */
-      session->timestamp = time(NULL);
+#ifdef __linux__
+/*! get an aligned buffer for O_DIRECT
+ *
+ *  @returns buffer of DIRECT_IO_BUFFERSIZE bytes or NULL for error
+ */
+static char*
+ftp_pool_get(void)
+{
+  void *buffer;
+  int  rc;
 
-      /* execute the command */
-      if(command == NULL)
-      {
-        /* send header */
+  if(pool_count > 0)
+    return pool[--pool_count];
+
+  rc = posix_memalign(&buffer, DIRECT_IO_ALIGN, DIRECT_IO_BUFFERSIZE);
+  if(rc != 0)
+  {
+    console_error(RED "posix_memalign: %d %s\n" RESET, rc, strerror(rc));
+    return NULL;
+  }
+
+  return (char*)buffer;
+}
+
+/*! return an aligned buffer to the pool
+ *
+ *  @param[in] buffer buffer to return
+ */
+static void
+ftp_pool_put(char *buffer)
+{
+  if(pool_count < DIRECT_IO_POOL)
+    pool[pool_count++] = buffer;
+  else
+    free(buffer);
+}
+
+/*! switch a file transfer to O_DIRECT
+ *
+ *  @param[in] session ftp session
+ *  @param[in] fd      open descriptor of the file
+ *  @param[in] flags   access mode for the direct descriptor
+ *
+ *  @note The file is reopened through /proc so that the shared descriptor
+ *        keeps going through the page cache; it still serves the unaligned
+ *        head and tail of the transfer. Filesystems without O_DIRECT support
+ *        just keep the buffered transfer.
+ */
+static void
+ftp_session_open_direct(ftp_session_t *session,
+                        int           fd,
+                        int           flags)
+{
+  char path[32];
+
+  session->iobuf = ftp_pool_get();
+  if(session->iobuf == NULL)
+    return;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  session->direct_fd = open(path, flags | O_DIRECT | O_CLOEXEC);
+  if(session->direct_fd < 0)
+  {
+    console_warn(YELLOW "open O_DIRECT '%s': %d %s\n" RESET,
+                 session->buffer, errno, strerror(errno));
+    ftp_pool_put(session->iobuf);
+    session->iobuf = NULL;
+  }
+}
+
+/*! write out the data gathered for an O_DIRECT upload
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ *
+ *  @note Whole aligned blocks are written directly. A REST offset that is
+ *        not aligned and the tail of the upload go through the page cache.
+ */
+static int
+ftp_session_flush_direct(ftp_session_t *session)
+{
+  size_t  pos = 0, len, head;
+  ssize_t rc;
+  int     fd;
+
+  while(pos < session->buffersize)
+  {
+    len  = session->buffersize - pos;
+    head = session->filepos % DIRECT_IO_ALIGN;
+
+    fd = session->direct_fd;
+    if(head != 0 || len < DIRECT_IO_ALIGN)
+    {
+      fd = session->upload->fd;
+      if(head != 0 && len > DIRECT_IO_ALIGN - head)
+        len = DIRECT_IO_ALIGN - head;
+    }
+    else
+      len &= ~(size_t)(DIRECT_IO_ALIGN - 1);
+
+    rc = pwrite(fd, session->iobuf + pos, len, session->filepos);
+    if(rc <= 0)
+    {
+      if(rc < 0)
+        console_error(RED "pwrite: %d %s\n" RESET, errno, strerror(errno));
+      else
+        console_error(RED "pwrite: wrote 0 bytes\n" RESET);
+      session->buffersize = 0;
+      return -1;
+    }
+
+    /* hash what went to disk */
+    if(session->flags & SESSION_HASHED)
+      hash_update(&session->hash, session->iobuf + pos, rc);
+
+    session->filepos += rc;
+    pos              += rc;
+  }
+
+  session->buffersize = 0;
+  update_free_space();
+  return 0;
+}
+#endif
+
+/*! get the transfer buffer for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns aligned buffer for O_DIRECT transfers, otherwise session->buffer
+ */
+static char*
+ftp_session_xfer_buffer(ftp_session_t *session)
+{
+#ifdef __linux__
+  if(session->iobuf != NULL)
+    return session->iobuf;
+#endif
+  return session->buffer;
+}
+
+/*! get how much data a transfer may move now
+ *
+ *  @param[in] session ftp session
+ *  @param[in] len     bytes the transfer wants to move
+ *
+ *  @returns bytes to move, 0 if the transfer must wait for the rate limits
+ *
+ *  @note A throttled transfer isn't polled again until it has earned enough
+ *        tokens for a whole transfer buffer in every bucket, so it sleeps
+ *        instead of trickling out small pieces.
+ */
+static size_t
+ftp_session_allowance(ftp_session_t *session,
+                      size_t        len)
+{
+#ifdef __linux__
+  ftp_bucket_t *buckets[] =
+  {
+    &global_bucket,
+    session->host != NULL ? &session->host->bucket : NULL,
+    &session->bucket,
+  };
+  ftp_bucket_t *bucket;
+  uint64_t     now = 0, wait = 0, need, delay;
+  size_t       i;
+
+  need = len < XFER_BUFFERSIZE ? len : XFER_BUFFERSIZE;
+
+  for(i = 0; i < sizeof(buckets)/sizeof(buckets[0]); ++i)
+  {
+    bucket = buckets[i];
+    if(bucket == NULL || bucket->rate == 0)
+      continue;
+
+    if(now == 0)
+      now = ftp_file_now();
+    ftp_bucket_fill(bucket, now);
+
+    if(bucket->tokens < need)
+    {
+      delay = ((need - bucket->tokens) * 1000 + bucket->rate - 1) / bucket->rate;
+      if(delay > wait)
+        wait = delay;
+    }
+    else if(len > bucket->tokens)
+      len = bucket->tokens;
+  }
+
+  if(wait != 0)
+  {
+    session->resume = now + wait;
+    return 0;
+  }
+#endif
+
+  return len;
+}
+
+/*! account for data moved by a transfer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] len     bytes moved
+ */
+static void
+ftp_session_charge(ftp_session_t *session,
+                   size_t        len)
+{
+#ifdef __linux__
+  ftp_bucket_t *buckets[] =
+  {
+    &global_bucket,
+    session->host != NULL ? &session->host->bucket : NULL,
+    &session->bucket,
+  };
+  size_t       i;
+
+  for(i = 0; i < sizeof(buckets)/sizeof(buckets[0]); ++i)
+  {
+    if(buckets[i] == NULL || buckets[i]->rate == 0)
+      continue;
+
+    if(buckets[i]->tokens > len)
+      buckets[i]->tokens -= len;
+    else
+      buckets[i]->tokens = 0;
+  }
+
+  /* the transfer log and metrics */
+  if(session->timed >= 0 && session->timed_first == 0 && len != 0)
+  {
+    session->timed_first = ftp_clock_ns();
+    hist_record(&transfer_ttfb[session->timed],
+                (session->timed_first - session->timed_start) / 1000);
+  }
+
+  session->account_bytes += len;
+  if(session->flags & SESSION_RECV)
+    bytes_in += len;
+  else
+    bytes_out += len;
+
+  /* sample the transfer rate for STAT */
+  if(session->account_bytes - session->rate_bytes >= XFER_BUFFERSIZE)
+  {
+    uint64_t now = ftp_file_now();
+
+    if(now - session->rate_stamp >= RATE_SAMPLE_TIME)
+    {
+      session->rate       = (session->account_bytes - session->rate_bytes) * 1000
+                          / (now - session->rate_stamp);
+      session->rate_bytes = session->account_bytes;
+      session->rate_stamp = now;
+    }
+  }
+#endif
+
+  /* this round of the transfer scheduler */
+  session->deficit -= len;
+}
+
+#ifdef __linux__
+/*! get the current rate of a transfer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] now     current time in milliseconds
+ *
+ *  @returns bytes per second
+ */
+static uint64_t
+ftp_session_rate(ftp_session_t *session,
+                 uint64_t      now)
+{
+  /* a sample that has gone stale is replaced by what moved since */
+  if(now - session->rate_stamp >= RATE_SAMPLE_TIME)
+    return (session->account_bytes - session->rate_bytes) * 1000
+         / (now - session->rate_stamp);
+
+  /* no sample yet, use the average so far */
+  if(session->rate_stamp == session->rate_start)
+  {
+    if(now == session->rate_start)
+      return 0;
+    return session->account_bytes * 1000 / (now - session->rate_start);
+  }
+
+  return session->rate;
+}
+#endif
+
+#ifdef __linux__
+/*! start accounting a transfer for the transfer log and metrics
+ *
+ *  @param[in] session ftp session
+ *  @param[in] command transfer command
+ *  @param[in] path    path being transferred
+ */
+static void
+ftp_session_account_begin(ftp_session_t *session,
+                          const char    *command,
+                          const char    *path)
+{
+  session->account        = command;
+  session->account_start  = ftp_file_now();
+  session->account_offset = session->filepos;
+  session->account_bytes  = 0;
+  snprintf(session->account_path, sizeof(session->account_path), "%s", path);
+}
+
+/*! copy a string as a JSON string body
+ *
+ *  @param[out] dst output buffer
+ *  @param[in]  cap output buffer size
+ *  @param[in]  src string to copy
+ *
+ *  @returns bytes written, not counting the nul terminator
+ */
+static size_t
+ftp_json_escape(char       *dst,
+                size_t     cap,
+                const char *src)
+{
+  size_t len = 0;
+
+  for(; *src && len + 7 < cap; ++src)
+  {
+    if(*src == '"' || *src == '\\')
+    {
+      dst[len++] = '\\';
+      dst[len++] = *src;
+    }
+    else if((unsigned char)*src < 0x20)
+      len += sprintf(dst + len, "\\u%04x", (unsigned char)*src);
+    else
+      dst[len++] = *src;
+  }
+
+  dst[len] = 0;
+  return len;
+}
+
+/*! write the log record of a finished transfer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] code    final reply code of the transfer
+ */
+static void
+ftp_session_account_end(ftp_session_t *session,
+                        int           code)
+{
+  static char record[3*sizeof(session->account_path)];
+  char        stamp[32];
+  char        *p;
+  time_t      now      = time(NULL);
+  uint64_t    duration = ftp_file_now() - session->account_start;
+  uint64_t    rate     = session->account_bytes * 1000 / (duration ? duration : 1);
+  bool        incoming = strcmp(session->account, "STOR") == 0
+                      || strcmp(session->account, "STOU") == 0
+                      || strcmp(session->account, "APPE") == 0;
+  size_t      len, i;
+
+  /* count it for the metrics endpoint */
+  for(i = 0; i < num_transfer_counts; ++i)
+  {
+    if(transfer_counts[i].command == session->account
+    && transfer_counts[i].code == code)
+      break;
+  }
+
+  if(i == num_transfer_counts && num_transfer_counts < METRICS_TRANSFERS)
+  {
+    transfer_counts[i].command = session->account;
+    transfer_counts[i].code    = code;
+    ++num_transfer_counts;
+  }
+
+  if(i < num_transfer_counts)
+    ++transfer_counts[i].count;
+
+  if(XFERLOG_FORMAT == XFERLOG_NONE)
+  {
+    session->account = NULL;
+    return;
+  }
+
+  if(XFERLOG_FORMAT == XFERLOG_WUFTPD)
+  {
+    /* xferlog only knows about file transfers */
+    if(strcmp(session->account, "RETR") != 0 && !incoming)
+    {
+      session->account = NULL;
+      return;
+    }
+
+    /* fields are separated by spaces */
+    for(p = session->account_path; *p; ++p)
+    {
+      if(isspace((int)*p))
+        *p = '_';
+    }
+
+    strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", localtime(&now));
+    len = snprintf(record, sizeof(record),
+                   "%s %" PRIu64 " %s %" PRIu64 " %s %c _ %c a anonymous ftp 0 * %c\n",
+                   stamp, (duration + 999) / 1000, inet_ntoa(session->client),
+                   session->account_bytes, session->account_path,
+                   session->flags & SESSION_BINARY ? 'b' : 'a',
+                   incoming ? 'i' : 'o', code == 226 || code == 250 ? 'c' : 'i');
+  }
+  else
+  {
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    len = snprintf(record, sizeof(record),
+                   "{\"time\":\"%s\",\"command\":\"%s\",\"client\":\"%s\",\"path\":\"",
+                   stamp, session->account, inet_ntoa(session->client));
+    len += ftp_json_escape(record + len, sizeof(record) - len - 256,
+                           session->account_path);
+    len += snprintf(record + len, sizeof(record) - len,
+                    "\",\"offset\":%" PRIu64 ",\"bytes\":%" PRIu64
+                    ",\"duration_ms\":%" PRIu64 ",\"bytes_per_sec\":%" PRIu64
+                    ",\"code\":%d}\n",
+                    session->account_offset, session->account_bytes,
+                    duration, rate, code);
+  }
+
+  session->account = NULL;
+  if(len < sizeof(record))
+    console_xferlog(record, len);
+}
+
+/*! stop timing a command at its final reply
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_timed_end(ftp_session_t *session)
+{
+  uint64_t now     = ftp_clock_ns();
+  uint64_t elapsed = now - session->timed_start;
+
+  hist_record(&command_latency[session->timed], elapsed / 1000);
+  if(session->timed_first != 0)
+    hist_record(&transfer_time[session->timed], (now - session->timed_first) / 1000);
+
+  FTP_PROBE3(command__done, session, ftp_commands[session->timed].name, elapsed);
+  session->timed = -1;
+}
+#endif
+
+#if ENABLE_PROBES || STORE_HASH
+/*! get file descriptor of open file for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns file descriptor
+ */
+static int
+ftp_session_fileno(ftp_session_t *session)
+{
+#ifdef __linux__
+  if(session->file != NULL)
+    return session->file->fd;
+  if(session->upload != NULL)
+    return session->upload->fd;
+#endif
+  if(session->fp == NULL)
+    return -1;
+  return fileno(session->fp);
+}
+#endif
+
+/*! close open file for ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_close_file(ftp_session_t *session)
+{
+  int rc;
+
+#if ENABLE_PROBES
+  if(session->cache != NULL || session->copy_src >= 0 || ftp_session_fileno(session) >= 0)
+    FTP_PROBE2(file__close, session, session->filepos);
+#endif
+
+  if(session->fp != NULL)
+  {
+    rc = fclose(session->fp);
+    if(rc != 0)
+      console_error(RED "fclose: %d %s\n" RESET, errno, strerror(errno));
+  }
+
+#ifdef __linux__
+  if(session->file != NULL)
+    ftp_file_put(session->file);
+  session->file = NULL;
+
+  /* keep what was received of an aborted O_DIRECT upload */
+  if(session->upload != NULL && session->iobuf != NULL)
+    ftp_session_flush_direct(session);
+
+  if(session->direct_fd >= 0 && close(session->direct_fd) != 0)
+    console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
+  session->direct_fd = -1;
+
+  if(session->iobuf != NULL)
+    ftp_pool_put(session->iobuf);
+  session->iobuf = NULL;
+
+  if(session->map != NULL && munmap(session->map, session->maplen) != 0)
+    console_error(RED "munmap: %d %s\n" RESET, errno, strerror(errno));
+  session->map     = NULL;
+  session->zc_sent = 0;
+  session->zc_done = 0;
+
+  if(session->upload != NULL)
+    ftp_upload_put(session->upload);
+  session->upload = NULL;
+  session->commit = 0;
+#endif
+
+  if(session->copy_src >= 0 && close(session->copy_src) != 0)
+    console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
+  if(session->copy_dst >= 0 && close(session->copy_dst) != 0)
+    console_error(RED "close: %d %s\n" RESET, errno, strerror(errno));
+
+  if(session->cache != NULL)
+    ftp_cache_put(session->cache);
+
+  session->fp       = NULL;
+  session->cache    = NULL;
+  session->copy_src = -1;
+  session->copy_dst = -1;
+  session->filepos  = 0;
+  session->rangeend = 0;
+}
+
+/*! open file for reading for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_session_open_file_read(ftp_session_t *session)
+{
+#ifdef __linux__
+  /* share the descriptor with other sessions reading this file; its stat
+   * data comes from the descriptor, so the size and the cache check are
+   * for the file we are about to send
+   */
+  session->file = ftp_file_get(session->buffer);
+  if(session->file == NULL)
+    return -1;
+
+  session->filesize = session->file->st.st_size;
+
+  /* send small files from memory */
+  session->cache = ftp_cache_get(session->buffer, &session->file->st);
+  if(session->cache != NULL)
+  {
+    ftp_file_put(session->file);
+    session->file = NULL;
+    return 0;
+  }
+
+  session->readahead  = session->filepos;
+  session->readwindow = READAHEAD_WINDOW;
+  session->ratestamp  = 0;
+  session->dropbehind = session->filepos;
+
+  /* keep very large files out of the page cache */
+  if(DIRECT_IO_SIZE > 0 && session->filesize >= DIRECT_IO_SIZE)
+    ftp_session_open_direct(session, session->file->fd, O_RDONLY);
+  return 0;
+#else
+  int         rc;
+  struct stat st;
+
+  rc = ftp_file_stat(session->buffer, &st, true);
+  if(rc != 0)
+  {
+    console_error(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+
+  /* send small files from memory */
+  session->cache = ftp_cache_get(session->buffer, &st);
+  if(session->cache != NULL)
+  {
+    session->filesize = st.st_size;
+    return 0;
+  }
+
+  /* open file in read mode */
+  session->fp = fopen(session->buffer, "rb");
+  if(session->fp == NULL)
+  {
+    console_error(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+
+  /* it's okay if this fails */
+  errno = 0;
+  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
+  if(rc != 0)
+  {
+    console_error(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+  }
+
+  /* get the file size */
+  rc = fstat(fileno(session->fp), &st);
+  if(rc != 0)
+  {
+    console_error(RED "fstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+  session->filesize = st.st_size;
+
+  if(session->filepos != 0)
+  {
+    rc = fseek(session->fp, session->filepos, SEEK_SET);
+    if(rc != 0)
+    {
+      console_error(RED "fseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+#endif
+}
+
+/*! read from an open file for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns bytes read
+ */
+static ssize_t
+ftp_session_read_file(ftp_session_t *session)
+{
+  ssize_t rc;
+  size_t  len = sizeof(session->buffer);
+
+#ifdef __linux__
+  if(session->iobuf != NULL)
+    len = DIRECT_IO_BUFFERSIZE;
+#endif
+
+  /* don't read past the end of a RANG byte range */
+  if(session->rangeend != 0)
+  {
+    if(session->filepos >= session->rangeend)
+      return 0;
+    if(session->rangeend - session->filepos < len)
+      len = session->rangeend - session->filepos;
+  }
+
+  if(session->cache != NULL)
+  {
+    /* copy from the cached contents */
+    if(session->filepos >= (uint64_t)session->cache->size)
+      return 0;
+    if(session->cache->size - session->filepos < len)
+      len = session->cache->size - session->filepos;
+
+    memcpy(session->buffer, session->cache->data + session->filepos, len);
+    session->filepos += len;
+    return len;
+  }
+
+#ifdef __linux__
+  if(session->iobuf != NULL && session->filepos % DIRECT_IO_ALIGN != 0)
+  {
+    /* read up to the next aligned offset through the page cache */
+    if(len > DIRECT_IO_ALIGN - session->filepos % DIRECT_IO_ALIGN)
+      len = DIRECT_IO_ALIGN - session->filepos % DIRECT_IO_ALIGN;
+    rc = pread(session->file->fd, session->iobuf, len, session->filepos);
+  }
+  else if(session->iobuf != NULL)
+  {
+    /* read whole blocks; the last one comes back short at end of file */
+    rc = pread(session->direct_fd, session->iobuf,
+               (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1),
+               session->filepos);
+    if(rc > 0 && (size_t)rc > len)
+      rc = len;
+  }
+  else
+  {
+    ftp_session_readahead(session);
+
+    /* read file at our own position; the descriptor may be shared */
+    rc = pread(session->file->fd, session->buffer, len, session->filepos);
+  }
+  if(rc < 0)
+  {
+    console_error(RED "pread: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+#else
+  /* read file at current position */
+  rc = fread(session->buffer, 1, len, session->fp);
+  if(rc < 0)
+  {
+    console_error(RED "fread: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+#endif
+
+  /* adjust file position */
+  session->filepos += rc;
+
+  return rc;
+}
+
+/*! open file for writing for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] append  whether to append
+ *
+ *  @returns -1 for error
+ *
+ *  @note truncates file
+ */
+static int
+ftp_session_open_file_write(ftp_session_t *session,
+                            bool          append)
+{
+#ifdef __linux__
+  bool unique = (session->flags & SESSION_UNIQUE) != 0;
+
+  /* open or join the upload */
+  session->upload = ftp_upload_get(session->buffer, append, session->filepos,
+                                   session->filepos != 0 || session->allocsize != 0,
+                                   unique);
+  if(session->upload == NULL)
+    return -1;
+  session->uploadstart    = session->filepos;
+  session->writeback      = session->filepos;
+  session->writeback_done = session->filepos;
+
+  /* reserve the space the client told us about */
+  if(session->allocsize != 0)
+    ftp_session_preallocate(session);
+
+  /* keep uploads announced as very large out of the page cache */
+  if(DIRECT_IO_SIZE > 0 && !append && session->allocsize >= DIRECT_IO_SIZE)
+    ftp_session_open_direct(session, session->upload->fd, O_WRONLY);
+
+  update_free_space();
+  return 0;
+#else
+  int        rc;
+  const char *mode = "wb";
+
+  if(append)
+    mode = "ab";
+  else if(session->filepos != 0)
+    mode = "r+b";
+
+  /* open file in write mode */
+  session->fp = fopen(session->buffer, mode);
+  if(session->fp == NULL)
+  {
+    console_error(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+
+  update_free_space();
+
+  /* it's okay if this fails */
+  errno = 0;
+  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
+  if(rc != 0)
+  {
+    console_error(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+  }
+
+  /* check if this had REST but not APPE */
+  if(session->filepos != 0 && !append)
+  {
+    /* seek to the REST offset */
+    rc = fseek(session->fp, session->filepos, SEEK_SET);
+    if(rc != 0)
+    {
+      console_error(RED "fseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+#endif
+}
+
+/*! write to an open file for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns bytes written
+ */
+static ssize_t
+ftp_session_write_file(ftp_session_t *session)
+{
+  ssize_t rc;
+
+#ifdef __linux__
+  /* write at our own position; the descriptor may be shared */
+  if(session->upload->append)
+    rc = write(session->upload->fd, session->buffer + session->bufferpos,
+               session->buffersize - session->bufferpos);
+  else
+    rc = pwrite(session->upload->fd, session->buffer + session->bufferpos,
+                session->buffersize - session->bufferpos, session->filepos);
+  if(rc < 0)
+  {
+    console_error(RED "pwrite: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+  else if(rc == 0)
+    console_error(RED "pwrite: wrote 0 bytes\n" RESET);
+#else
+  /* write to file at current position */
+  rc = fwrite(session->buffer + session->bufferpos,
+              1, session->buffersize - session->bufferpos,
+              session->fp);
+  if(rc < 0)
+  {
+    console_error(RED "fwrite: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+  else if(rc == 0)
+    console_error(RED "fwrite: wrote 0 bytes\n" RESET);
+#endif
+
+  /* adjust file position */
+  session->filepos += rc;
+
+#ifdef __linux__
+  /* keep the dirty pages of this upload bounded */
+  if(WRITEBACK_CHUNK > 0 && !session->upload->append
+  && session->filepos - session->writeback >= WRITEBACK_CHUNK)
+    ftp_session_writeback(session);
+#endif
+
+  update_free_space();
+  return rc;
+}
+
+#if STORE_HASH
+/*! get the name of the xattr holding a stored digest
+ *
+ *  @param[in]  algo hash algorithm
+ *  @param[out] name xattr name
+ */
+static void
+hash_xattr_name(hash_algo_t algo,
+                char        name[32])
+{
+  snprintf(name, 32, "user.ftpd.%s", hash_name(algo));
+}
+
+/*! store the digest of an open file for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] hex     hex digest of session->hash
+ *
+ *  @note The digest is only kept if it covers the whole file. It is tagged
+ *        with the file size and mtime so that it is ignored once the file
+ *        changes.
+ */
+static void
+ftp_session_save_hash(ftp_session_t *session,
+                      const char    *hex)
+{
+  char        name[32], value[128];
+  int         len;
+  struct stat st;
+
+  /* the digest must start at the beginning of the file */
+  if(session->filepos != session->hash.length)
+    return;
+
+  /* files sent from the cache are small enough to hash again */
+  if(ftp_session_fileno(session) < 0)
+    return;
+
+  if(fstat(ftp_session_fileno(session), &st) != 0)
+  {
+    console_error(RED "fstat: %d %s\n" RESET, errno, strerror(errno));
+    return;
+  }
+
+  /* ... and cover all of it */
+  if((uint64_t)st.st_size != session->hash.length)
+    return;
+
+  hash_xattr_name(session->hash.algo, name);
+  len = snprintf(value, sizeof(value), "%lld %lld.%09ld %s",
+                 (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                 (long)st.st_mtim.tv_nsec, hex);
+
+  if(fsetxattr(ftp_session_fileno(session), name, value, len, 0) != 0)
+    console_error(RED "fsetxattr: %d %s\n" RESET, errno, strerror(errno));
+}
+
+/*! look up a stored digest
+ *
+ *  @param[in]  path path to look up
+ *  @param[in]  st   current stat data for path
+ *  @param[in]  algo hash algorithm
+ *  @param[out] hex  hex digest
+ *
+ *  @returns -1 if there is no up-to-date digest
+ */
+static int
+ftp_lookup_hash(const char        *path,
+                const struct stat *st,
+                hash_algo_t       algo,
+                char              hex[HASH_MAX_HEX])
+{
+  char      name[32], value[128];
+  ssize_t   len;
+  long long size, sec;
+  long      nsec;
+
+  hash_xattr_name(algo, name);
+  len = getxattr(path, name, value, sizeof(value) - 1);
+  if(len < 0)
+    return -1;
+  value[len] = 0;
+
+  if(sscanf(value, "%lld %lld.%ld %64s", &size, &sec, &nsec, hex) != 4)
+    return -1;
+
+  /* make sure the file hasn't changed since it was hashed */
+  if(size != st->st_size || sec != st->st_mtim.tv_sec
+  || nsec != st->st_mtim.tv_nsec)
+    return -1;
+
+  return 0;
+}
+#endif
+
+/*! close current working directory for ftp session
+ *
+ *   @param[in] session ftp session
+ */
+static void
+ftp_session_close_cwd(ftp_session_t *session)
+{
+  int rc;
+
+  /* close open directory pointer */
+  if(session->dp != NULL)
+  {
+    rc = closedir(session->dp);
+    if(rc != 0)
+      console_error(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
+  }
+  session->dp = NULL;
+
+  /* close directories left open by an unfinished RMTREE */
+  if(session->tree != NULL)
+  {
+    while(session->tree->depth > 0)
+    {
+      rc = closedir(session->tree->dirs[--session->tree->depth].dp);
+      if(rc != 0)
+        console_error(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
+    }
+
+    free(session->tree->dirs);
+    free(session->tree);
+  }
+  session->tree = NULL;
+}
+
+/*! open a directory for SITE RMTREE
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ *
+ *  @note The session buffer holds the directory's path. Subdirectories are
+ *        opened relative to their parent where the platform allows it.
+ */
+static int
+ftp_session_push_tree(ftp_session_t *session)
+{
+  ftp_tree_t     *tree = session->tree;
+  ftp_tree_dir_t *dirs;
+  DIR            *dp;
+
+  if(tree->depth == tree->capacity)
+  {
+    dirs = (ftp_tree_dir_t*)realloc(tree->dirs,
+                                    (tree->capacity + 16) * sizeof(ftp_tree_dir_t));
+    if(dirs == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    tree->dirs      = dirs;
+    tree->capacity += 16;
+  }
+
+#ifdef __linux__
+  if(tree->depth > 0)
+  {
+    ftp_tree_dir_t *parent = &tree->dirs[tree->depth-1];
+    int            fd;
+
+    /* never follow a link that replaced the directory */
+    fd = openat(dirfd(parent->dp), session->buffer + parent->pathlen + 1,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+      return -1;
+
+    dp = fdopendir(fd);
+    if(dp == NULL)
+      close(fd);
+  }
+  else
+#endif
+  dp = opendir(session->buffer);
+  if(dp == NULL)
+    return -1;
+
+  tree->dirs[tree->depth].dp      = dp;
+  tree->dirs[tree->depth].pathlen = strlen(session->buffer);
+  ++tree->depth;
+
+  return 0;
+}
+
+/*! remove an entry of a directory for SITE RMTREE
+ *
+ *  @param[in] session ftp session
+ *  @param[in] dir     parent directory
+ *  @param[in] isdir   whether the entry is a directory
+ *
+ *  @returns -1 for error
+ *
+ *  @note The session buffer holds the entry's path.
+ */
+static int
+ftp_session_unlink_tree(ftp_session_t  *session,
+                        ftp_tree_dir_t *dir,
+                        bool           isdir)
+{
+#ifdef __linux__
+  return unlinkat(dirfd(dir->dp), session->buffer + dir->pathlen + 1,
+                  isdir ? AT_REMOVEDIR : 0);
+#else
+  if(isdir)
+    return rmdir(session->buffer);
+  return unlink(session->buffer);
+#endif
+}
+
+/*! open current working directory for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @return -1 for failure
+ */
+static int
+ftp_session_open_cwd(ftp_session_t *session)
+{
+  /* open current working directory */
+  session->dp = opendir(session->cwd);
+  if(session->dp == NULL)
+  {
+    console_error(RED "opendir '%s': %d %s\n" RESET, session->cwd, errno, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! set state for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] state   state to set
+ *  @param[in] flags   flags
+ */
+static void
+ftp_session_set_state(ftp_session_t     *session,
+                      session_state_t   state,
+                      set_state_flags_t flags)
+{
+  if(session->state != state)
+  {
+    FTP_PROBE3(state, session, session->state, state);
+    session->state_time = time(NULL);
+#ifdef __linux__
+    if(state == DATA_TRANSFER_STATE)
+    {
+      /* start measuring the transfer rate */
+      session->rate_start = session->rate_stamp = ftp_file_now();
+      session->rate_bytes = session->account_bytes;
+      session->rate       = 0;
+    }
+#endif
+  }
+
+  session->state = state;
+
+  /* close pasv and data sockets */
+  if(flags & CLOSE_PASV)
+    ftp_session_close_pasv(session);
+  if(flags & CLOSE_DATA)
+    ftp_session_close_data(session);
+
+  if(state == COMMAND_STATE)
+  {
+    /* the next transfer is not a STOU unless it says so */
+    session->flags &= ~SESSION_UNIQUE;
+
+    /* close file/cwd */
+    ftp_session_close_file(session);
+    ftp_session_close_cwd(session);
+  }
+}
+
+/*! fill directory entry
+ *
+ *  @param[in] session ftp session
+ *  @param[in] st      stat data
+ *  @param[in] path    path to fill
+ *  @param[in] len     path length
+ *  @param[in] type    type fact
+ *
+ *  @returns errno
+ */
+static int
+ftp_session_fill_dirent_type(ftp_session_t *session, const struct stat *st,
+                             const char *path, size_t len, const char *type)
+{
+#if STORE_HASH
+  char hash[HASH_MAX_HEX];
+  bool have_hash = false;
+
+  /* session->buffer still holds the full path of a listed file */
+  if((session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
+  && (session->mlst_flags & SESSION_MLST_HASH) && S_ISREG(st->st_mode) && !type)
+    have_hash = ftp_lookup_hash(session->buffer, st, session->hash_algo, hash) == 0;
+#endif
+
+  session->buffersize = 0;
+
+  if(session->dir_mode == XFER_DIR_MLSD
+  || session->dir_mode == XFER_DIR_MLST)
+  {
+    if(session->dir_mode == XFER_DIR_MLST)
+      session->buffer[session->buffersize++] = ' ';
+
+    if(session->mlst_flags & SESSION_MLST_TYPE)
+    {
+      /* type fact */
+      if(!type)
+      {
+        type = "???";
+        if(S_ISREG(st->st_mode))
+          type = "file";
+        else if(S_ISDIR(st->st_mode))
+          type = "dir";
+#if !defined(_3DS) && !defined(__SWITCH__)
+        else if(S_ISLNK(st->st_mode))
+          type = "os.unix=symlink";
+        else if(S_ISCHR(st->st_mode))
+          type = "os.unix=character";
+        else if(S_ISBLK(st->st_mode))
+          type = "os.unix=block";
+        else if(S_ISFIFO(st->st_mode))
+          type = "os.unix=fifo";
+        else if(S_ISSOCK(st->st_mode))
+          type = "os.unix=socket";
+#endif
+      }
+
+      session->buffersize +=
+        sprintf(session->buffer + session->buffersize, "Type=%s;", type);
+    }
+
+    if(session->mlst_flags & SESSION_MLST_SIZE)
+    {
+      /* size fact */
+      session->buffersize +=
+        sprintf(session->buffer + session->buffersize, "Size=%lld;",
+                (signed long long)st->st_size);
+    }
+
+    if(session->mlst_flags & SESSION_MLST_MODIFY)
+    {
+      /* mtime fact */
+      struct tm *tm = gmtime(&st->st_mtime);
+      if(tm == NULL)
+        return errno;
+
+      session->buffersize +=
+        strftime(session->buffer + session->buffersize,
+                 sizeof(session->buffer) - session->buffersize,
+                 "Modify=%Y%m%d%H%M%S;", tm);
+      if(session->buffersize == 0)
+        return EOVERFLOW;
+    }
+
+    if(session->mlst_flags & SESSION_MLST_PERM)
+    {
+      /* permission fact */
+      strcpy(session->buffer + session->buffersize, "Perm=");
+      session->buffersize += strlen("Perm=");
+
+      /* append permission */
+      if(S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
+        session->buffer[session->buffersize++] = 'a';
+
+      /* create permission */
+      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
+        session->buffer[session->buffersize++] = 'c';
+
+      /* delete permission */
+      session->buffer[session->buffersize++] = 'd';
+
+      /* chdir permission */
+      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IXUSR))
+        session->buffer[session->buffersize++] = 'e';
+
+      /* rename permission */
+      session->buffer[session->buffersize++] = 'f';
+
+      /* list permission */
+      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IRUSR))
+        session->buffer[session->buffersize++] = 'l';
+
+      /* mkdir permission */
+      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
+        session->buffer[session->buffersize++] = 'm';
+
+      /* delete permission */
+      if(S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
+        session->buffer[session->buffersize++] = 'p';
+
+      /* read permission */
+      if(S_ISREG(st->st_mode) && (st->st_mode & S_IRUSR))
+        session->buffer[session->buffersize++] = 'r';
+
+      /* write permission */
+      if(S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
+        session->buffer[session->buffersize++] = 'w';
+
+      session->buffer[session->buffersize++] = ';';
+    }
+
+    if(session->mlst_flags & SESSION_MLST_UNIX_MODE)
+    {
+      /* unix mode fact */
+      mode_t mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID;
+      session->buffersize +=
+        sprintf(session->buffer + session->buffersize, "UNIX.mode=0%lo;",
+                (unsigned long)(st->st_mode & mask));
+    }
+
+#if STORE_HASH
+    if(have_hash)
+    {
+      /* stored digest fact */
+      session->buffersize +=
+        sprintf(session->buffer + session->buffersize, "X.hash=%s:%s;",
+                hash_name(session->hash_algo), hash);
+    }
+#endif
+
+    /* make sure space precedes name */
+    if(session->buffer[session->buffersize-1] != ' ')
+      session->buffer[session->buffersize++] = ' ';
+  }
+  else if(session->dir_mode != XFER_DIR_NLST)
+  {
+    if(session->dir_mode == XFER_DIR_STAT)
+      session->buffer[session->buffersize++] = ' ';
+
+    /* perms nlinks owner group size */
+    session->buffersize +=
+      sprintf(session->buffer + session->buffersize,
+              "%c%c%c%c%c%c%c%c%c%c %lu 3DS 3DS %lld ",
+              S_ISREG(st->st_mode)  ? '-' :
+              S_ISDIR(st->st_mode)  ? 'd' :
+#if !defined(_3DS) && !defined(__SWITCH__)
+              S_ISLNK(st->st_mode)  ? 'l' :
+              S_ISCHR(st->st_mode)  ? 'c' :
+              S_ISBLK(st->st_mode)  ? 'b' :
+              S_ISFIFO(st->st_mode) ? 'p' :
+              S_ISSOCK(st->st_mode) ? 's' :
+#endif
+              '?',
+              st->st_mode & S_IRUSR ? 'r' : '-',
+              st->st_mode & S_IWUSR ? 'w' : '-',
+              st->st_mode & S_IXUSR ? 'x' : '-',
+              st->st_mode & S_IRGRP ? 'r' : '-',
+              st->st_mode & S_IWGRP ? 'w' : '-',
+              st->st_mode & S_IXGRP ? 'x' : '-',
+              st->st_mode & S_IROTH ? 'r' : '-',
+              st->st_mode & S_IWOTH ? 'w' : '-',
+              st->st_mode & S_IXOTH ? 'x' : '-',
+              (unsigned long)st->st_nlink,
+              (signed long long)st->st_size);
+
+    /* timestamp */
+    struct tm *tm = gmtime(&st->st_mtime);
+    if(tm)
+    {
+      const char *fmt = "%b %e %Y ";
+      if(session->timestamp > st->st_mtime
+      && session->timestamp - st->st_mtime < (60*60*24*365/2))
+      {
+        fmt = "%b %e %H:%M ";
+      }
+
+      session->buffersize +=
+        strftime(session->buffer + session->buffersize,
+                 sizeof(session->buffer) - session->buffersize,
+                 fmt, tm);
+    }
+    else
+    {
+      session->buffersize +=
+        sprintf(session->buffer + session->buffersize, "Jan 1 1970 ");
+    }
+  }
+
+  if(session->buffersize + len + 2 > sizeof(session->buffer))
+  {
+    /* buffer will overflow */
+    return EOVERFLOW;
+  }
+
+  /* copy path */
+  memcpy(session->buffer+session->buffersize, path, len);
+  len = session->buffersize + len;
+  session->buffer[len++] = '\r';
+  session->buffer[len++] = '\n';
+  session->buffersize = len;
+
+  return 0;
+}
+
+/*! fill directory entry
+ *
+ *  @param[in] session ftp session
+ *  @param[in] st      stat data
+ *  @param[in] path    path to fill
+ *  @param[in] len     path length
+ *
+ *  @returns errno
+ */
+static int
+ftp_session_fill_dirent(ftp_session_t *session, const struct stat *st,
+                        const char *path, size_t len)
+{
+  return ftp_session_fill_dirent_type(session, st, path, len, NULL);
+}
+
+/*! transfer loop
+ *
+ *  Try to transfer this session's share of data without blocking
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note Transfers are scheduled by deficit round robin. Each loop iteration
+ *        adds weight quantums to the deficit of a ready transfer, and it runs
+ *        until it has moved that many bytes, so one client on a fast link
+ *        can't hold up the others or the command sockets. Overshoot is paid
+ *        back in the next round.
+ */
+static void
+ftp_session_transfer(ftp_session_t *session)
+{
+  int      rc;
+#ifdef __linux__
+  uint64_t start = ftp_file_now();
+#endif
+#if ENABLE_PROBES
+  int64_t  deficit;
+#endif
+
+  /* a transfer still paying back overshoot sits this round out */
+  session->deficit += (int64_t)TRANSFER_QUANTUM * session->weight;
+  while(session->deficit > 0)
+  {
+#if ENABLE_PROBES
+    deficit = session->deficit;
+#endif
+    rc = session->transfer(session);
+    FTP_PROBE3(transfer, session, deficit - session->deficit, rc);
+
+    /* a transfer that is waiting doesn't bank its credit */
+    if(rc != 0)
+    {
+      if(session->deficit > 0)
+        session->deficit = 0;
+      return;
+    }
+
+#ifdef __linux__
+    /* neither does one held up by slow storage */
+    if(ftp_file_now() - start >= TRANSFER_QUANTUM_TIME)
+    {
+      if(session->deficit > 0)
+        session->deficit = 0;
+      return;
+    }
+#endif
+  }
+}
+
+/*! encode a path
+ *
+ *  @param[in]     path   path to encode
+ *  @param[in,out] len    path length
+ *  @param[in]     quotes whether to encode quotes
+ *
+ *  @returns encoded path
+ *
+ *  @note The caller must free the returned path
+ */
+static char*
+encode_path(const char *path,
+            size_t     *len,
+            bool       quotes)
+{
+  bool   enc = false;
+  size_t i, diff = 0;
+  char   *out, *p = (char*)path;
+
+  /* check for \n that needs to be encoded */
+  if(memchr(p, '\n', *len) != NULL)
+    enc = true;
+
+  if(quotes)
+  {
+    /* check for " that needs to be encoded */
+    p = (char*)path;
+    do
+    {
+      p = memchr(p, '"', path + *len - p);
+      if(p != NULL)
+      {
+        ++p;
+        ++diff;
+      }
+    } while(p != NULL);
+  }
+
+  /* check if an encode was needed */
+  if(!enc && diff == 0)
+    return strdup(path);
+
+  /* allocate space for encoded path */
+  p = out = (char*)malloc(*len + diff);
+  if(out == NULL)
+    return NULL;
+
+  /* copy the path while performing encoding */
+  for(i = 0; i < *len; ++i)
+  {
+    if(*path == '\n')
+    {
+      /* encoded \n is \0 */
+      *p++ = 0;
+    }
+    else if(quotes && *path == '"')
+    {
+      /* encoded " is "" */
+      *p++ = '"';
+      *p++ = '"';
+    }
+    else
+      *p++ = *path;
+    ++path;
+  }
+
+  *len += diff;
+  return out;
+}
+
+/*! decode a path
+ *
+ *  @param[in] session ftp session
+ *  @param[in] len     command length
+ */
+static void
+decode_path(ftp_session_t *session,
+            size_t        len)
+{
+  size_t i;
+
+  /* decode \0 from the first command */
+  for(i = 0; i < len; ++i)
+  {
+    /* this is an encoded \n */
+    if(session->cmd_buffer[i] == 0)
+      session->cmd_buffer[i] = '\n';
+  }
+}
+
+/*! fill cdir directory entry
+ *
+ *  @param[in] session ftp session
+ *  @param[in] path    path to fill
+ *
+ *  @returns errno
+ */
+static int
+ftp_session_fill_dirent_cdir(ftp_session_t *session, const char *path)
+{
+  int         rc;
+  struct stat st;
+  char        *buffer;
+  size_t      len;
+
+  rc = stat(path, &st);
+  /* double-check this was a directory */
+  if(rc == 0 && !S_ISDIR(st.st_mode))
+  {
+    /* shouldn't happen but just in case */
+    rc = -1;
+    errno = ENOTDIR;
+  }
+  if(rc != 0)
+    return errno;
+
+  /* encode \n in path */
+  len = strlen(path);
+  buffer = encode_path(path, &len, false);
+  if(!buffer)
+    return ENOMEM;
+
+  /* fill dirent with listed directory as type=cdir */
+  rc = ftp_session_fill_dirent_type(session, &st, buffer, len, "cdir");
+  free(buffer);
+
+  return rc;
+}
+
+/*! send a response on the command socket
+ *
+ *  @param[in] session ftp session
+ *  @param[in] buffer  buffer to send
+ *  @param[in] len     buffer length
+ */
+static void
+ftp_send_response_buffer(ftp_session_t *session,
+                         const char    *buffer,
+                         size_t        len)
+{
+  ssize_t rc, to_send;
+
+  if(session->cmd_fd < 0)
+    return;
+
+  /* send response */
+  to_send = len;
+  console_debug(GREEN "%s" RESET, buffer);
+  rc = send(session->cmd_fd, buffer, to_send, 0);
+  if(rc < 0)
+  {
+    console_error(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_cmd(session);
+  }
+  else if(rc != to_send)
+  {
+    console_error(RED "only sent %u/%u bytes\n" RESET,
+                  (unsigned int)rc, (unsigned int)to_send);
+    ftp_session_close_cmd(session);
+  }
+}
+
+__attribute__((format(printf,3,4)))
+/*! send ftp response to ftp session's peer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] code    response code
+ *  @param[in] fmt     format string
+ *  @param[in] ...     format arguments
+ */
+static void
+ftp_send_response(ftp_session_t *session,
+                  int           code,
+                  const char    *fmt, ...)
+{
+  static char buffer[CMD_BUFFERSIZE];
+  ssize_t     rc;
+  va_list     ap;
+
+#ifdef __linux__
+  /* the first final reply after a transfer ends is its result */
+  if(session->account != NULL && code >= 200
+  && session->state == COMMAND_STATE)
+    ftp_session_account_end(session, code);
+
+  /* a complete reply ends the command being timed */
+  if(session->timed >= 0 && (code >= 200 || code <= -200)
+  && session->state == COMMAND_STATE)
+    ftp_session_timed_end(session);
+#endif
+
+  if(session->cmd_fd < 0)
+    return;
+
+  /* print response code and message to buffer */
+  va_start(ap, fmt);
+  if(code > 0)
+    rc = sprintf(buffer, "%d ", code);
+  else
+    rc = sprintf(buffer, "%d-", -code);
+  rc += vsnprintf(buffer+rc, sizeof(buffer)-rc, fmt, ap);
+  va_end(ap);
+
+  if(rc >= sizeof(buffer))
+  {
+    /* couldn't fit message; just send code */
+    console_error(RED "%s: buffersize too small\n" RESET, __func__);
+    if(code > 0)
+      rc = sprintf(buffer, "%d \r\n", code);
+    else
+      rc = sprintf(buffer, "%d-\r\n", -code);
+  }
+
+  ftp_send_response_buffer(session, buffer, rc);
+}
+
+/*! destroy ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns the next session in the list
+ */
+static ftp_session_t*
+ftp_session_destroy(ftp_session_t *session)
+{
+  ftp_session_t *next = session->next;
+
+  FTP_PROBE1(session__destroy, session);
+
+  /* close all sockets/files */
+  ftp_session_close_cmd(session);
+  ftp_session_close_pasv(session);
+  ftp_session_close_data(session);
+  ftp_session_close_file(session);
+  ftp_session_close_cwd(session);
+
+  /* unlink from sessions list */
+  if(session->next)
+    session->next->prev = session->prev;
+  if(session == sessions)
+    sessions = session->next;
+  else
+  {
+    session->prev->next = session->next;
+    if(session == sessions->prev)
+      sessions->prev = session->prev;
+  }
+
+#ifdef __linux__
+  /* the client went away in the middle of a transfer */
+  if(session->account != NULL)
+    ftp_session_account_end(session, 426);
+
+  if(session->host != NULL)
+    ftp_host_put(session->host);
+#endif
+
+  /* deallocate */
+  free(session);
+  --num_sessions;
+
+  return next;
+}
+
+/*! decide whether to admit a new connection
+ *
+ *  @param[in] addr client address
+ *
+ *  @returns NULL to admit, otherwise the reason for turning it away
+ */
+static const char*
+ftp_admit(struct in_addr addr)
+{
+#ifdef __linux__
+  ftp_host_t *host;
+  unsigned   subnet = 0;
+  in_addr_t  mask   = htonl(~0u << (32 - SUBNET_PREFIX));
+#endif
+
+  if(MAX_SESSIONS != 0 && num_sessions >= MAX_SESSIONS)
+  {
+    ++rejected_full;
+    return "Too many users";
+  }
+
+#ifdef __linux__
+  for(host = hosts; host != NULL; host = host->next)
+  {
+    if(host->addr.s_addr == addr.s_addr
+    && MAX_SESSIONS_PER_HOST != 0 && host->refs >= MAX_SESSIONS_PER_HOST)
+    {
+      ++rejected_host;
+      return "Too many connections from your address";
+    }
+
+    if((host->addr.s_addr & mask) == (addr.s_addr & mask))
+      subnet += host->refs;
+  }
+
+  if(MAX_SESSIONS_PER_SUBNET != 0 && subnet >= MAX_SESSIONS_PER_SUBNET)
+  {
+    ++rejected_subnet;
+    return "Too many connections from your network";
+  }
+#endif
+
+  return NULL;
+}
+
+/*! allocate new ftp session
+ *
+ *  @param[in] listen_fd socket to accept connection from
+ *
+ *  @returns -1 when there are no more connections to accept
+ */
+static int
+ftp_session_new(int listen_fd)
+{
+  ssize_t            rc;
+  int                new_fd;
+  ftp_session_t      *session;
+  struct sockaddr_in addr;
+  socklen_t          addrlen = sizeof(addr);
+  const char         *reason;
+  char               buffer[64];
+
+  /* accept connection */
+#ifdef __linux__
+  new_fd = accept4(listen_fd, (struct sockaddr*)&addr, &addrlen, SOCK_CLOEXEC);
+#else
+  new_fd = accept(listen_fd, (struct sockaddr*)&addr, &addrlen);
+#endif
+  if(new_fd < 0)
+  {
+    if(errno != EAGAIN && errno != EWOULDBLOCK)
+      console_error(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  ++sessions_accepted;
+
+  /* turn it away before spending anything on it */
+  reason = ftp_admit(addr.sin_addr);
+  if(reason != NULL)
+  {
+    FTP_PROBE2(session__reject, addr.sin_addr.s_addr, reason);
+    console_warn(YELLOW "rejected connection from %s:%u: %s\n" RESET,
+                 inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), reason);
+
+    rc = snprintf(buffer, sizeof(buffer), "421 %s\r\n", reason);
+#ifdef __linux__
+    send(new_fd, buffer, rc, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+    send(new_fd, buffer, rc, 0);
+#endif
+    close(new_fd);
+    return 0;
+  }
+
+  console_print(CYAN "accepted connection from %s:%u\n" RESET,
+                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+  ftp_set_cmd_socket_options(new_fd);
+
+  /* allocate a new session */
+  session = (ftp_session_t*)calloc(1, sizeof(ftp_session_t));
+  if(session == NULL)
+  {
+    console_error(RED "failed to allocate session\n" RESET);
+    ftp_closesocket(new_fd, true);
+    return 0;
+  }
+
+  /* initialize session */
+  strcpy(session->cwd, "/");
+  session->peer_addr.sin_addr.s_addr = INADDR_ANY;
+  session->cmd_fd     = new_fd;
+  session->pasv_fd    = -1;
+  session->data_fd    = -1;
+  session->mlst_flags = SESSION_MLST_TYPE
+                      | SESSION_MLST_SIZE
+                      | SESSION_MLST_MODIFY
+                      | SESSION_MLST_PERM;
+  session->state      = COMMAND_STATE;
+  session->state_time = time(NULL);
+  session->hash_algo  = HASH_SHA256;
+  session->weight     = TRANSFER_WEIGHT_FILE;
+  session->copy_src   = -1;
+  session->copy_dst   = -1;
+#ifdef __linux__
+  session->direct_fd  = -1;
+  session->host       = ftp_host_get(addr.sin_addr);
+  session->client     = addr.sin_addr;
+  session->timed      = -1;
+  ftp_bucket_init(&session->bucket, RATE_SESSION);
+#endif
+
+  /* link to the sessions list */
+  if(sessions == NULL)
+  {
+    sessions = session;
+    session->prev = session;
+  }
+  else
+  {
+    sessions->prev->next = session;
+    session->prev        = sessions->prev;
+    sessions->prev       = session;
+  }
+
+  if(++num_sessions > peak_sessions)
+    peak_sessions = num_sessions;
+
+  FTP_PROBE3(session__accept, session, new_fd, addr.sin_addr.s_addr);
+
+  /* copy socket address to pasv address */
+  addrlen = sizeof(session->pasv_addr);
+  rc = getsockname(new_fd, (struct sockaddr*)&session->pasv_addr, &addrlen);
+  if(rc != 0)
+  {
+    console_error(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 451, "Failed to get connection info\r\n");
+    ftp_session_destroy(session);
+    return 0;
+  }
+
+  session->cmd_fd = new_fd;
+
+  /* send initiator response */
+  ftp_send_response(session, 220, "Hello!\r\n");
+  return 0;
+}
+
+/*! tell the client the data connection is ready
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_send_ready(ftp_session_t *session)
+{
+  /* STOU tells the client which name it got */
+  if(session->flags & SESSION_UNIQUE)
+    ftp_send_response(session, 150, "FILE: %s\r\n", session->xfer_path);
+  else
+    ftp_send_response(session, 150, "Ready\r\n");
+}
+
+/*! accept PASV connection for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_session_accept(ftp_session_t *session)
+{
+  int                rc, new_fd;
+  struct sockaddr_in addr;
+  socklen_t          addrlen = sizeof(addr);
+
+  if(session->flags & SESSION_PASV)
+  {
+    /* clear PASV flag */
+    session->flags &= ~SESSION_PASV;
+
+    /* tell the peer that we're ready to accept the connection */
+    ftp_session_send_ready(session);
+
+    /* accept connection from peer */
+    new_fd = accept(session->pasv_fd, (struct sockaddr*)&addr, &addrlen);
+    if(new_fd < 0)
+    {
+      console_error(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      return -1;
+    }
+
+    /* set the socket to non-blocking */
+    rc = ftp_set_socket_nonblocking(new_fd);
+    if(rc != 0)
+    {
+      ftp_closesocket(new_fd, true);
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      return -1;
+    }
+
+    console_print(CYAN "accepted connection from %s:%u\n" RESET,
+                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    /* we are ready to transfer data */
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+    session->data_fd = new_fd;
+
+    return 0;
+  }
+  else
+  {
+    /* peer didn't send PASV command */
+    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+    return -1;
+  }
+}
+
+/*! connect to peer for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_session_connect(ftp_session_t *session)
+{
+  int rc;
+
+  /* clear PORT flag */
+  session->flags &= ~SESSION_PORT;
+
+  /* create a new socket */
+  session->data_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(session->data_fd < 0)
+  {
+    console_error(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  /* set socket options */
+  rc = ftp_set_socket_options(session->data_fd);
+  if(rc != 0)
+  {
+    ftp_closesocket(session->data_fd, false);
+    session->data_fd = -1;
+    return -1;
+  }
+
+  /* set socket to non-blocking */
+  rc = ftp_set_socket_nonblocking(session->data_fd);
+  if(rc != 0)
+    return -1;
+
+  /* connect to peer */
+  rc = connect(session->data_fd, (struct sockaddr*)&session->peer_addr,
+               sizeof(session->peer_addr));
+  if(rc != 0)
+  {
+    if(errno != EINPROGRESS)
+    {
+      console_error(RED "connect: %d %s\n" RESET, errno, strerror(errno));
+      ftp_closesocket(session->data_fd, false);
+      session->data_fd = -1;
+      return -1;
+    }
+  }
+  else
+  {
+    console_print(CYAN "connected to %s:%u\n" RESET,
+                  inet_ntoa(session->peer_addr.sin_addr),
+                  ntohs(session->peer_addr.sin_port));
+
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+    ftp_session_send_ready(session);
+  }
+
+  return 0;
+}
+
+/*! run a command handler
+ *
+ *  @param[in] session ftp session
+ *  @param[in] command command to run
+ *  @param[in] args    command arguments
+ */
+static void
+ftp_session_execute(ftp_session_t       *session,
+                    const ftp_command_t *command,
+                    const char          *args)
+{
+#ifdef __linux__
+  /* time it until its final reply, unless this is STAT or ABOR for a
+   * transfer that is still being timed
+   */
+  if(session->timed < 0)
+  {
+    session->timed       = command - ftp_commands;
+    session->timed_start = ftp_clock_ns();
+    session->timed_first = 0;
+  }
+#endif
+
+  FTP_PROBE3(command, session, command->name, args);
+  command->handler(session, args);
+}
+
+/*! read command for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] events  poll events
+ */
+static void
+ftp_session_read_command(ftp_session_t *session,
+                         int           events)
+{
+  char          *buffer, *args, *next = NULL;
+  size_t        i, len;
+  int           atmark;
+  ssize_t       rc;
+  ftp_command_t key, *command;
+
+  /* check out-of-band data */
+  if(events & POLLPRI)
+  {
+    session->flags |= SESSION_URGENT;
+
+    /* check if we are at the urgent marker */
+    atmark = sockatmark(session->cmd_fd);
+    if(atmark < 0)
+    {
+      console_error(RED "sockatmark: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_close_cmd(session);
+      return;
+    }
+
+    if(!atmark)
+    {
+      /* discard in-band data */
+      rc = recv(session->cmd_fd, session->cmd_buffer, sizeof(session->cmd_buffer), 0);
+      if(rc < 0 && errno != EWOULDBLOCK)
+      {
+        console_error(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+        ftp_session_close_cmd(session);
+      }
+
+      return;
+    }
+
+    /* retrieve the urgent data */
+    rc = recv(session->cmd_fd, session->cmd_buffer, sizeof(session->cmd_buffer), MSG_OOB);
+    if(rc < 0)
+    {
+      /* EWOULDBLOCK means out-of-band data is on the way */
+      if(errno == EWOULDBLOCK)
+        return;
+
+      /* error retrieving out-of-band data */
+      console_error(RED "recv (oob): %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_close_cmd(session);
+      return;
+    }
+
+    /* reset the command buffer */
+    session->cmd_buffersize = 0;
+    return;
+  }
+
+  /* prepare to receive data */
+  buffer = session->cmd_buffer + session->cmd_buffersize;
+  len    = sizeof(session->cmd_buffer) - session->cmd_buffersize;
+  if(len == 0)
+  {
+    /* error retrieving command */
+    console_error(RED "Exceeded command buffer size\n" RESET);
+    ftp_session_close_cmd(session);
+    return;
+  }
+
+  /* retrieve command data */
+  rc = recv(session->cmd_fd, buffer, len, 0);
+  if(rc < 0)
+  {
+    /* error retrieving command */
+    console_error(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_cmd(session);
+    return;
+  }
+  if(rc == 0)
+  {
+    /* peer closed connection */
+    debug_print("peer closed connection\n");
+    ftp_session_close_cmd(session);
+    return;
+  }
+  else
+  {
+    session->cmd_buffersize += rc;
+    len                      = sizeof(session->cmd_buffer) - session->cmd_buffersize;
+
+    if(session->flags & SESSION_URGENT)
+    {
+      /* look for telnet data mark */
+      for(i = 0; i < session->cmd_buffersize; ++i)
+      {
+        if((unsigned char)session->cmd_buffer[i] == 0xF2)
+        {
+          /* ignore all data that precedes the data mark */
+          if(i < session->cmd_buffersize - 1)
+            memmove(session->cmd_buffer, session->cmd_buffer + i + 1, len - i - 1);
+          session->cmd_buffersize -= i + 1;
+          session->flags &= ~SESSION_URGENT;
+          break;
+        }
+      }
+    }
+
+    /* loop through commands */
+    while(true)
+    {
+      /* must have at least enough data for the delimiter */
+      if(session->cmd_buffersize < 1)
+        return;
+
+      /* look for \r\n or \n delimiter */
+      for(i = 0; i < session->cmd_buffersize; ++i)
+      {
+        if(i < session->cmd_buffersize-1
+        && session->cmd_buffer[i]   == '\r'
+        && session->cmd_buffer[i+1] == '\n')
+        {
+          /* we found a \r\n delimiter */
+          session->cmd_buffer[i] = 0;
+          next = &session->cmd_buffer[i+2];
+          break;
+        }
+        else if(session->cmd_buffer[i] == '\n')
+        {
+          /* we found a \n delimiter */
+          session->cmd_buffer[i] = 0;
+          next = &session->cmd_buffer[i+1];
+          break;
+        }
+      }
+
+      /* check if a delimiter was found */
+      if(i == session->cmd_buffersize)
+        return;
+
+      /* decode the command */
+      decode_path(session, i);
+
+      /* split command from arguments */
+      args = buffer = session->cmd_buffer;
+      while(*args && !isspace((int)*args))
+        ++args;
+      if(*args)
+        *args++ = 0;
+
+      /* look up the command */
+      key.name = buffer;
+      command = bsearch(&key, ftp_commands,
+                        num_ftp_commands, sizeof(ftp_command_t),
+                        ftp_command_cmp);
+
+      /* update command timestamp */
+      session->timestamp = time(NULL);
+
+      /* execute the command */
+      if(command == NULL)
+      {
+        /* send header */
         ftp_send_response(session, 502, "Invalid command \"");
 
-        /* send command */
-        len = strlen(buffer);
-        buffer = encode_path(buffer, &len, false);
+        /* send command */
+        len = strlen(buffer);
+        buffer = encode_path(buffer, &len, false);
+        if(buffer != NULL)
+          ftp_send_response_buffer(session, buffer, len);
+        else
+          ftp_send_response_buffer(session, key.name, strlen(key.name));
+        free(buffer);
+
+        /* send args (if any) */
+        if(*args != 0)
+        {
+          ftp_send_response_buffer(session, " ", 1);
+
+          len = strlen(args);
+          buffer = encode_path(args, &len, false);
+          if(buffer != NULL)
+            ftp_send_response_buffer(session, buffer, len);
+          else
+            ftp_send_response_buffer(session, args, strlen(args));
+          free(buffer);
+        }
+
+        /* send footer */
+        ftp_send_response_buffer(session, "\"\r\n", 3);
+      }
+      else if(session->state != COMMAND_STATE)
+      {
+        /* only some commands are available during data transfer */
+        if(strcasecmp(command->name, "ABOR") != 0
+        && strcasecmp(command->name, "STAT") != 0
+        && strcasecmp(command->name, "QUIT") != 0)
+        {
+          ftp_send_response(session, 503, "Invalid command during transfer\r\n");
+          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+          ftp_session_close_cmd(session);
+        }
+        else
+          ftp_session_execute(session, command, args);
+      }
+      else
+      {
+        /* clear RENAME flag for all commands except RNTO */
+        if(strcasecmp(command->name, "RNTO") != 0)
+          session->flags &= ~SESSION_RENAME;
+
+        /* clear COPY flag for all commands except SITE CPTO */
+        if(strcasecmp(command->name, "SITE") != 0)
+          session->flags &= ~SESSION_COPY;
+
+        ftp_session_execute(session, command, args);
+      }
+
+      /* remove executed command from the command buffer */
+      len = session->cmd_buffer + session->cmd_buffersize - next;
+      if(len > 0)
+        memmove(session->cmd_buffer, next, len);
+      session->cmd_buffersize = len;
+    }
+  }
+}
+
+/*! poll sockets for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns next session
+ */
+static ftp_session_t*
+ftp_session_poll(ftp_session_t *session)
+{
+  int           rc;
+  struct pollfd pollinfo[2];
+  nfds_t        nfds = 1;
+
+  /* the first pollfd is the command socket */
+  pollinfo[0].fd      = session->cmd_fd;
+  pollinfo[0].events  = POLLIN | POLLPRI;
+  pollinfo[0].revents = 0;
+
+  switch(session->state)
+  {
+    case COMMAND_STATE:
+      /* we are waiting to read a command */
+      break;
+
+    case DATA_CONNECT_STATE:
+      if(session->flags & SESSION_PASV)
+      {
+        /* we are waiting for a PASV connection */
+        pollinfo[1].fd     = session->pasv_fd;
+        pollinfo[1].events = POLLIN;
+      }
+      else
+      {
+        /* we are waiting to complete a PORT connection */
+        pollinfo[1].fd     = session->data_fd;
+        pollinfo[1].events = POLLOUT;
+      }
+      pollinfo[1].revents = 0;
+      nfds = 2;
+      break;
+
+    case DATA_TRANSFER_STATE:
+#ifdef __linux__
+      /* a throttled or committing transfer sleeps until it may go on */
+      if(session->resume != 0 && session->resume > ftp_file_now())
+        break;
+#endif
+
+      /* we need to transfer data */
+      pollinfo[1].fd     = session->data_fd;
+      if(session->flags & SESSION_RECV)
+        pollinfo[1].events = POLLIN;
+      else
+        pollinfo[1].events = POLLOUT;
+      pollinfo[1].revents = 0;
+      nfds = 2;
+      break;
+  }
+
+  /* poll the selected sockets */
+  rc = poll(pollinfo, nfds, 0);
+  if(rc < 0)
+  {
+    console_error(RED "poll: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_cmd(session);
+  }
+  else if(rc > 0)
+  {
+    /* check the command socket */
+    if(pollinfo[0].revents != 0)
+    {
+      /* handle command */
+      if(pollinfo[0].revents & POLL_UNKNOWN)
+        console_warn(YELLOW "cmd_fd: revents=0x%08X\n" RESET, pollinfo[0].revents);
+
+      /* we need to read a new command */
+      if(pollinfo[0].revents & (POLLERR|POLLHUP))
+      {
+        debug_print("cmd revents=0x%x\n", pollinfo[0].revents);
+        ftp_session_close_cmd(session);
+      }
+      else if(pollinfo[0].revents & (POLLIN | POLLPRI))
+        ftp_session_read_command(session, pollinfo[0].revents);
+    }
+
+    /* check the data/pasv socket */
+    if(nfds > 1 && pollinfo[1].revents != 0)
+    {
+      switch(session->state)
+      {
+        case COMMAND_STATE:
+          /* this shouldn't happen? */
+          break;
+
+        case DATA_CONNECT_STATE:
+          if(pollinfo[1].revents & POLL_UNKNOWN)
+            console_warn(YELLOW "pasv_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+
+          /* we need to accept the PASV connection */
+          if(pollinfo[1].revents & (POLLERR|POLLHUP))
+          {
+            ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+            ftp_send_response(session, 426, "Data connection failed\r\n");
+          }
+          else if(pollinfo[1].revents & POLLIN)
+          {
+            if(ftp_session_accept(session) != 0)
+              ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+          }
+          else if(pollinfo[1].revents & POLLOUT)
+          {
+
+            console_print(CYAN "connected to %s:%u\n" RESET,
+                          inet_ntoa(session->peer_addr.sin_addr),
+                          ntohs(session->peer_addr.sin_port));
+
+            ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+            ftp_session_send_ready(session);
+          }
+          break;
+
+        case DATA_TRANSFER_STATE:
+          if(pollinfo[1].revents & POLL_UNKNOWN)
+            console_warn(YELLOW "data_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+
+#ifdef __linux__
+          /* MSG_ZEROCOPY completions are reported as socket errors */
+          if((pollinfo[1].revents & POLLERR) && session->zc_sent != 0
+          && ftp_session_zerocopy_reap(session) == 0)
+            pollinfo[1].revents = (pollinfo[1].revents & ~POLLERR) | POLLOUT;
+#endif
+
+          /* we need to transfer data */
+          if(pollinfo[1].revents & (POLLERR|POLLHUP))
+          {
+            ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+            ftp_send_response(session, 426, "Data connection failed\r\n");
+          }
+          else if(pollinfo[1].revents & (POLLIN|POLLOUT))
+            ftp_session_transfer(session);
+          break;
+      }
+    }
+  }
+
+  /* still connected to peer; return next session */
+  if(session->cmd_fd >= 0)
+    return session->next;
+
+  /* disconnected from peer; destroy it and return next session */
+  debug_print("disconnected from peer\n");
+  return ftp_session_destroy(session);
+}
+
+/* Update free space in status bar */
+static void
+update_free_space(void)
+{
+#if defined(_3DS) || defined(__SWITCH__)
+#define KiB (1024.0)
+#define MiB (1024.0*KiB)
+#define GiB (1024.0*MiB)
+  char           buffer[16];
+  struct statvfs st;
+  double         bytes_free;
+  int            rc, len;
+
+  rc = statvfs("sdmc:/", &st);
+  if(rc != 0)
+    console_error(RED "statvfs: %d %s\n" RESET, errno, strerror(errno));
+  else
+  {
+    bytes_free = (double)st.f_bsize * st.f_bfree;
+
+    if     (bytes_free < 1000.0)
+      len = snprintf(buffer, sizeof(buffer), "%.0lfB", bytes_free);
+    else if(bytes_free < 10.0*KiB)
+      len = snprintf(buffer, sizeof(buffer), "%.2lfKiB", floor((bytes_free*100.0)/KiB)/100.0);
+    else if(bytes_free < 100.0*KiB)
+      len = snprintf(buffer, sizeof(buffer), "%.1lfKiB", floor((bytes_free*10.0)/KiB)/10.0);
+    else if(bytes_free < 1000.0*KiB)
+      len = snprintf(buffer, sizeof(buffer), "%.0lfKiB", floor(bytes_free/KiB));
+    else if(bytes_free < 10.0*MiB)
+      len = snprintf(buffer, sizeof(buffer), "%.2lfMiB", floor((bytes_free*100.0)/MiB)/100.0);
+    else if(bytes_free < 100.0*MiB)
+      len = snprintf(buffer, sizeof(buffer), "%.1lfMiB", floor((bytes_free*10.0)/MiB)/10.0);
+    else if(bytes_free < 1000.0*MiB)
+      len = snprintf(buffer, sizeof(buffer), "%.0lfMiB", floor(bytes_free/MiB));
+    else if(bytes_free < 10.0*GiB)
+      len = snprintf(buffer, sizeof(buffer), "%.2lfGiB", floor((bytes_free*100.0)/GiB)/100.0);
+    else if(bytes_free < 100.0*GiB)
+      len = snprintf(buffer, sizeof(buffer), "%.1lfGiB", floor((bytes_free*10.0)/GiB)/10.0);
+    else
+      len = snprintf(buffer, sizeof(buffer), "%.0lfGiB", floor(bytes_free/GiB));
+
+    console_set_status("\x1b[0;%dH" GREEN "%s", 50-len, buffer);
+  }
+#endif
+}
+
+/*! Update status bar */
+static int
+update_status(void)
+{
+#if defined(_3DS) || defined(__SWITCH__)
+  console_set_status("\n" GREEN STATUS_STRING " "
+#ifdef ENABLE_LOGGING
+                     "DEBUG "
+#endif
+                     CYAN "%s:%u" RESET,
+                     inet_ntoa(serv_addr.sin_addr),
+                     ntohs(serv_addr.sin_port));
+  update_free_space();
+#else
+  char      hostname[128];
+  socklen_t addrlen = sizeof(serv_addr);
+  int       rc;
+
+  rc = getsockname(listenfd, (struct sockaddr*)&serv_addr, &addrlen);
+  if(rc != 0)
+  {
+    console_error(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  rc = gethostname(hostname, sizeof(hostname));
+  if(rc != 0)
+  {
+    console_error(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  console_set_status(GREEN STATUS_STRING " "
+#ifdef ENABLE_LOGGING
+                     "DEBUG "
+#endif
+                     YELLOW "IP:"   CYAN "%s "
+                     YELLOW "Port:" CYAN "%u"
+                     RESET,
+                     hostname,
+                     ntohs(serv_addr.sin_port));
+#endif
+
+  return 0;
+}
+
+#ifdef _3DS
+/*! Handle apt events
+ *
+ *  @param[in] type    Event type
+ *  @param[in] closure Callback closure
+ */
+static void
+apt_hook(APT_HookType type,
+         void         *closure)
+{
+  switch(type)
+  {
+    case APTHOOK_ONSUSPEND:
+    case APTHOOK_ONSLEEP:
+      /* turn on backlight, or you can't see the home menu! */
+      if(R_SUCCEEDED(gspLcdInit()))
+      {
+        GSPLCD_PowerOnBacklight(GSPLCD_SCREEN_BOTH);
+        gspLcdExit();
+      }
+      break;
+
+    case APTHOOK_ONRESTORE:
+    case APTHOOK_ONWAKEUP:
+      /* restore backlight power state */
+      if(R_SUCCEEDED(gspLcdInit()))
+      {
+        (lcd_power ? GSPLCD_PowerOnBacklight : GSPLCD_PowerOffBacklight)(GSPLCD_SCREEN_BOTH);
+        gspLcdExit();
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+#elif defined(__SWITCH__)
+/*! Handle applet events
+ *
+ *  @param[in] type    Event type
+ *  @param[in] closure Callback closure
+ */
+static void
+applet_hook(AppletHookType type,
+         void         *closure)
+{
+  (void)closure;
+  (void)type;
+  /* stubbed for now */
+  switch(type)
+  {
+    default:
+      break;
+  }
+}
+#endif
+
+#ifdef __linux__
+/*! append to a text buffer
+ *
+ *  @param[in] text text buffer
+ *  @param[in] fmt  format string
+ *  @param[in] ...  format arguments
+ *
+ *  @returns -1 for failure
+ */
+__attribute__((format(printf,2,3)))
+static int
+ftp_text_printf(ftp_text_t *text,
+                const char *fmt, ...)
+{
+  va_list ap;
+  int     rc;
+  char    *data;
+
+  for(;;)
+  {
+    va_start(ap, fmt);
+    rc = vsnprintf(text->data + text->len, text->cap - text->len, fmt, ap);
+    va_end(ap);
+    if(rc < 0)
+      return -1;
+
+    if(text->len + rc < text->cap)
+    {
+      text->len += rc;
+      return 0;
+    }
+
+    /* make room and try again */
+    data = (char*)realloc(text->data, 2*text->cap + rc + 1);
+    if(data == NULL)
+      return -1;
+
+    text->data = data;
+    text->cap  = 2*text->cap + rc + 1;
+  }
+}
+
+/*! render per-command histograms as a Prometheus summary
+ *
+ *  @param[in] text  text buffer
+ *  @param[in] name  metric name
+ *  @param[in] help  metric description
+ *  @param[in] hists histograms indexed like ftp_commands
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_metrics_summary(ftp_text_t   *text,
+                    const char   *name,
+                    const char   *help,
+                    const hist_t *hists)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  size_t              i, j;
+  int                 rc;
+
+  rc = ftp_text_printf(text, "# HELP %s %s.\n# TYPE %s summary\n",
+                       name, help, name);
+
+  for(i = 0; i < num_ftp_commands; ++i)
+  {
+    if(hists[i].count == 0)
+      continue;
+
+    for(j = 0; j < sizeof(quantiles)/sizeof(quantiles[0]); ++j)
+      rc |= ftp_text_printf(text, "%s{command=\"%s\",quantile=\"%g\"} %.6f\n",
+                            name, ftp_commands[i].name, quantiles[j],
+                            hist_percentile(&hists[i], quantiles[j] * 100) / 1e6);
+
+    rc |= ftp_text_printf(text,
+                          "%s_sum{command=\"%s\"} %.6f\n"
+                          "%s_count{command=\"%s\"} %" PRIu64 "\n",
+                          name, ftp_commands[i].name, hists[i].sum / 1e6,
+                          name, ftp_commands[i].name, hists[i].count);
+  }
+
+  return rc;
+}
+
+/*! render the metrics in the Prometheus text format
+ *
+ *  @param[in] text text buffer
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_metrics_render(ftp_text_t *text)
+{
+  static const char *state_names[] =
+  {
+    [COMMAND_STATE]       = "command",
+    [DATA_CONNECT_STATE]  = "data_connect",
+    [DATA_TRANSFER_STATE] = "data_transfer",
+  };
+  unsigned       states[3] = { 0, 0, 0 };
+  ftp_session_t  *session;
+  struct statvfs st;
+  size_t         i;
+  int            rc = 0;
+
+  for(session = sessions; session != NULL; session = session->next)
+    ++states[session->state];
+
+  rc |= ftp_text_printf(text,
+                        "# HELP ftpd_uptime_seconds Time since the server started.\n"
+                        "# TYPE ftpd_uptime_seconds gauge\n"
+                        "ftpd_uptime_seconds %lld\n",
+                        (long long)(time(NULL) - start_time));
+
+  rc |= ftp_text_printf(text,
+                        "# HELP ftpd_sessions Sessions by state.\n"
+                        "# TYPE ftpd_sessions gauge\n");
+  for(i = 0; i < 3; ++i)
+    rc |= ftp_text_printf(text, "ftpd_sessions{state=\"%s\"} %u\n",
+                          state_names[i], states[i]);
+
+  rc |= ftp_text_printf(text,
+                        "# HELP ftpd_sessions_peak Most sessions at once.\n"
+                        "# TYPE ftpd_sessions_peak gauge\n"
+                        "ftpd_sessions_peak %u\n"
+                        "# HELP ftpd_accepts_total Connections accepted.\n"
+                        "# TYPE ftpd_accepts_total counter\n"
+                        "ftpd_accepts_total %" PRIu64 "\n"
+                        "# HELP ftpd_rejects_total Connections turned away.\n"
+                        "# TYPE ftpd_rejects_total counter\n"
+                        "ftpd_rejects_total{reason=\"full\"} %" PRIu64 "\n"
+                        "ftpd_rejects_total{reason=\"host\"} %" PRIu64 "\n"
+                        "ftpd_rejects_total{reason=\"subnet\"} %" PRIu64 "\n",
+                        peak_sessions, sessions_accepted,
+                        rejected_full, rejected_host, rejected_subnet);
+
+  rc |= ftp_text_printf(text,
+                        "# HELP ftpd_bytes_total Bytes moved by transfers.\n"
+                        "# TYPE ftpd_bytes_total counter\n"
+                        "ftpd_bytes_total{direction=\"in\"} %" PRIu64 "\n"
+                        "ftpd_bytes_total{direction=\"out\"} %" PRIu64 "\n"
+                        "# HELP ftpd_listing_entries_total Directory entries sent by listings.\n"
+                        "# TYPE ftpd_listing_entries_total counter\n"
+                        "ftpd_listing_entries_total %" PRIu64 "\n",
+                        bytes_in, bytes_out, listing_entries);
+
+  rc |= ftp_text_printf(text,
+                        "# HELP ftpd_transfers_total Finished transfers by command and reply code.\n"
+                        "# TYPE ftpd_transfers_total counter\n");
+  for(i = 0; i < num_transfer_counts; ++i)
+    rc |= ftp_text_printf(text,
+                          "ftpd_transfers_total{command=\"%s\",code=\"%d\"} %" PRIu64 "\n",
+                          transfer_counts[i].command, transfer_counts[i].code,
+                          transfer_counts[i].count);
+
+  rc |= ftp_metrics_summary(text, "ftpd_command_latency_seconds",
+                            "Time from parsing a command to its final reply",
+                            command_latency);
+  rc |= ftp_metrics_summary(text, "ftpd_transfer_first_byte_seconds",
+                            "Time from parsing a transfer command to its first data byte",
+                            transfer_ttfb);
+  rc |= ftp_metrics_summary(text, "ftpd_transfer_duration_seconds",
+                            "Time from the first data byte of a transfer to its final reply",
+                            transfer_time);
+
+  rc |= ftp_text_printf(text,
+                        "# HELP ftpd_buffer_pool_idle Idle aligned buffers kept for O_DIRECT.\n"
+                        "# TYPE ftpd_buffer_pool_idle gauge\n"
+                        "ftpd_buffer_pool_idle %zu\n"
+                        "# HELP ftpd_buffer_pool_size Aligned buffers the pool can keep.\n"
+                        "# TYPE ftpd_buffer_pool_size gauge\n"
+                        "ftpd_buffer_pool_size %d\n"
+                        "# HELP ftpd_cache_bytes Bytes of small files kept in memory.\n"
+                        "# TYPE ftpd_cache_bytes gauge\n"
+                        "ftpd_cache_bytes %" PRIu64 "\n"
+                        "# HELP ftpd_cache_requests_total RETRs of cacheable files.\n"
+                        "# TYPE ftpd_cache_requests_total counter\n"
+                        "ftpd_cache_requests_total{result=\"hit\"} %" PRIu64 "\n"
+                        "ftpd_cache_requests_total{result=\"miss\"} %" PRIu64 "\n",
+                        pool_count, DIRECT_IO_POOL,
+                        cache_bytes, cache_hits, cache_misses);
+
+  if(statvfs("/", &st) == 0)
+    rc |= ftp_text_printf(text,
+                          "# HELP ftpd_free_bytes Free space of the served filesystem.\n"
+                          "# TYPE ftpd_free_bytes gauge\n"
+                          "ftpd_free_bytes %" PRIu64 "\n",
+                          (uint64_t)st.f_bsize * st.f_bavail);
+
+  return rc;
+}
+
+/*! start the metrics endpoint */
+static void
+ftp_metrics_init(void)
+{
+  struct sockaddr_in addr;
+  int                rc, yes = 1;
+  size_t             i;
+
+  for(i = 0; i < METRICS_CLIENTS; ++i)
+    metrics_clients[i].fd = -1;
+
+  if(METRICS_PORT == 0)
+    return;
+
+  metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(metrics_fd < 0)
+  {
+    console_error(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    return;
+  }
+
+  setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(METRICS_ADDR);
+  addr.sin_port        = htons(METRICS_PORT);
+
+  rc = bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr));
+  if(rc == 0)
+    rc = listen(metrics_fd, METRICS_CLIENTS);
+  if(rc != 0)
+  {
+    /* the server is still useful without metrics */
+    console_error(RED "metrics: %d %s\n" RESET, errno, strerror(errno));
+    close(metrics_fd);
+    metrics_fd = -1;
+    return;
+  }
+
+  console_print(CYAN "metrics on %s:%u\n" RESET,
+                inet_ntoa(addr.sin_addr), METRICS_PORT);
+}
+
+/*! finish with a metrics client
+ *
+ *  @param[in] client metrics client
+ */
+static void
+ftp_metrics_close(ftp_metrics_client_t *client)
+{
+  close(client->fd);
+  free(client->response);
+  client->fd       = -1;
+  client->response = NULL;
+}
+
+/*! stop the metrics endpoint */
+static void
+ftp_metrics_exit(void)
+{
+  size_t i;
+
+  if(metrics_fd < 0)
+    return;
+
+  for(i = 0; i < METRICS_CLIENTS; ++i)
+  {
+    if(metrics_clients[i].fd >= 0)
+      ftp_metrics_close(&metrics_clients[i]);
+  }
+
+  close(metrics_fd);
+  metrics_fd = -1;
+}
+
+/*! answer a metrics request
+ *
+ *  @param[in] client metrics client
+ */
+static void
+ftp_metrics_respond(ftp_metrics_client_t *client)
+{
+  ftp_text_t body   = { NULL, 0, 0 };
+  ftp_text_t header = { NULL, 0, 0 };
+  bool       found  = strncmp(client->request, "GET /metrics ", 13) == 0;
+
+  if(found && ftp_metrics_render(&body) != 0)
+  {
+    free(body.data);
+    ftp_metrics_close(client);
+    return;
+  }
+
+  if(ftp_text_printf(&header,
+                     "HTTP/1.0 %s\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "%s",
+                     found ? "200 OK" : "404 Not Found",
+                     body.len, body.len ? body.data : "") != 0)
+  {
+    free(body.data);
+    free(header.data);
+    ftp_metrics_close(client);
+    return;
+  }
+
+  free(body.data);
+  client->response = header.data;
+  client->resplen  = header.len;
+  client->resppos  = 0;
+}
+
+/*! serve the metrics endpoint */
+static void
+ftp_metrics_poll(void)
+{
+  struct pollfd        pollinfo[METRICS_CLIENTS + 1];
+  ftp_metrics_client_t *client;
+  time_t               now;
+  ssize_t              rc;
+  size_t               i;
+  int                  fd;
+
+  if(metrics_fd < 0)
+    return;
+
+  pollinfo[0].fd     = metrics_fd;
+  pollinfo[0].events = POLLIN;
+  for(i = 0; i < METRICS_CLIENTS; ++i)
+  {
+    client = &metrics_clients[i];
+    pollinfo[i+1].fd     = client->fd;
+    pollinfo[i+1].events = client->response != NULL ? POLLOUT : POLLIN;
+  }
+
+  if(poll(pollinfo, METRICS_CLIENTS + 1, 0) < 0)
+    return;
+
+  now = time(NULL);
+  for(i = 0; i < METRICS_CLIENTS; ++i)
+  {
+    client = &metrics_clients[i];
+    if(client->fd < 0)
+      continue;
+
+    if(pollinfo[i+1].revents & (POLLERR|POLLHUP|POLLNVAL))
+    {
+      ftp_metrics_close(client);
+      continue;
+    }
+
+    if(pollinfo[i+1].revents & POLLIN)
+    {
+      /* read until the end of the request header */
+      rc = recv(client->fd, client->request + client->reqlen,
+                sizeof(client->request) - client->reqlen - 1, 0);
+      if(rc <= 0 && !(rc < 0 && errno == EWOULDBLOCK))
+      {
+        ftp_metrics_close(client);
+        continue;
+      }
+
+      if(rc > 0)
+      {
+        client->reqlen += rc;
+        client->request[client->reqlen] = 0;
+        if(strstr(client->request, "\r\n\r\n") != NULL
+        || strstr(client->request, "\n\n") != NULL
+        || client->reqlen == sizeof(client->request) - 1)
+          ftp_metrics_respond(client);
+      }
+    }
+    else if(pollinfo[i+1].revents & POLLOUT)
+    {
+      rc = send(client->fd, client->response + client->resppos,
+                client->resplen - client->resppos, MSG_NOSIGNAL);
+      if(rc < 0 && errno != EWOULDBLOCK)
+      {
+        ftp_metrics_close(client);
+        continue;
+      }
+
+      if(rc > 0)
+        client->resppos += rc;
+      if(client->resppos == client->resplen)
+      {
+        ftp_metrics_close(client);
+        continue;
+      }
+    }
+
+    /* don't let a stalled client keep its slot */
+    if(client->fd >= 0 && now - client->timestamp > METRICS_TIMEOUT)
+      ftp_metrics_close(client);
+  }
+
+  if(!(pollinfo[0].revents & POLLIN))
+    return;
+
+  fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if(fd < 0)
+    return;
+
+  for(i = 0; i < METRICS_CLIENTS; ++i)
+  {
+    client = &metrics_clients[i];
+    if(client->fd < 0)
+    {
+      client->fd        = fd;
+      client->timestamp = now;
+      client->reqlen    = 0;
+      client->response  = NULL;
+      return;
+    }
+  }
+
+  /* too many requests at once */
+  close(fd);
+}
+#endif
+
+/*! initialize ftp subsystem */
+int
+ftp_init(void)
+{
+  int rc;
+
+  start_time = time(NULL);
+
+#ifdef _3DS
+  Result ret  = 0;
+  u32    wifi = 0;
+  bool   loop;
+
+  /* register apt hook */
+  aptHook(&cookie, apt_hook, NULL);
+
+  console_print(GREEN "Waiting for wifi...\n" RESET);
+
+  /* wait for wifi to be available */
+  while((loop = aptMainLoop()) && !wifi && (ret == 0 || ret == 0xE0A09D2E))
+  {
+    ret = 0;
+
+    hidScanInput();
+    if(hidKeysDown() & KEY_B)
+    {
+      /* user canceled */
+      loop = false;
+      break;
+    }
+
+    /* update the wifi status */
+    ret = ACU_GetWifiStatus(&wifi);
+    if(ret != 0)
+      wifi = 0;
+  }
+
+  /* check if there was a wifi error */
+  if(ret != 0)
+    console_error(RED "ACU_GetWifiStatus returns 0x%lx\n" RESET, ret);
+
+  /* check if we need to exit */
+  if(!loop || ret != 0)
+    return -1;
+
+  console_print(GREEN "Ready!\n" RESET);
+
+  /* allocate buffer for SOC service */
+  SOCU_buffer = (u32*)memalign(SOCU_ALIGN, SOCU_BUFFERSIZE);
+  if(SOCU_buffer == NULL)
+  {
+    console_error(RED "memalign: failed to allocate\n" RESET);
+    goto memalign_fail;
+  }
+
+  /* initialize SOC service */
+  ret = socInit(SOCU_buffer, SOCU_BUFFERSIZE);
+  if(ret != 0)
+  {
+    console_error(RED "socInit: %08X\n" RESET, (unsigned int)ret);
+    goto soc_fail;
+  }
+#elif defined(__SWITCH__)
+  static const SocketInitConfig socketInitConfig = {
+    .bsdsockets_version = 1,
+
+    .tcp_tx_buf_size        = 8 * SOCK_BUFFERSIZE,
+    .tcp_rx_buf_size        = 8 * SOCK_BUFFERSIZE,
+    .tcp_tx_buf_max_size    = 16 * SOCK_BUFFERSIZE,
+    .tcp_rx_buf_max_size    = 16 * SOCK_BUFFERSIZE,
+
+    .udp_tx_buf_size = 0x2400,
+    .udp_rx_buf_size = 0xA500,
+
+    .sb_efficiency = 8,
+  };
+
+  Result ret = socketInitialize(&socketInitConfig);
+  if(ret != 0)
+  {
+    console_error(RED "socketInitialize: %X\n" RESET, (unsigned int)ret);
+    return -1;
+  }
+
+  /* register applet hook */
+  appletHook(&cookie, applet_hook, NULL);
+#elif defined(__linux__)
+  /* a client dropping its connection must not take the server down */
+  signal(SIGPIPE, SIG_IGN);
+
+  ftp_bucket_init(&global_bucket, RATE_GLOBAL);
+  pacing_rate = ftp_pacing_rate();
+#endif
+
+  /* allocate socket to listen for clients */
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(listenfd < 0)
+  {
+    console_error(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* get address to listen on */
+  serv_addr.sin_family      = AF_INET;
+#if defined(_3DS) || defined(__SWITCH__)
+  serv_addr.sin_addr.s_addr = gethostid();
+  serv_addr.sin_port        = htons(LISTEN_PORT);
+#else
+  serv_addr.sin_addr.s_addr = INADDR_ANY;
+  serv_addr.sin_port        = htons(LISTEN_PORT);
+#endif
+
+  /* reuse address */
+  {
+    int yes = 1;
+    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if(rc != 0)
+    {
+      console_error(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
+      ftp_exit();
+      return -1;
+    }
+  }
+
+  /* bind socket to listen address */
+  rc = bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+  if(rc != 0)
+  {
+    console_error(RED "bind: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* listen on socket */
+  rc = listen(listenfd, LISTEN_BACKLOG);
+  if(rc != 0)
+  {
+    console_error(RED "listen: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+#ifdef __linux__
+  /* drain the backlog in batches without blocking on the last accept */
+  rc = ftp_set_socket_nonblocking(listenfd);
+  if(rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  /* control connections inherit the congestion control */
+  ftp_set_socket_congestion(listenfd);
+
+  /* let clients that support it skip a round trip on connect */
+  if(LISTEN_FASTOPEN != 0)
+  {
+    int qlen = LISTEN_FASTOPEN;
+
+    rc = setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+    if(rc != 0)
+      console_warn(YELLOW "setsockopt: TCP_FASTOPEN %d %s\n" RESET, errno, strerror(errno));
+  }
+
+  ftp_metrics_init();
+#endif
+
+  /* print server address */
+  rc = update_status();
+  if(rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  return 0;
+
+#ifdef _3DS
+soc_fail:
+  free(SOCU_buffer);
+  SOCU_buffer = NULL;
+
+memalign_fail:
+  return -1;
+#endif
+}
+
+/*! deinitialize ftp subsystem */
+void
+ftp_exit(void)
+{
+#if defined(_3DS)
+  Result ret;
+#endif
+
+  debug_print("exiting ftp server\n");
+
+  /* clean up all sessions */
+  while(sessions != NULL)
+    ftp_session_destroy(sessions);
+
+  /* drop cached files */
+  while(cache_head != NULL)
+    ftp_cache_remove(cache_head);
+#ifdef __linux__
+  while(files != NULL)
+    ftp_file_remove(files);
+  while(pool_count > 0)
+    free(pool[--pool_count]);
+  ftp_metrics_exit();
+#endif
+
+  /* stop listening for new clients */
+  if(listenfd >= 0)
+    ftp_closesocket(listenfd, false);
+
+#ifdef _3DS
+  /* deinitialize SOC service */
+  console_render();
+  console_print(CYAN "Waiting for socExit()...\n" RESET);
+
+  if(SOCU_buffer != NULL)
+  {
+    ret = socExit();
+    if(ret != 0)
+      console_error(RED "socExit: 0x%08X\n" RESET, (unsigned int)ret);
+    free(SOCU_buffer);
+  }
+#elif defined(__SWITCH__)
+  /* deinitialize socket driver */
+  console_render();
+  console_print(CYAN "Waiting for socketExit()...\n" RESET);
+
+  socketExit();
+
+#endif
+}
+
+/*! ftp look
+ *
+ *  @returns whether to keep looping
+ */
+loop_status_t
+ftp_loop(void)
+{
+  int           rc, i;
+  struct pollfd pollinfo;
+  ftp_session_t *session;
+
+  /* we will poll for new client connections */
+  pollinfo.fd      = listenfd;
+  pollinfo.events  = POLLIN;
+  pollinfo.revents = 0;
+
+  /* poll for a new client */
+  rc = poll(&pollinfo, 1, 0);
+  if(rc < 0)
+  {
+    /* wifi got disabled */
+    if(errno == ENETDOWN)
+      return LOOP_RESTART;
+
+    console_error(RED "poll: %d %s\n" RESET, errno, strerror(errno));
+    return LOOP_EXIT;
+  }
+  else if(rc > 0)
+  {
+    if(pollinfo.revents & POLLIN)
+    {
+      /* we got new clients */
+      for(i = 0; i < ACCEPT_BATCH; ++i)
+      {
+        if(ftp_session_new(listenfd) != 0)
+          break;
+      }
+    }
+    else
+    {
+      console_warn(YELLOW "listenfd: revents=0x%08X\n" RESET, pollinfo.revents);
+    }
+  }
+
+  /* poll each session */
+  session = sessions;
+  while(session != NULL)
+    session = ftp_session_poll(session);
+
+#ifdef __linux__
+  /* answer metrics requests */
+  ftp_metrics_poll();
+
+  /* close file handles nobody wants anymore */
+  ftp_file_expire();
+#endif
+
+#ifdef _3DS
+  /* check if the user wants to exit */
+  hidScanInput();
+  u32 down = hidKeysDown();
+
+  if(down & KEY_B)
+    return LOOP_EXIT;
+
+  /* check if the user wants to toggle the LCD power */
+  if(down & KEY_START)
+  {
+    lcd_power = !lcd_power;
+    apt_hook(APTHOOK_ONRESTORE, NULL);
+  }
+#elif defined(__SWITCH__)
+  /* check if the user wants to exit */
+  hidScanInput();
+  u32 down = hidKeysDown(CONTROLLER_P1_AUTO);
+
+  if(down & KEY_B)
+    return LOOP_EXIT;
+#endif
+
+  return LOOP_CONTINUE;
+}
+
+/*! change to parent directory
+ *
+ *  @param[in] session ftp session
+ */
+static void
+cd_up(ftp_session_t *session)
+{
+  char *slash = NULL, *p;
+
+  /* remove basename from cwd */
+  for(p = session->cwd; *p; ++p)
+  {
+    if(*p == '/')
+      slash = p;
+  }
+  *slash = 0;
+  if(strlen(session->cwd) == 0)
+    strcat(session->cwd, "/");
+}
+
+/*! validate a path
+ *
+ *  @param[in] args path to validate
+ */
+static int
+validate_path(const char *args)
+{
+  const char *p;
+
+  /* make sure no path components are '..' */
+  p = args;
+  while((p = strstr(p, "/..")) != NULL)
+  {
+    if(p[3] == 0 || p[3] == '/')
+      return -1;
+  }
+
+  /* make sure there are no '//' */
+  if(strstr(args, "//") != NULL)
+    return -1;
+
+  return 0;
+}
+
+/*! parse a decimal offset
+ *
+ *  @param[in,out] p   string to parse; advanced past the number
+ *  @param[out]    pos parsed offset
+ *
+ *  @returns -1 for error
+ */
+static int
+parse_offset(const char **p,
+             uint64_t   *pos)
+{
+  const char *s = *p;
+
+  *pos = 0;
+
+  /* require at least one digit */
+  if(!isdigit((int)*s))
+    return -1;
+
+  while(isdigit((int)*s))
+  {
+    if(UINT64_MAX / 10 < *pos)
+      return -1;
+
+    *pos *= 10;
+
+    if(UINT64_MAX - (*s - '0') < *pos)
+      return -1;
+
+    *pos += *s++ - '0';
+  }
+
+  *p = s;
+  return 0;
+}
+
+/*! get a path relative to cwd
+ *
+ *  @param[in] session ftp session
+ *  @param[in] cwd     working directory
+ *  @param[in] args    path to make
+ *
+ *  @returns error
+ *
+ *  @note the output goes to session->buffer
+ */
+static int
+build_path(ftp_session_t *session,
+           const char    *cwd,
+           const char    *args)
+{
+  int  rc;
+  char *p;
+
+  session->buffersize = 0;
+  memset(session->buffer, 0, sizeof(session->buffer));
+
+  /* make sure the input is a valid path */
+  if(validate_path(args) != 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(args[0] == '/')
+  {
+    /* this is an absolute path */
+    size_t len = strlen(args);
+    if(len > sizeof(session->buffer)-1)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+    memcpy(session->buffer, args, len);
+    session->buffersize = len;
+  }
+  else
+  {
+    /* this is a relative path */
+    if(strcmp(cwd, "/") == 0)
+      rc = snprintf(session->buffer, sizeof(session->buffer), "/%s",
+                    args);
+    else
+      rc = snprintf(session->buffer, sizeof(session->buffer), "%s/%s",
+                    cwd, args);
+
+    if(rc >= sizeof(session->buffer))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+    session->buffersize = rc;
+  }
+
+  /* remove trailing / */
+  p = session->buffer + session->buffersize;
+  while(p > session->buffer && *--p == '/')
+  {
+    *p = 0;
+    --session->buffersize;
+  }
+
+  /* if we ended with an empty path, it is the root directory */
+  if(session->buffersize == 0)
+    session->buffer[session->buffersize++] = '/';
+
+  return 0;
+}
+
+/*! transfer a directory listing
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+list_transfer(ftp_session_t *session)
+{
+  ssize_t       rc;
+  size_t        len;
+  char          *buffer;
+  struct stat   st;
+  struct dirent *dent;
+
+  /* check if we sent all available data */
+  if(session->bufferpos == session->buffersize)
+  {
+    /* check xfer dir type */
+    if(session->dir_mode == XFER_DIR_STAT)
+      rc = 213;
+    else
+      rc = 226;
+
+    /* check if this was for a file */
+    if(session->dp == NULL)
+    {
+      /* we already sent the file's listing */
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, rc, "OK\r\n");
+      return LOOP_EXIT;
+    }
+
+    /* get the next directory entry */
+    dent = readdir(session->dp);
+    if(dent == NULL)
+    {
+      /* we have exhausted the directory listing */
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, rc, "OK\r\n");
+      return LOOP_EXIT;
+    }
+
+    /* TODO I think we are supposed to return entries for . and .. */
+    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      return LOOP_CONTINUE;
+
+#ifdef __linux__
+    ++listing_entries;
+#endif
+    FTP_PROBE2(list__entry, session, dent->d_name);
+
+    /* check if this was a NLST */
+    if(session->dir_mode == XFER_DIR_NLST)
+    {
+      /* NLST gives the whole path name */
+      session->buffersize = 0;
+      if(build_path(session, session->lwd, dent->d_name) == 0)
+      {
+        /* encode \n in path */
+        len = session->buffersize;
+        buffer = encode_path(session->buffer, &len, false);
         if(buffer != NULL)
-          ftp_send_response_buffer(session, buffer, len);
+        {
+          /* copy to the session buffer to send */
+          memcpy(session->buffer, buffer, len);
+          free(buffer);
+          session->buffer[len++] = '\r';
+          session->buffer[len++] = '\n';
+          session->buffersize = len;
+        }
+      }
+    }
+    else
+    {
+#ifdef _3DS
+      /* the sdmc directory entry already has the type and size, so no need to do a slow stat */
+      u32 magic = *(u32*)session->dp->dirData->dirStruct;
+
+      if(magic == SDMC_DIRITER_MAGIC)
+      {
+        sdmc_dir_t        *dir   = (sdmc_dir_t*)session->dp->dirData->dirStruct;
+        FS_DirectoryEntry *entry = &dir->entry_data[dir->index];
+
+        if(entry->attributes & FS_ATTRIBUTE_DIRECTORY)
+          st.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
         else
-          ftp_send_response_buffer(session, key.name, strlen(key.name));
-        free(buffer);
+          st.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
 
-        /* send args (if any) */
-        if(*args != 0)
+        if(!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
+          st.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+
+        st.st_size  = entry->fileSize;
+        st.st_mtime = 0;
+
+        bool getmtime = true;
+        if(session->dir_mode == XFER_DIR_MLSD
+        || session->dir_mode == XFER_DIR_MLST)
         {
-          ftp_send_response_buffer(session, " ", 1);
+          if(!(session->mlst_flags & SESSION_MLST_MODIFY))
+            getmtime = false;
+        }
+        else if(session->dir_mode == XFER_DIR_NLST)
+          getmtime = false;
 
-          len = strlen(args);
-          buffer = encode_path(args, &len, false);
-          if(buffer != NULL)
-            ftp_send_response_buffer(session, buffer, len);
+        if((rc = build_path(session, session->lwd, dent->d_name)) != 0)
+          console_error(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
+        else if(getmtime)
+        {
+          uint64_t mtime = 0;
+          if((rc = sdmc_getmtime(session->buffer, &mtime)) != 0)
+            console_error(RED "sdmc_getmtime '%s': 0x%x\n" RESET, session->buffer, rc);
           else
-            ftp_send_response_buffer(session, args, strlen(args));
-          free(buffer);
+            st.st_mtime = mtime;
         }
-
-        /* send footer */
-        ftp_send_response_buffer(session, "\"\r\n", 3);
       }
-      else if(session->state != COMMAND_STATE)
+      else
       {
-        /* only some commands are available during data transfer */
-        if(strcasecmp(command->name, "ABOR") != 0
-        && strcasecmp(command->name, "STAT") != 0
-        && strcasecmp(command->name, "QUIT") != 0)
+        /* lstat the entry */
+        if((rc = build_path(session, session->lwd, dent->d_name)) != 0)
+          console_error(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
+        else if((rc = lstat(session->buffer, &st)) != 0)
+          console_error(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+
+        if(rc != 0)
         {
-          ftp_send_response(session, 503, "Invalid command during transfer\r\n");
+          /* an error occurred */
           ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_session_close_cmd(session);
+          ftp_send_response(session, 550, "unavailable\r\n");
+          return LOOP_EXIT;
         }
-        else
-          command->handler(session, args);
       }
-      else
-      {
-        /* clear RENAME flag for all commands except RNTO */
-        if(strcasecmp(command->name, "RNTO") != 0)
-          session->flags &= ~SESSION_RENAME;
+#else
+      /* lstat the entry */
+      if((rc = build_path(session, session->lwd, dent->d_name)) != 0)
+        console_error(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
+      else if((rc = lstat(session->buffer, &st)) != 0)
+        console_error(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
 
-        command->handler(session, args);
+      if(rc != 0)
+      {
+        /* an error occurred */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 550, "unavailable\r\n");
+        return LOOP_EXIT;
       }
-
-      /* remove executed command from the command buffer */
-      len = session->cmd_buffer + session->cmd_buffersize - next;
-      if(len > 0)
-        memmove(session->cmd_buffer, next, len);
-      session->cmd_buffersize = len;
+#endif
+      /* encode \n in path */
+      len = strlen(dent->d_name);
+      buffer = encode_path(dent->d_name, &len, false);
+      if(buffer != NULL)
+      {
+        rc = ftp_session_fill_dirent(session, &st, buffer, len);
+        free(buffer);
+        if(rc != 0)
+        {
+          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+          ftp_send_response(session, 425, "%s\r\n", strerror(rc));
+          return LOOP_EXIT;
+        }
+      }
+      else
+        session->buffersize = 0;
     }
+    session->bufferpos = 0;
   }
-}
-
-/*! poll sockets for ftp session
- *
- *  @param[in] session ftp session
- *
- *  @returns next session
- */
-static ftp_session_t*
-ftp_session_poll(ftp_session_t *session)
-{
-  int           rc;
-  struct pollfd pollinfo[2];
-  nfds_t        nfds = 1;
 
-  /* the first pollfd is the command socket */
-  pollinfo[0].fd      = session->cmd_fd;
-  pollinfo[0].events  = POLLIN | POLLPRI;
-  pollinfo[0].revents = 0;
+  /* stay within the rate limits */
+  len = ftp_session_allowance(session, session->buffersize - session->bufferpos);
+  if(len == 0)
+    return LOOP_EXIT;
 
-  switch(session->state)
+  /* send any pending data; more entries or the reply always follow, so
+   * partial segments can wait for them
+   */
+#ifdef __linux__
+  rc = send(session->data_fd, session->buffer + session->bufferpos, len,
+            SOCK_MORE ? MSG_MORE : 0);
+#else
+  rc = send(session->data_fd, session->buffer + session->bufferpos, len, 0);
+#endif
+  if(rc <= 0)
   {
-    case COMMAND_STATE:
-      /* we are waiting to read a command */
-      break;
-
-    case DATA_CONNECT_STATE:
-      if(session->flags & SESSION_PASV)
-      {
-        /* we are waiting for a PASV connection */
-        pollinfo[1].fd     = session->pasv_fd;
-        pollinfo[1].events = POLLIN;
-      }
-      else
+    /* error sending data */
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
       {
-        /* we are waiting to complete a PORT connection */
-        pollinfo[1].fd     = session->data_fd;
-        pollinfo[1].events = POLLOUT;
+        FTP_PROBE1(transfer__block, session);
+        return LOOP_EXIT;
       }
-      pollinfo[1].revents = 0;
-      nfds = 2;
-      break;
+      console_error(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_warn(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
 
-    case DATA_TRANSFER_STATE:
-      /* we need to transfer data */
-      pollinfo[1].fd     = session->data_fd;
-      if(session->flags & SESSION_RECV)
-        pollinfo[1].events = POLLIN;
-      else
-        pollinfo[1].events = POLLOUT;
-      pollinfo[1].revents = 0;
-      nfds = 2;
-      break;
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return LOOP_EXIT;
   }
 
-  /* poll the selected sockets */
-  rc = poll(pollinfo, nfds, 0);
-  if(rc < 0)
+  /* we can try to send more data */
+  session->bufferpos += rc;
+  ftp_session_charge(session, rc);
+  return LOOP_CONTINUE;
+}
+
+/*! send a file to the client
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+retrieve_transfer(ftp_session_t *session)
+{
+  ssize_t    rc;
+  uint64_t   end;
+  const char *data;
+  size_t     len;
+  bool       buffered = false;
+  int        flags = 0;
+
+  if(session->cache != NULL)
   {
-    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
+    /* send straight from the cached contents */
+    end = session->cache->size;
+    if(session->rangeend != 0 && session->rangeend < end)
+      end = session->rangeend;
+
+    if(session->filepos >= end)
+    {
+#ifdef __linux__
+      /* don't release memory the kernel is still sending from */
+      if(ftp_session_zerocopy_busy(session))
+        return LOOP_EXIT;
+#endif
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 226, "OK\r\n");
+      return LOOP_EXIT;
+    }
+
+    data = session->cache->data + session->filepos;
+    len  = end - session->filepos;
   }
-  else if(rc > 0)
+#ifdef __linux__
+  else if(MMAP_SIZE > 0 && session->file != NULL && session->iobuf == NULL
+       && session->filesize >= MMAP_SIZE)
   {
-    /* check the command socket */
-    if(pollinfo[0].revents != 0)
+    /* send straight from a mapping of the file */
+    end = session->filesize;
+    if(session->rangeend != 0 && session->rangeend < end)
+      end = session->rangeend;
+
+    if(session->filepos >= end)
     {
-      /* handle command */
-      if(pollinfo[0].revents & POLL_UNKNOWN)
-        console_print(YELLOW "cmd_fd: revents=0x%08X\n" RESET, pollinfo[0].revents);
+      /* don't release memory the kernel is still sending from */
+      if(ftp_session_zerocopy_busy(session))
+        return LOOP_EXIT;
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 226, "OK\r\n");
+      return LOOP_EXIT;
+    }
 
-      /* we need to read a new command */
-      if(pollinfo[0].revents & (POLLERR|POLLHUP))
-      {
-        debug_print("cmd revents=0x%x\n", pollinfo[0].revents);
-        ftp_session_close_cmd(session);
-      }
-      else if(pollinfo[0].revents & (POLLIN | POLLPRI))
-        ftp_session_read_command(session, pollinfo[0].revents);
+    if(ftp_session_map(session) != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 451, "Failed to read file\r\n");
+      return LOOP_EXIT;
     }
 
-    /* check the data/pasv socket */
-    if(nfds > 1 && pollinfo[1].revents != 0)
+    ftp_session_readahead(session);
+
+    data = session->map + (session->filepos - session->mapstart);
+    len  = session->mapstart + session->maplen - session->filepos;
+    if(len > end - session->filepos)
+      len = end - session->filepos;
+  }
+#endif
+  else
+  {
+    if(session->bufferpos == session->buffersize)
     {
-      switch(session->state)
+#ifdef __linux__
+      /* don't overwrite memory the kernel is still sending from */
+      if(ftp_session_zerocopy_busy(session))
+        return LOOP_EXIT;
+#endif
+
+      /* we have sent all the data so read some more */
+      rc = ftp_session_read_file(session);
+      if(rc <= 0)
       {
-        case COMMAND_STATE:
-          /* this shouldn't happen? */
-          break;
+        /* can't read any more data */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        if(rc < 0)
+          ftp_send_response(session, 451, "Failed to read file\r\n");
+        else
+          ftp_send_response(session, 226, "OK\r\n");
+        return LOOP_EXIT;
+      }
 
-        case DATA_CONNECT_STATE:
-          if(pollinfo[1].revents & POLL_UNKNOWN)
-            console_print(YELLOW "pasv_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+      /* we read some data so reset the session buffer to send */
+      session->bufferpos  = 0;
+      session->buffersize = rc;
+    }
 
-          /* we need to accept the PASV connection */
-          if(pollinfo[1].revents & (POLLERR|POLLHUP))
-          {
-            ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-            ftp_send_response(session, 426, "Data connection failed\r\n");
-          }
-          else if(pollinfo[1].revents & POLLIN)
-          {
-            if(ftp_session_accept(session) != 0)
-              ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          }
-          else if(pollinfo[1].revents & POLLOUT)
-          {
+    data     = ftp_session_xfer_buffer(session) + session->bufferpos;
+    len      = session->buffersize - session->bufferpos;
+    buffered = true;
+  }
 
-            console_print(CYAN "connected to %s:%u\n" RESET,
-                          inet_ntoa(session->peer_addr.sin_addr),
-                          ntohs(session->peer_addr.sin_port));
+  /* the kernel slows down a lot when asked to queue more than the socket
+   * buffer holds, so send from memory in socket buffer sized pieces */
+  if(len > (size_t)sock_buffersize)
+    len = sock_buffersize;
 
-            ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
-            ftp_send_response(session, 150, "Ready\r\n");
-          }
-          break;
+  /* stay within the rate limits */
+  len = ftp_session_allowance(session, len);
+  if(len == 0)
+    return LOOP_EXIT;
 
-        case DATA_TRANSFER_STATE:
-          if(pollinfo[1].revents & POLL_UNKNOWN)
-            console_print(YELLOW "data_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+#ifdef __linux__
+  /* lend the kernel memory that stays put until it is done with it; the
+   * session buffer is refilled too often for that to pay off */
+  if((session->flags & SESSION_ZEROCOPY) && (!buffered || session->iobuf != NULL))
+  {
+    int one = 1;
 
-          /* we need to transfer data */
-          if(pollinfo[1].revents & (POLLERR|POLLHUP))
-          {
-            ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-            ftp_send_response(session, 426, "Data connection failed\r\n");
-          }
-          else if(pollinfo[1].revents & (POLLIN|POLLOUT))
-            ftp_session_transfer(session);
-          break;
-      }
+    if(session->zc_sent == 0
+    && setsockopt(session->data_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+    {
+      console_warn(YELLOW "setsockopt: SO_ZEROCOPY %d %s\n" RESET, errno, strerror(errno));
+      session->flags &= ~SESSION_ZEROCOPY;
     }
+    else
+      flags = MSG_ZEROCOPY;
   }
+#endif
 
-  /* still connected to peer; return next session */
-  if(session->cmd_fd >= 0)
-    return session->next;
+  /* send any pending data */
+  rc = send(session->data_fd, data, len, flags);
+#ifdef __linux__
+  if(rc < 0 && errno == ENOBUFS && flags != 0)
+  {
+    /* out of memory to track completions; copy this piece */
+    flags = 0;
+    rc    = send(session->data_fd, data, len, 0);
+  }
+  if(rc > 0 && flags != 0)
+    ++session->zc_sent;
+#endif
+  if(rc <= 0)
+  {
+    /* error sending data */
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
+      {
+        FTP_PROBE1(transfer__block, session);
+        return LOOP_EXIT;
+      }
+      console_error(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_warn(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
 
-  /* disconnected from peer; destroy it and return next session */
-  debug_print("disconnected from peer\n");
-  return ftp_session_destroy(session);
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return LOOP_EXIT;
+  }
+
+  /* we can try to send more data */
+  if(buffered)
+    session->bufferpos += rc;
+  else
+    session->filepos += rc;
+  ftp_session_charge(session, rc);
+  return LOOP_CONTINUE;
 }
 
-/* Update free space in status bar */
-static void
-update_free_space(void)
+#ifdef __linux__
+/*! wait for a group commit of an upload
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+commit_transfer(ftp_session_t *session)
 {
-#if defined(_3DS) || defined(__SWITCH__)
-#define KiB (1024.0)
-#define MiB (1024.0*KiB)
-#define GiB (1024.0*MiB)
-  char           buffer[16];
-  struct statvfs st;
-  double         bytes_free;
-  int            rc, len;
-
-  rc = statvfs("sdmc:/", &st);
-  if(rc != 0)
-    console_print(RED "statvfs: %d %s\n" RESET, errno, strerror(errno));
-  else
+  /* batch the uploads that finish within one interval */
+  if(session->commit > 0)
   {
-    bytes_free = (double)st.f_bsize * st.f_bfree;
-
-    if     (bytes_free < 1000.0)
-      len = snprintf(buffer, sizeof(buffer), "%.0lfB", bytes_free);
-    else if(bytes_free < 10.0*KiB)
-      len = snprintf(buffer, sizeof(buffer), "%.2lfKiB", floor((bytes_free*100.0)/KiB)/100.0);
-    else if(bytes_free < 100.0*KiB)
-      len = snprintf(buffer, sizeof(buffer), "%.1lfKiB", floor((bytes_free*10.0)/KiB)/10.0);
-    else if(bytes_free < 1000.0*KiB)
-      len = snprintf(buffer, sizeof(buffer), "%.0lfKiB", floor(bytes_free/KiB));
-    else if(bytes_free < 10.0*MiB)
-      len = snprintf(buffer, sizeof(buffer), "%.2lfMiB", floor((bytes_free*100.0)/MiB)/100.0);
-    else if(bytes_free < 100.0*MiB)
-      len = snprintf(buffer, sizeof(buffer), "%.1lfMiB", floor((bytes_free*10.0)/MiB)/10.0);
-    else if(bytes_free < 1000.0*MiB)
-      len = snprintf(buffer, sizeof(buffer), "%.0lfMiB", floor(bytes_free/MiB));
-    else if(bytes_free < 10.0*GiB)
-      len = snprintf(buffer, sizeof(buffer), "%.2lfGiB", floor((bytes_free*100.0)/GiB)/100.0);
-    else if(bytes_free < 100.0*GiB)
-      len = snprintf(buffer, sizeof(buffer), "%.1lfGiB", floor((bytes_free*10.0)/GiB)/10.0);
-    else
-      len = snprintf(buffer, sizeof(buffer), "%.0lfGiB", floor(bytes_free/GiB));
+    if(ftp_file_now() < commit_stamp + GROUP_COMMIT_INTERVAL)
+    {
+      /* sleep until the next commit instead of polling for it */
+      session->resume = commit_stamp + GROUP_COMMIT_INTERVAL;
+      return LOOP_EXIT;
+    }
 
-    console_set_status("\x1b[0;%dH" GREEN "%s", 50-len, buffer);
+    ftp_group_commit();
   }
-#endif
+
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+  if(session->commit == 0)
+    ftp_send_response(session, 226, "OK\r\n");
+  else
+    ftp_send_response(session, 451, "Failed to sync file\r\n");
+  return LOOP_EXIT;
 }
+#endif
 
-/*! Update status bar */
-static int
-update_status(void)
+/*! finish storing a file once the data connection is done
+ *
+ *  @param[in] session ftp session
+ *  @param[in] rc      0 if the client closed the connection, -1 for error
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+store_done(ftp_session_t *session,
+           ssize_t       rc)
 {
-#if defined(_3DS) || defined(__SWITCH__)
-  console_set_status("\n" GREEN STATUS_STRING " "
-#ifdef ENABLE_LOGGING
-                     "DEBUG "
+#ifdef __linux__
+  /* this segment made it to disk; the last writer finishes the file
+   * before its size and mtime are recorded anywhere */
+  if(rc == 0)
+  {
+    ftp_upload_complete(session->upload, session->uploadstart, session->filepos);
+    ++session->upload->received;
+    if(session->upload->refs == 1 && ftp_upload_finalize(session->upload) != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 451, "Failed to publish file\r\n");
+      return LOOP_EXIT;
+    }
+  }
 #endif
-                     CYAN "%s:%u" RESET,
-                     inet_ntoa(serv_addr.sin_addr),
-                     ntohs(serv_addr.sin_port));
-  update_free_space();
-#else
-  char      hostname[128];
-  socklen_t addrlen = sizeof(serv_addr);
-  int       rc;
 
-  rc = getsockname(listenfd, (struct sockaddr*)&serv_addr, &addrlen);
-  if(rc != 0)
+#if STORE_HASH
+  if(rc == 0 && (session->flags & SESSION_HASHED))
   {
-    console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    char hex[HASH_MAX_HEX];
+
+    hash_final(&session->hash, hex);
+    ftp_session_save_hash(session, hex);
   }
+#endif
 
-  rc = gethostname(hostname, sizeof(hostname));
-  if(rc != 0)
+#ifdef __linux__
+  if(rc == 0)
   {
-    console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    /* make the upload durable before reporting success */
+    rc = ftp_session_sync(session);
+    if(rc > 0)
+    {
+      /* wait for the group commit over the command socket */
+      ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV | CLOSE_DATA);
+      session->data_fd  = session->cmd_fd;
+      session->flags   |= SESSION_SEND;
+      session->transfer = commit_transfer;
+      session->resume   = commit_stamp + GROUP_COMMIT_INTERVAL;
+      return LOOP_EXIT;
+    }
+    else if(rc < 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 451, "Failed to sync file\r\n");
+      return LOOP_EXIT;
+    }
   }
-
-  console_set_status(GREEN STATUS_STRING " "
-#ifdef ENABLE_LOGGING
-                     "DEBUG "
-#endif
-                     YELLOW "IP:"   CYAN "%s "
-                     YELLOW "Port:" CYAN "%u"
-                     RESET,
-                     hostname,
-                     ntohs(serv_addr.sin_port));
 #endif
 
-  return 0;
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+
+  if(rc == 0)
+    ftp_send_response(session, 226, "OK\r\n");
+  else
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+  return LOOP_EXIT;
 }
 
-#ifdef _3DS
-/*! Handle apt events
+#ifdef __linux__
+/*! receive a file from the client with O_DIRECT
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
  *
- *  @param[in] type    Event type
- *  @param[in] closure Callback closure
+ *  @note Data is gathered in the aligned buffer until a whole buffer can be
+ *        written, starting with just enough to align a REST offset.
  */
-static void
-apt_hook(APT_HookType type,
-         void         *closure)
+static loop_status_t
+store_direct_transfer(ftp_session_t *session)
 {
-  switch(type)
+  ssize_t rc;
+  size_t  len, fill = DIRECT_IO_BUFFERSIZE;
+
+  if(session->filepos % DIRECT_IO_ALIGN != 0)
+    fill = DIRECT_IO_ALIGN - session->filepos % DIRECT_IO_ALIGN;
+
+  /* stay within the rate limits */
+  len = ftp_session_allowance(session, fill - session->buffersize);
+  if(len == 0)
+    return LOOP_EXIT;
+
+  rc = recv(session->data_fd, session->iobuf + session->buffersize, len, 0);
+  if(rc <= 0)
   {
-    case APTHOOK_ONSUSPEND:
-    case APTHOOK_ONSLEEP:
-      /* turn on backlight, or you can't see the home menu! */
-      if(R_SUCCEEDED(gspLcdInit()))
+    /* can't read any more data */
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
       {
-        GSPLCD_PowerOnBacklight(GSPLCD_SCREEN_BOTH);
-        gspLcdExit();
+        FTP_PROBE1(transfer__block, session);
+        return LOOP_EXIT;
       }
-      break;
+      console_error(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+    }
 
-    case APTHOOK_ONRESTORE:
-    case APTHOOK_ONWAKEUP:
-      /* restore backlight power state */
-      if(R_SUCCEEDED(gspLcdInit()))
-      {
-        (lcd_power ? GSPLCD_PowerOnBacklight : GSPLCD_PowerOffBacklight)(GSPLCD_SCREEN_BOTH);
-        gspLcdExit();
-      }
-      break;
+    /* write out the unaligned tail */
+    if(ftp_session_flush_direct(session) != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 451, "Failed to write file\r\n");
+      return LOOP_EXIT;
+    }
 
-    default:
-      break;
+    return store_done(session, rc);
   }
-}
-#elif defined(__SWITCH__)
-/*! Handle applet events
- *
- *  @param[in] type    Event type
- *  @param[in] closure Callback closure
- */
-static void
-applet_hook(AppletHookType type,
-         void         *closure)
-{
-  (void)closure;
-  (void)type;
-  /* stubbed for now */
-  switch(type)
+
+  session->buffersize += rc;
+  ftp_session_charge(session, rc);
+  if(session->buffersize == fill && ftp_session_flush_direct(session) != 0)
   {
-    default:
-      break;
+    /* error writing data */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 451, "Failed to write file\r\n");
+    return LOOP_EXIT;
   }
+
+  /* we can try to receive more data */
+  return LOOP_CONTINUE;
 }
 #endif
 
-/*! initialize ftp subsystem */
-int
-ftp_init(void)
+/*! receive a file from the client
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+store_transfer(ftp_session_t *session)
 {
-  int rc;
-
-  start_time = time(NULL);
-
-#ifdef _3DS
-  Result ret  = 0;
-  u32    wifi = 0;
-  bool   loop;
-
-  /* register apt hook */
-  aptHook(&cookie, apt_hook, NULL);
+  ssize_t rc;
+  size_t  len;
 
-  console_print(GREEN "Waiting for wifi...\n" RESET);
+#ifdef __linux__
+  if(session->iobuf != NULL)
+    return store_direct_transfer(session);
+#endif
 
-  /* wait for wifi to be available */
-  while((loop = aptMainLoop()) && !wifi && (ret == 0 || ret == 0xE0A09D2E))
+  if(session->bufferpos == session->buffersize)
   {
-    ret = 0;
+    /* stay within the rate limits */
+    len = ftp_session_allowance(session, sizeof(session->buffer));
+    if(len == 0)
+      return LOOP_EXIT;
 
-    hidScanInput();
-    if(hidKeysDown() & KEY_B)
+    /* we have written all the received data, so try to get some more */
+    rc = recv(session->data_fd, session->buffer, len, 0);
+    if(rc <= 0)
     {
-      /* user canceled */
-      loop = false;
-      break;
+      /* can't read any more data */
+      if(rc < 0)
+      {
+        if(errno == EWOULDBLOCK)
+        {
+          FTP_PROBE1(transfer__block, session);
+          return LOOP_EXIT;
+        }
+        console_error(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+      }
+
+      return store_done(session, rc);
     }
 
-    /* update the wifi status */
-    ret = ACU_GetWifiStatus(&wifi);
-    if(ret != 0)
-      wifi = 0;
+    /* we received some data so reset the session buffer to write */
+    session->bufferpos  = 0;
+    session->buffersize = rc;
+    ftp_session_charge(session, rc);
   }
 
-  /* check if there was a wifi error */
-  if(ret != 0)
-    console_print(RED "ACU_GetWifiStatus returns 0x%lx\n" RESET, ret);
-
-  /* check if we need to exit */
-  if(!loop || ret != 0)
-    return -1;
-
-  console_print(GREEN "Ready!\n" RESET);
-
-  /* allocate buffer for SOC service */
-  SOCU_buffer = (u32*)memalign(SOCU_ALIGN, SOCU_BUFFERSIZE);
-  if(SOCU_buffer == NULL)
+  rc = ftp_session_write_file(session);
+  if(rc <= 0)
   {
-    console_print(RED "memalign: failed to allocate\n" RESET);
-    goto memalign_fail;
+    /* error writing data */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 451, "Failed to write file\r\n");
+    return LOOP_EXIT;
   }
 
-  /* initialize SOC service */
-  ret = socInit(SOCU_buffer, SOCU_BUFFERSIZE);
-  if(ret != 0)
-  {
-    console_print(RED "socInit: %08X\n" RESET, (unsigned int)ret);
-    goto soc_fail;
-  }
-#elif defined(__SWITCH__)
-  static const SocketInitConfig socketInitConfig = {
-    .bsdsockets_version = 1,
+  /* hash what went to disk */
+  if(session->flags & SESSION_HASHED)
+    hash_update(&session->hash, session->buffer + session->bufferpos, rc);
 
-    .tcp_tx_buf_size        = 8 * SOCK_BUFFERSIZE,
-    .tcp_rx_buf_size        = 8 * SOCK_BUFFERSIZE,
-    .tcp_tx_buf_max_size    = 16 * SOCK_BUFFERSIZE,
-    .tcp_rx_buf_max_size    = 16 * SOCK_BUFFERSIZE,
+  /* we can try to receive more data */
+  session->bufferpos += rc;
+  return LOOP_CONTINUE;
+}
 
-    .udp_tx_buf_size = 0x2400,
-    .udp_rx_buf_size = 0xA500,
+/*! ftp_xfer_file mode */
+typedef enum
+{
+  XFER_FILE_RETR, /*!< Retrieve a file */
+  XFER_FILE_STOR, /*!< Store a file */
+  XFER_FILE_APPE, /*!< Append a file */
+} xfer_file_mode_t;
 
-    .sb_efficiency = 8,
-  };
+/*! Transfer a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    ftp arguments
+ *  @param[in] mode    transfer mode
+ *
+ *  @returns failure
+ */
+static void
+ftp_xfer_file(ftp_session_t    *session,
+              const char       *args,
+              xfer_file_mode_t mode)
+{
+  int rc;
 
-  Result ret = socketInitialize(&socketInitConfig);
-  if(ret != 0)
+  /* build the path of the file to transfer */
+  if(build_path(session, session->cwd, args) != 0)
   {
-    console_print(RED "socketInitialize: %X\n" RESET, (unsigned int)ret);
-    return -1;
+    rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 553, "%s\r\n", strerror(rc));
+    return;
   }
 
-  /* register applet hook */
-  appletHook(&cookie, applet_hook, NULL);
+#ifdef __linux__
+  ftp_session_account_begin(session,
+                            mode == XFER_FILE_RETR ? "RETR" :
+                            mode == XFER_FILE_APPE ? "APPE" :
+                            session->flags & SESSION_UNIQUE ? "STOU" : "STOR",
+                            session->buffer);
 #endif
 
-  /* allocate socket to listen for clients */
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  if(listenfd < 0)
+  /* hash whole-file uploads on the way to disk */
+  session->flags &= ~SESSION_HASHED;
+  if(STORE_HASH && mode == XFER_FILE_STOR && session->filepos == 0)
   {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
+    hash_init(&session->hash, session->hash_algo);
+    session->flags |= SESSION_HASHED;
   }
 
-  /* get address to listen on */
-  serv_addr.sin_family      = AF_INET;
-#if defined(_3DS) || defined(__SWITCH__)
-  serv_addr.sin_addr.s_addr = gethostid();
-  serv_addr.sin_port        = htons(LISTEN_PORT);
-#else
-  serv_addr.sin_addr.s_addr = INADDR_ANY;
-  serv_addr.sin_port        = htons(LISTEN_PORT);
-#endif
+  /* the file is about to change */
+  if(mode != XFER_FILE_RETR)
+    ftp_file_invalidate(session->buffer);
 
-  /* reuse address */
-  {
-    int yes = 1;
-    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-    if(rc != 0)
-    {
-      console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
-      ftp_exit();
-      return -1;
-    }
-  }
+  /* open the file for retrieving or storing */
+  if(mode == XFER_FILE_RETR)
+    rc = ftp_session_open_file_read(session);
+  else
+    rc = ftp_session_open_file_write(session, mode == XFER_FILE_APPE);
+  FTP_PROBE3(file__open, session, session->buffer, rc);
+
+  /* the size hint only applies to one transfer */
+  session->allocsize = 0;
 
-  /* bind socket to listen address */
-  rc = bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
   if(rc != 0)
   {
-    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
+    /* error opening the file */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 450, "failed to open file\r\n");
+    return;
   }
 
-  /* listen on socket */
-  rc = listen(listenfd, 5);
-  if(rc != 0)
-  {
-    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
-  }
+  if(session->flags & (SESSION_PORT|SESSION_PASV))
+  {
+    ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
+
+    if(session->flags & SESSION_PORT)
+    {
+      /* setup connection */
+      rc = ftp_session_connect(session);
+      if(rc != 0)
+      {
+        /* error connecting */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 425, "can't open data connection\r\n");
+        return;
+      }
+    }
+
+    /* set up the transfer */
+    session->weight  = TRANSFER_WEIGHT_FILE;
+    session->deficit = 0;
+    session->flags &= ~(SESSION_RECV|SESSION_SEND|SESSION_ZEROCOPY);
+    if(mode == XFER_FILE_RETR)
+    {
+      session->flags   |= SESSION_SEND;
+      session->transfer = retrieve_transfer;
+#ifdef __linux__
+      if(SEND_ZEROCOPY)
+        session->flags |= SESSION_ZEROCOPY;
+#endif
+    }
+    else
+    {
+      session->flags   |= SESSION_RECV;
+      session->transfer = store_transfer;
+    }
+
+    session->bufferpos  = 0;
+    session->buffersize = 0;
 
-  /* print server address */
-  rc = update_status();
-  if(rc != 0)
-  {
-    ftp_exit();
-    return -1;
+    return;
   }
 
-  return 0;
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+}
 
-#ifdef _3DS
-soc_fail:
-  free(SOCU_buffer);
-  SOCU_buffer = NULL;
+/*! send a hash response
+ *
+ *  @param[in] session ftp session
+ *  @param[in] algo    hash algorithm
+ *  @param[in] start   first byte hashed
+ *  @param[in] end     one past the last byte hashed
+ *  @param[in] hex     hex digest
+ */
+static void
+ftp_session_send_hash(ftp_session_t *session,
+                      hash_algo_t   algo,
+                      uint64_t      start,
+                      uint64_t      end,
+                      const char    *hex)
+{
+  /* HASH reports an inclusive range */
+  if(end > start)
+    --end;
 
-memalign_fail:
-  return -1;
-#endif
+  if(session->flags & SESSION_XHASH)
+    ftp_send_response(session, 250, "%s\r\n", hex);
+  else
+    ftp_send_response(session, 213, "%s %" PRIu64 "-%" PRIu64 " %s %s\r\n",
+                      hash_name(algo), start, end, hex, session->xfer_path);
 }
 
-/*! deinitialize ftp subsystem */
-void
-ftp_exit(void)
+/*! hash a file for the client
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+hash_transfer(ftp_session_t *session)
 {
-#if defined(_3DS)
-  Result ret;
+  char     hex[HASH_MAX_HEX];
+  size_t   hashed = 0;
+  ssize_t  rc;
+  uint64_t start, end;
+
+  /* hash a bounded amount so that other sessions get serviced */
+  while(hashed < HASH_QUANTUM)
+  {
+    rc = ftp_session_read_file(session);
+    if(rc < 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+      ftp_send_response(session, 451, "Failed to read file\r\n");
+      return LOOP_EXIT;
+    }
+    else if(rc == 0)
+    {
+      /* we reached the end of the range */
+      hash_final(&session->hash, hex);
+#if STORE_HASH
+      ftp_session_save_hash(session, hex);
 #endif
 
-  debug_print("exiting ftp server\n");
+      end   = session->filepos;
+      start = end - session->hash.length;
 
-  /* clean up all sessions */
-  while(sessions != NULL)
-    ftp_session_destroy(sessions);
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+      ftp_session_send_hash(session, session->hash.algo, start, end, hex);
+      return LOOP_EXIT;
+    }
 
-  /* stop listening for new clients */
-  if(listenfd >= 0)
-    ftp_closesocket(listenfd, false);
+    hash_update(&session->hash, ftp_session_xfer_buffer(session), rc);
+    hashed += rc;
+  }
 
-#ifdef _3DS
-  /* deinitialize SOC service */
-  console_render();
-  console_print(CYAN "Waiting for socExit()...\n" RESET);
+  /* let the other sessions run */
+  return LOOP_EXIT;
+}
 
-  if(SOCU_buffer != NULL)
+/*! copy a file on the server
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+copy_transfer(ftp_session_t *session)
+{
+  size_t   copied = 0;
+  ssize_t  rc, n, written;
+  uint64_t total;
+
+  /* copy a bounded amount so that other sessions get serviced */
+  while(copied < COPY_QUANTUM)
   {
-    ret = socExit();
-    if(ret != 0)
-      console_print(RED "socExit: 0x%08X\n" RESET, (unsigned int)ret);
-    free(SOCU_buffer);
-  }
-#elif defined(__SWITCH__)
-  /* deinitialize socket driver */
-  console_render();
-  console_print(CYAN "Waiting for socketExit()...\n" RESET);
+#ifdef __linux__
+    if(session->copy_range)
+    {
+      /* let the kernel copy without passing the data through us */
+      rc = copy_file_range(session->copy_src, NULL, session->copy_dst, NULL,
+                           COPY_QUANTUM - copied, 0);
+      if(rc < 0 && (errno == EXDEV || errno == EINVAL
+                 || errno == ENOSYS || errno == EOPNOTSUPP))
+      {
+        /* fall back to copying through our buffer */
+        session->copy_range = false;
+        continue;
+      }
+      else if(rc < 0)
+        console_error(RED "copy_file_range: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+#endif
+    {
+      rc = read(session->copy_src, session->buffer, sizeof(session->buffer));
+      if(rc < 0)
+        console_error(RED "read: %d %s\n" RESET, errno, strerror(errno));
 
-  socketExit();
+      for(written = 0; rc > 0 && written < rc; written += n)
+      {
+        n = write(session->copy_dst, session->buffer + written, rc - written);
+        if(n <= 0)
+        {
+          console_error(RED "write: %d %s\n" RESET, errno, strerror(errno));
+          rc = -1;
+        }
+      }
+    }
 
-#endif
+    if(rc < 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+      update_free_space();
+      ftp_send_response(session, 451, "Failed to copy file\r\n");
+      return LOOP_EXIT;
+    }
+    else if(rc == 0)
+    {
+      /* we reached the end of the source */
+      total = session->filepos;
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+      update_free_space();
+      ftp_send_response(session, 250, "OK, copied %" PRIu64 " bytes\r\n", total);
+      return LOOP_EXIT;
+    }
+
+    session->filepos += rc;
+    copied           += rc;
+  }
+
+  /* let the other sessions run */
+  return LOOP_EXIT;
 }
 
-/*! ftp look
+/*! remove a directory tree for the client
  *
- *  @returns whether to keep looping
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
  */
-loop_status_t
-ftp_loop(void)
+static loop_status_t
+rmtree_transfer(ftp_session_t *session)
 {
-  int           rc;
-  struct pollfd pollinfo;
-  ftp_session_t *session;
+  ftp_tree_t     *tree = session->tree;
+  ftp_tree_dir_t *dir;
+  struct dirent  *dent;
+  struct stat    st;
+  size_t         len, entries;
+  bool           isdir;
+  int            rc = 0;
+
+  /* remove a bounded number of entries so that other sessions get serviced */
+  for(entries = 0; entries < RMTREE_QUANTUM && rc == 0; ++entries)
+  {
+    dir = &tree->dirs[tree->depth-1];
+    session->buffer[dir->pathlen] = 0;
+
+    errno = 0;
+    dent = readdir(dir->dp);
+    if(dent == NULL && errno != 0)
+    {
+      console_error(RED "readdir '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      rc = -1;
+      break;
+    }
+    else if(dent == NULL)
+    {
+      /* this directory is empty now */
+      rc = closedir(dir->dp);
+      if(rc != 0)
+        console_error(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
+      --tree->depth;
 
-  /* we will poll for new client connections */
-  pollinfo.fd      = listenfd;
-  pollinfo.events  = POLLIN;
-  pollinfo.revents = 0;
+      if(tree->depth == 0)
+      {
+        /* remove the top of the tree */
+        rc = rmdir(session->buffer);
+        if(rc != 0)
+        {
+          console_error(RED "rmdir '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+          break;
+        }
 
-  /* poll for a new client */
-  rc = poll(&pollinfo, 1, 0);
-  if(rc < 0)
-  {
-    /* wifi got disabled */
-    if(errno == ENETDOWN)
-      return LOOP_RESTART;
+        ++tree->removed;
+        console_print(CYAN "removed %" PRIu64 " files and %" PRIu64 " directories\n" RESET,
+                      tree->files, tree->removed);
 
-    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
-    return LOOP_EXIT;
-  }
-  else if(rc > 0)
-  {
-    if(pollinfo.revents & POLLIN)
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+        update_free_space();
+        ftp_send_response(session, 250, "OK\r\n");
+        return LOOP_EXIT;
+      }
+
+      rc = ftp_session_unlink_tree(session, &tree->dirs[tree->depth-1], true);
+      if(rc != 0)
+      {
+        console_error(RED "rmdir '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+        break;
+      }
+
+      ++tree->removed;
+      continue;
+    }
+
+    /* skip current/parent directories */
+    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+
+    /* append the name to the directory's path */
+    len = strlen(dent->d_name);
+    if(dir->pathlen + 1 + len >= sizeof(session->buffer))
     {
-      /* we got a new client */
-      ftp_session_new(listenfd);
+      errno = ENAMETOOLONG;
+      console_error(RED "'%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      rc = -1;
+      break;
     }
+    session->buffer[dir->pathlen] = '/';
+    memcpy(session->buffer + dir->pathlen + 1, dent->d_name, len + 1);
+
+#ifdef __linux__
+    if(dent->d_type != DT_UNKNOWN)
+      isdir = dent->d_type == DT_DIR;
+    else if(fstatat(dirfd(dir->dp), dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+      isdir = S_ISDIR(st.st_mode);
+#else
+    if(lstat(session->buffer, &st) == 0)
+      isdir = S_ISDIR(st.st_mode);
+#endif
     else
     {
-      console_print(YELLOW "listenfd: revents=0x%08X\n" RESET, pollinfo.revents);
+      console_error(RED "lstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      rc = -1;
+      break;
     }
-  }
-
-  /* poll each session */
-  session = sessions;
-  while(session != NULL)
-    session = ftp_session_poll(session);
 
-#ifdef _3DS
-  /* check if the user wants to exit */
-  hidScanInput();
-  u32 down = hidKeysDown();
+    if(isdir)
+    {
+      /* descend into the subdirectory */
+      rc = ftp_session_push_tree(session);
+      if(rc != 0)
+        console_error(RED "opendir '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      continue;
+    }
 
-  if(down & KEY_B)
-    return LOOP_EXIT;
+    rc = ftp_session_unlink_tree(session, dir, false);
+    if(rc != 0)
+    {
+      console_error(RED "unlink '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      break;
+    }
 
-  /* check if the user wants to toggle the LCD power */
-  if(down & KEY_START)
-  {
-    lcd_power = !lcd_power;
-    apt_hook(APTHOOK_ONRESTORE, NULL);
+    ++tree->files;
   }
-#elif defined(__SWITCH__)
-  /* check if the user wants to exit */
-  hidScanInput();
-  u32 down = hidKeysDown(CONTROLLER_P1_AUTO);
 
-  if(down & KEY_B)
+  if(rc != 0)
+  {
+    rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_DATA);
+    update_free_space();
+    ftp_send_response(session, 550, "%s\r\n", strerror(rc));
     return LOOP_EXIT;
-#endif
+  }
 
-  return LOOP_CONTINUE;
+  /* let the other sessions run */
+  return LOOP_EXIT;
 }
 
-/*! change to parent directory
+/*! Hash a file
  *
  *  @param[in] session ftp session
+ *  @param[in] args    path to hash
+ *  @param[in] algo    hash algorithm
+ *
+ *  @note Uses the REST/RANG offsets already stored in the session
  */
 static void
-cd_up(ftp_session_t *session)
+ftp_xfer_hash(ftp_session_t *session,
+              const char    *args,
+              hash_algo_t   algo)
 {
-  char *slash = NULL, *p;
+  int         rc;
+  struct stat st;
 
-  /* remove basename from cwd */
-  for(p = session->cwd; *p; ++p)
+  /* remember the path as given for the response */
+  if(strlen(args) >= sizeof(session->xfer_path))
   {
-    if(*p == '/')
-      slash = p;
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 553, "%s\r\n", strerror(ENAMETOOLONG));
+    return;
   }
-  *slash = 0;
-  if(strlen(session->cwd) == 0)
-    strcat(session->cwd, "/");
-}
+  strcpy(session->xfer_path, args);
 
-/*! validate a path
- *
- *  @param[in] args path to validate
- */
-static int
-validate_path(const char *args)
-{
-  const char *p;
+  /* build the path of the file to hash */
+  if(build_path(session, session->cwd, args) != 0)
+  {
+    rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 553, "%s\r\n", strerror(rc));
+    return;
+  }
 
-  /* make sure no path components are '..' */
-  p = args;
-  while((p = strstr(p, "/..")) != NULL)
+  /* we can only hash regular files */
+  rc = ftp_file_stat(session->buffer, &st, true);
+  if(rc != 0)
   {
-    if(p[3] == 0 || p[3] == '/')
-      return -1;
+    rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+    return;
+  }
+  if(!S_ISREG(st.st_mode))
+  {
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 550, "not a regular file\r\n");
+    return;
+  }
+
+  /* the range must start inside the file */
+  if(session->filepos > (uint64_t)st.st_size)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 501, "invalid byte range\r\n");
+    return;
+  }
+
+#if STORE_HASH
+  /* answer whole-file requests from the stored digest if it is current */
+  if(session->filepos == 0
+  && (session->rangeend == 0 || session->rangeend >= (uint64_t)st.st_size))
+  {
+    char hex[HASH_MAX_HEX];
+
+    if(ftp_lookup_hash(session->buffer, &st, algo, hex) == 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, 0);
+      ftp_session_send_hash(session, algo, 0, st.st_size, hex);
+      return;
+    }
+  }
+#endif
+
+  rc = ftp_session_open_file_read(session);
+  FTP_PROBE3(file__open, session, session->buffer, rc);
+  if(rc != 0)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 450, "failed to open file\r\n");
+    return;
   }
 
-  /* make sure there are no '//' */
-  if(strstr(args, "//") != NULL)
-    return -1;
+  hash_init(&session->hash, algo);
 
-  return 0;
+  /* hash over the command socket so that we are polled every iteration */
+  ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_DATA);
+  session->data_fd  = session->cmd_fd;
+  session->flags   |= SESSION_SEND;
+  session->transfer = hash_transfer;
+  session->deficit  = 0;
 }
 
-/*! get a path relative to cwd
+/*! Hash a file for an XCRC/XMD5/XSHA* command
  *
  *  @param[in] session ftp session
- *  @param[in] cwd     working directory
- *  @param[in] args    path to make
- *
- *  @returns error
+ *  @param[in] args    ftp arguments
+ *  @param[in] algo    hash algorithm
  *
- *  @note the output goes to session->buffer
+ *  @note args is either a bare path or "path" [start [end]], where end is
+ *        exclusive and 0 means end of file
  */
-static int
-build_path(ftp_session_t *session,
-           const char    *cwd,
-           const char    *args)
+static void
+ftp_xhash(ftp_session_t *session,
+          const char    *args,
+          hash_algo_t   algo)
 {
-  int  rc;
-  char *p;
+  const char *p, *q;
+  char       *path;
+  uint64_t   start = 0, end = 0;
 
-  session->buffersize = 0;
-  memset(session->buffer, 0, sizeof(session->buffer));
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* make sure the input is a valid path */
-  if(validate_path(args) != 0)
+  if(args[0] == '"' && (q = strchr(args + 1, '"')) != NULL)
   {
-    errno = EINVAL;
-    return -1;
-  }
+    /* quoted path followed by an optional range */
+    path = strndup(args + 1, q - args - 1);
 
-  if(args[0] == '/')
-  {
-    /* this is an absolute path */
-    size_t len = strlen(args);
-    if(len > sizeof(session->buffer)-1)
+    p = q + 1;
+    while(*p == ' ')
+      ++p;
+    if(*p && parse_offset(&p, &start) == 0)
     {
-      errno = ENAMETOOLONG;
-      return -1;
+      while(*p == ' ')
+        ++p;
+      if(*p && parse_offset(&p, &end) != 0)
+        p = "?";
     }
 
-    memcpy(session->buffer, args, len);
-    session->buffersize = len;
-  }
-  else
-  {
-    /* this is a relative path */
-    if(strcmp(cwd, "/") == 0)
-      rc = snprintf(session->buffer, sizeof(session->buffer), "/%s",
-                    args);
-    else
-      rc = snprintf(session->buffer, sizeof(session->buffer), "%s/%s",
-                    cwd, args);
-
-    if(rc >= sizeof(session->buffer))
+    if(*p)
     {
-      errno = ENAMETOOLONG;
-      return -1;
+      free(path);
+      ftp_send_response(session, 501, "invalid argument\r\n");
+      return;
     }
-
-    session->buffersize = rc;
   }
+  else
+    path = strdup(args);
 
-  /* remove trailing / */
-  p = session->buffer + session->buffersize;
-  while(p > session->buffer && *--p == '/')
+  if(path == NULL)
   {
-    *p = 0;
-    --session->buffersize;
+    ftp_send_response(session, 451, "%s\r\n", strerror(ENOMEM));
+    return;
   }
 
-  /* if we ended with an empty path, it is the root directory */
-  if(session->buffersize == 0)
-    session->buffer[session->buffersize++] = '/';
+  if(end != 0 && end <= start)
+  {
+    free(path);
+    ftp_send_response(session, 501, "invalid byte range\r\n");
+    return;
+  }
 
-  return 0;
+  session->filepos  = start;
+  session->rangeend = end;
+  session->flags   |= SESSION_XHASH;
+  ftp_xfer_hash(session, path, algo);
+  free(path);
 }
 
-/*! transfer a directory listing
- *
- *  @param[in] session ftp session
+/*! Transfer a directory
  *
- *  @returns whether to call again
+ *  @param[in] session    ftp session
+ *  @param[in] args       ftp arguments
+ *  @param[in] mode       transfer mode
+ *  @param[in] workaround whether to workaround LIST -a
  */
-static loop_status_t
-list_transfer(ftp_session_t *session)
+static void
+ftp_xfer_dir(ftp_session_t   *session,
+             const char      *args,
+             xfer_dir_mode_t mode,
+             bool            workaround)
 {
-  ssize_t       rc;
-  size_t        len;
-  char          *buffer;
-  struct stat   st;
-  struct dirent *dent;
+  ssize_t     rc;
+  size_t      len;
+  struct stat st;
+  char        *buffer;
+#ifdef __linux__
+  const char  *command = mode == XFER_DIR_LIST ? "LIST" :
+                         mode == XFER_DIR_NLST ? "NLST" :
+                         mode == XFER_DIR_MLSD ? "MLSD" : NULL;
+#endif
 
-  /* check if we sent all available data */
-  if(session->bufferpos == session->buffersize)
-  {
-    /* check xfer dir type */
-    if(session->dir_mode == XFER_DIR_STAT)
-      rc = 213;
-    else
-      rc = 226;
+  /* set up the transfer */
+  session->dir_mode = mode;
+  session->flags &= ~SESSION_RECV;
+  session->flags |= SESSION_SEND;
 
-    /* check if this was for a file */
-    if(session->dp == NULL)
-    {
-      /* we already sent the file's listing */
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, rc, "OK\r\n");
-      return LOOP_EXIT;
-    }
+  session->transfer   = list_transfer;
+  session->weight     = TRANSFER_WEIGHT_LIST;
+  session->deficit    = 0;
+  session->buffersize = 0;
+  session->bufferpos  = 0;
 
-    /* get the next directory entry */
-    dent = readdir(session->dp);
-    if(dent == NULL)
+#ifdef __linux__
+  /* a listing without an argument is of the cwd */
+  if(command != NULL && strlen(args) == 0)
+    ftp_session_account_begin(session, command, session->cwd);
+#endif
+
+  if(strlen(args) > 0)
+  {
+    /* an argument was provided */
+    if(build_path(session, session->cwd, args) != 0)
     {
-      /* we have exhausted the directory listing */
+      /* error building path */
       ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, rc, "OK\r\n");
-      return LOOP_EXIT;
+      ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+      return;
     }
 
-    /* TODO I think we are supposed to return entries for . and .. */
-    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
-      return LOOP_CONTINUE;
+#ifdef __linux__
+    if(command != NULL)
+      ftp_session_account_begin(session, command, session->buffer);
+#endif
 
-    /* check if this was a NLST */
-    if(session->dir_mode == XFER_DIR_NLST)
-    {
-      /* NLST gives the whole path name */
-      session->buffersize = 0;
-      if(build_path(session, session->lwd, dent->d_name) == 0)
-      {
-        /* encode \n in path */
-        len = session->buffersize;
-        buffer = encode_path(session->buffer, &len, false);
-        if(buffer != NULL)
-        {
-          /* copy to the session buffer to send */
-          memcpy(session->buffer, buffer, len);
-          free(buffer);
-          session->buffer[len++] = '\r';
-          session->buffer[len++] = '\n';
-          session->buffersize = len;
-        }
-      }
-    }
-    else
+    /* check if this is a directory */
+    session->dp = opendir(session->buffer);
+    if(session->dp == NULL)
     {
-#ifdef _3DS
-      /* the sdmc directory entry already has the type and size, so no need to do a slow stat */
-      u32 magic = *(u32*)session->dp->dirData->dirStruct;
-
-      if(magic == SDMC_DIRITER_MAGIC)
+      /* not a directory; check if it is a file */
+      rc = stat(session->buffer, &st);
+      if(rc != 0)
       {
-        sdmc_dir_t        *dir   = (sdmc_dir_t*)session->dp->dirData->dirStruct;
-        FS_DirectoryEntry *entry = &dir->entry_data[dir->index];
-
-        if(entry->attributes & FS_ATTRIBUTE_DIRECTORY)
-          st.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
-        else
-          st.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        /* error getting stat */
+        rc = errno;
 
-        if(!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
-          st.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+        /* work around broken clients that think LIST -a is valid */
+        if(workaround && mode == XFER_DIR_LIST)
+        {
+          if(args[0] == '-' && (args[1] == 'a' || args[1] == 'l'))
+          {
+            if(args[2] == 0)
+              buffer = strdup(args+2);
+            else
+              buffer = strdup(args+3);
 
-        st.st_size  = entry->fileSize;
-        st.st_mtime = 0;
+            if(buffer != NULL)
+            {
+              ftp_xfer_dir(session, buffer, mode, false);
+              free(buffer);
+              return;
+            }
 
-        bool getmtime = true;
-        if(session->dir_mode == XFER_DIR_MLSD
-        || session->dir_mode == XFER_DIR_MLST)
-        {
-          if(!(session->mlst_flags & SESSION_MLST_MODIFY))
-            getmtime = false;
+            rc = ENOMEM;
+          }
         }
-        else if(session->dir_mode == XFER_DIR_NLST)
-          getmtime = false;
 
-        if((rc = build_path(session, session->lwd, dent->d_name)) != 0)
-          console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
-        else if(getmtime)
-        {
-          uint64_t mtime = 0;
-          if((rc = sdmc_getmtime(session->buffer, &mtime)) != 0)
-            console_print(RED "sdmc_getmtime '%s': 0x%x\n" RESET, session->buffer, rc);
-          else
-            st.st_mtime = mtime;
-        }
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+        return;
+      }
+      else if(mode == XFER_DIR_MLSD)
+      {
+        /* specified file instead of directory for MLSD */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
+        return;
+      }
+      else if(mode == XFER_DIR_NLST)
+      {
+        /* NLST uses full path name */
+        len = session->buffersize;
+        buffer = encode_path(session->buffer, &len, false);
       }
       else
       {
-        /* lstat the entry */
-        if((rc = build_path(session, session->lwd, dent->d_name)) != 0)
-          console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
-        else if((rc = lstat(session->buffer, &st)) != 0)
-          console_print(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+        /* everything else uses base name */
+        const char *base = strrchr(session->buffer, '/') + 1;
 
-        if(rc != 0)
-        {
-          /* an error occurred */
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 550, "unavailable\r\n");
-          return LOOP_EXIT;
-        }
+        len = strlen(base);
+        buffer = encode_path(base, &len, false);
       }
-#else
-      /* lstat the entry */
-      if((rc = build_path(session, session->lwd, dent->d_name)) != 0)
-        console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
-      else if((rc = lstat(session->buffer, &st)) != 0)
-        console_print(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+
+      if(buffer)
+      {
+        rc = ftp_session_fill_dirent(session, &st, buffer, len);
+        free(buffer);
+      }
+      else
+        rc = ENOMEM;
 
       if(rc != 0)
       {
-        /* an error occurred */
         ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 550, "unavailable\r\n");
-        return LOOP_EXIT;
+        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+        return;
       }
-#endif
-      /* encode \n in path */
-      len = strlen(dent->d_name);
-      buffer = encode_path(dent->d_name, &len, false);
-      if(buffer != NULL)
+    }
+    else
+    {
+      /* it was a directory, so set it as the lwd */
+      memcpy(session->lwd, session->buffer, session->buffersize);
+      session->lwd[session->buffersize] = 0;
+      session->buffersize = 0;
+
+      if(session->dir_mode == XFER_DIR_MLSD
+      && (session->mlst_flags & SESSION_MLST_TYPE))
       {
-        rc = ftp_session_fill_dirent(session, &st, buffer, len);
-        free(buffer);
+        /* send this directory as type=cdir */
+        rc = ftp_session_fill_dirent_cdir(session, session->lwd);
         if(rc != 0)
         {
           ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 425, "%s\r\n", strerror(rc));
-          return LOOP_EXIT;
+          ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+          return;
         }
       }
-      else
-        session->buffersize = 0;
     }
-    session->bufferpos = 0;
   }
+  else if(ftp_session_open_cwd(session) != 0)
+  {
+    /* no argument, but opening cwd failed */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    return;
+  }
+  else
+  {
+    /* set the cwd as the lwd */
+    strcpy(session->lwd, session->cwd);
+    session->buffersize = 0;
 
-  /* send any pending data */
-  rc = send(session->data_fd, session->buffer + session->bufferpos,
-            session->buffersize - session->bufferpos, 0);
-  if(rc <= 0)
+    if(session->dir_mode == XFER_DIR_MLSD
+    && (session->mlst_flags & SESSION_MLST_TYPE))
+    {
+      /* send this directory as type=cdir */
+      rc = ftp_session_fill_dirent_cdir(session, session->lwd);
+      if(rc != 0)
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+        return;
+      }
+    }
+  }
+
+  if(mode == XFER_DIR_MLST || mode == XFER_DIR_STAT)
   {
-    /* error sending data */
-    if(rc < 0)
+    /* this is a little different; we have to send the data over the command socket */
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV | CLOSE_DATA);
+    session->data_fd = session->cmd_fd;
+    session->flags  |= SESSION_SEND;
+    ftp_send_response(session, -213, "Status\r\n");
+    return;
+  }
+  else if(session->flags & (SESSION_PORT|SESSION_PASV))
+  {
+    ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
+
+    if(session->flags & SESSION_PORT)
     {
-      if(errno == EWOULDBLOCK)
-        return LOOP_EXIT;
-      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+      /* setup connection */
+      rc = ftp_session_connect(session);
+      if(rc != 0)
+      {
+        /* error connecting */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 425, "can't open data connection\r\n");
+      }
     }
-    else
-      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
 
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
-    return LOOP_EXIT;
+    return;
   }
 
-  /* we can try to send more data */
-  session->bufferpos += rc;
-  return LOOP_CONTINUE;
+  /* we must have got LIST/MLSD/MLST/NLST without a preceding PORT or PASV */
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  ftp_send_response(session, 503, "Bad sequence of commands\r\n");
 }
 
-/*! send a file to the client
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *                          F T P   C O M M A N D S                          *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*! @fn static void ABOR(ftp_session_t *session, const char *args)
  *
- *  @param[in] session ftp session
+ *  @brief abort a transfer
  *
- *  @returns whether to call again
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
  */
-static loop_status_t
-retrieve_transfer(ftp_session_t *session)
+FTP_DECLARE(ABOR)
 {
-  ssize_t rc;
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  if(session->bufferpos == session->buffersize)
+  if(session->state == COMMAND_STATE)
   {
-    /* we have sent all the data so read some more */
-    rc = ftp_session_read_file(session);
-    if(rc <= 0)
-    {
-      /* can't read any more data */
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      if(rc < 0)
-        ftp_send_response(session, 451, "Failed to read file\r\n");
-      else
-        ftp_send_response(session, 226, "OK\r\n");
-      return LOOP_EXIT;
-    }
-
-    /* we read some data so reset the session buffer to send */
-    session->bufferpos  = 0;
-    session->buffersize = rc;
+    ftp_send_response(session, 225, "No transfer to abort\r\n");
+    return;
   }
 
-  /* send any pending data */
-  rc = send(session->data_fd, session->buffer + session->bufferpos,
-            session->buffersize - session->bufferpos, 0);
-  if(rc <= 0)
-  {
-    /* error sending data */
-    if(rc < 0)
-    {
-      if(errno == EWOULDBLOCK)
-        return LOOP_EXIT;
-      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
-    }
-    else
-      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+  /* abort the transfer */
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
 
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
-    return LOOP_EXIT;
+  /* send response for this request */
+  ftp_send_response(session, 225, "Aborted\r\n");
+
+  /* send response for transfer */
+  ftp_send_response(session, 425, "Transfer aborted\r\n");
+}
+
+/*! @fn static void ALLO(ftp_session_t *session, const char *args)
+ *
+ *  @brief allocate space
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(ALLO)
+{
+  const char *p = args;
+  uint64_t   size, record;
+
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  /* we are already in COMMAND_STATE; don't reset a preceding REST */
+
+  /* parse the size and an optional record size */
+  if(parse_offset(&p, &size) != 0
+  || (strncasecmp(p, " R ", 3) == 0 && (p += 3, parse_offset(&p, &record) != 0))
+  || *p != 0)
+  {
+    ftp_send_response(session, 501, "invalid argument\r\n");
+    return;
   }
 
-  /* we can try to send more data */
-  session->bufferpos += rc;
-  return LOOP_CONTINUE;
+#ifdef __linux__
+  /* remember the size for the next STOR/APPE */
+  session->allocsize = size;
+  ftp_send_response(session, 200, "OK\r\n");
+#else
+  ftp_send_response(session, 202, "superfluous command\r\n");
+#endif
 }
 
-/*! send a file to the client
+/*! @fn static void APPE(ftp_session_t *session, const char *args)
+ *
+ *  @brief append data to a file
+ *
+ *  @note requires a PASV or PORT connection
  *
  *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(APPE)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  /* open the file in append mode */
+  ftp_xfer_file(session, args, XFER_FILE_APPE);
+}
+
+/*! @fn static void CDUP(ftp_session_t *session, const char *args)
  *
- *  @returns whether to call again
+ *  @brief CWD to parent directory
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
  */
-static loop_status_t
-store_transfer(ftp_session_t *session)
+FTP_DECLARE(CDUP)
 {
-  ssize_t rc;
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  if(session->bufferpos == session->buffersize)
-  {
-    /* we have written all the received data, so try to get some more */
-    rc = recv(session->data_fd, session->buffer, sizeof(session->buffer), 0);
-    if(rc <= 0)
-    {
-      /* can't read any more data */
-      if(rc < 0)
-      {
-        if(errno == EWOULDBLOCK)
-          return LOOP_EXIT;
-        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-      }
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  /* change to parent directory */
+  cd_up(session);
 
-      if(rc == 0)
-        ftp_send_response(session, 226, "OK\r\n");
-      else
-        ftp_send_response(session, 426, "Connection broken during transfer\r\n");
-      return LOOP_EXIT;
-    }
+  ftp_send_response(session, 200, "OK\r\n");
+}
 
-    /* we received some data so reset the session buffer to write */
-    session->bufferpos  = 0;
-    session->buffersize = rc;
+/*! @fn static void CWD(ftp_session_t *session, const char *args)
+ *
+ *  @brief change working directory
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(CWD)
+{
+  struct stat st;
+  int         rc;
+
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* .. is equivalent to CDUP */
+  if(strcmp(args, "..") == 0)
+  {
+    cd_up(session);
+    ftp_send_response(session, 200, "OK\r\n");
+    return;
+  }
+
+  /* build the new cwd path */
+  if(build_path(session, session->cwd, args) != 0)
+  {
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    return;
+  }
+
+  /* get the path status */
+  rc = stat(session->buffer, &st);
+  if(rc != 0)
+  {
+    console_error(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_send_response(session, 550, "unavailable\r\n");
+    return;
   }
 
-  rc = ftp_session_write_file(session);
-  if(rc <= 0)
+  /* make sure it is a directory */
+  if(!S_ISDIR(st.st_mode))
   {
-    /* error writing data */
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 451, "Failed to write file\r\n");
-    return LOOP_EXIT;
+    ftp_send_response(session, 553, "not a directory\r\n");
+    return;
   }
 
-  /* we can try to receive more data */
-  session->bufferpos += rc;
-  return LOOP_CONTINUE;
+  /* copy the path into the cwd */
+  strncpy(session->cwd, session->buffer, sizeof(session->cwd));
+  session->cwd[sizeof(session->cwd)-1] = '\0';
+  ftp_send_response(session, 200, "OK\r\n");
 }
 
-/*! ftp_xfer_file mode */
-typedef enum
-{
-  XFER_FILE_RETR, /*!< Retrieve a file */
-  XFER_FILE_STOR, /*!< Store a file */
-  XFER_FILE_APPE, /*!< Append a file */
-} xfer_file_mode_t;
-
-/*! Transfer a file
+/*! @fn static void DELE(ftp_session_t *session, const char *args)
  *
- *  @param[in] session ftp session
- *  @param[in] args    ftp arguments
- *  @param[in] mode    transfer mode
+ *  @brief delete a file
  *
- *  @returns failure
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
  */
-static void
-ftp_xfer_file(ftp_session_t    *session,
-              const char       *args,
-              xfer_file_mode_t mode)
+FTP_DECLARE(DELE)
 {
   int rc;
 
-  /* build the path of the file to transfer */
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* build the file path */
   if(build_path(session, session->cwd, args) != 0)
   {
-    rc = errno;
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 553, "%s\r\n", strerror(rc));
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
     return;
   }
 
-  /* open the file for retrieving or storing */
-  if(mode == XFER_FILE_RETR)
-    rc = ftp_session_open_file_read(session);
-  else
-    rc = ftp_session_open_file_write(session, mode == XFER_FILE_APPE);
+  /* forget cached metadata of the path */
+  ftp_file_invalidate(session->buffer);
 
+  /* try to unlink the path */
+  rc = unlink(session->buffer);
   if(rc != 0)
   {
-    /* error opening the file */
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 450, "failed to open file\r\n");
+    /* error unlinking the file */
+    console_error(RED "unlink: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 550, "failed to delete file\r\n");
     return;
   }
 
-  if(session->flags & (SESSION_PORT|SESSION_PASV))
-  {
-    ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
-
-    if(session->flags & SESSION_PORT)
-    {
-      /* setup connection */
-      rc = ftp_session_connect(session);
-      if(rc != 0)
-      {
-        /* error connecting */
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 425, "can't open data connection\r\n");
-        return;
-      }
-    }
-
-    /* set up the transfer */
-    session->flags &= ~(SESSION_RECV|SESSION_SEND);
-    if(mode == XFER_FILE_RETR)
-    {
-      session->flags   |= SESSION_SEND;
-      session->transfer = retrieve_transfer;
-    }
-    else
-    {
-      session->flags   |= SESSION_RECV;
-      session->transfer = store_transfer;
-    }
+  update_free_space();
+  ftp_send_response(session, 250, "OK\r\n");
+}
 
-    session->bufferpos  = 0;
-    session->buffersize = 0;
+/*! @fn static void FEAT(ftp_session_t *session, const char *args)
+ *
+ *  @brief list server features
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(FEAT)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-    return;
-  }
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-  ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+  /* list our features */
+  ftp_send_response(session, -211, "\r\n"
+    " HASH %s%s;%s%s;%s%s;%s%s\r\n"
+    " MDTM\r\n"
+    " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;%s\r\n"
+    " PASV\r\n"
+    " RANG STREAM\r\n"
+    " REST STREAM\r\n"
+    " SIZE\r\n"
+    " TVFS\r\n"
+    " UTF8\r\n"
+    " XCRC \"filename\" SP EP\r\n"
+    " XMD5 \"filename\" SP EP\r\n"
+    " XSHA1 \"filename\" SP EP\r\n"
+    " XSHA256 \"filename\" SP EP\r\n"
+    "\r\n"
+    "211 End\r\n",
+    hash_name(HASH_CRC32),  session->hash_algo == HASH_CRC32  ? "*" : "",
+    hash_name(HASH_MD5),    session->hash_algo == HASH_MD5    ? "*" : "",
+    hash_name(HASH_SHA1),   session->hash_algo == HASH_SHA1   ? "*" : "",
+    hash_name(HASH_SHA256), session->hash_algo == HASH_SHA256 ? "*" : "",
+    session->mlst_flags & SESSION_MLST_TYPE      ? "*" : "",
+    session->mlst_flags & SESSION_MLST_SIZE      ? "*" : "",
+    session->mlst_flags & SESSION_MLST_MODIFY    ? "*" : "",
+    session->mlst_flags & SESSION_MLST_PERM      ? "*" : "",
+    session->mlst_flags & SESSION_MLST_UNIX_MODE ? "*" : "",
+    !STORE_HASH                                  ? ""         :
+    session->mlst_flags & SESSION_MLST_HASH      ? "X.hash*;" : "X.hash;");
 }
 
-/*! Transfer a directory
+/*! @fn static void HASH(ftp_session_t *session, const char *args)
  *
- *  @param[in] session    ftp session
- *  @param[in] args       ftp arguments
- *  @param[in] mode       transfer mode
- *  @param[in] workaround whether to workaround LIST -a
+ *  @brief hash a file
+ *
+ *  @note Uses the algorithm selected by OPTS HASH and the range set by RANG
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
  */
-static void
-ftp_xfer_dir(ftp_session_t   *session,
-             const char      *args,
-             xfer_dir_mode_t mode,
-             bool            workaround)
+FTP_DECLARE(HASH)
 {
-  ssize_t     rc;
-  size_t      len;
-  struct stat st;
-  char        *buffer;
-
-  /* set up the transfer */
-  session->dir_mode = mode;
-  session->flags &= ~SESSION_RECV;
-  session->flags |= SESSION_SEND;
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  session->transfer   = list_transfer;
-  session->buffersize = 0;
-  session->bufferpos  = 0;
+  session->flags &= ~SESSION_XHASH;
 
-  if(strlen(args) > 0)
-  {
-    /* an argument was provided */
-    if(build_path(session, session->cwd, args) != 0)
-    {
-      /* error building path */
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 550, "%s\r\n", strerror(errno));
-      return;
-    }
+  /* hash the file in the background */
+  ftp_xfer_hash(session, args, session->hash_algo);
+}
 
-    /* check if this is a directory */
-    session->dp = opendir(session->buffer);
-    if(session->dp == NULL)
-    {
-      /* not a directory; check if it is a file */
-      rc = stat(session->buffer, &st);
-      if(rc != 0)
-      {
-        /* error getting stat */
-        rc = errno;
+/*! @fn static void HELP(ftp_session_t *session, const char *args)
+ *
+ *  @brief print server help
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(HELP)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-        /* work around broken clients that think LIST -a is valid */
-        if(workaround && mode == XFER_DIR_LIST)
-        {
-          if(args[0] == '-' && (args[1] == 'a' || args[1] == 'l'))
-          {
-            if(args[2] == 0)
-              buffer = strdup(args+2);
-            else
-              buffer = strdup(args+3);
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-            if(buffer != NULL)
-            {
-              ftp_xfer_dir(session, buffer, mode, false);
-              free(buffer);
-              return;
-            }
+  /* list our accepted commands */
+  ftp_send_response(session, -214,
+      "The following commands are recognized\r\n"
+      " ABOR ALLO APPE CDUP CWD DELE FEAT HASH HELP LIST MDTM MKD MLSD MLST\r\n"
+      " MODE NLST NOOP OPTS PASS PASV PORT PWD QUIT RANG REST RETR RMD RNFR\r\n"
+      " RNTO SITE STAT STOR STOU STRU SYST TYPE USER XCRC XCUP XCWD XMD5 XMKD\r\n"
+      " XPWD XRMD XSHA1 XSHA256\r\n"
+      "214 End\r\n");
+}
 
-            rc = ENOMEM;
-          }
-        }
+/*! @fn static void LIST(ftp_session_t *session, const char *args)
+ *
+ *  @brief retrieve a directory listing
+ *
+ *  @note Requires a PORT or PASV connection
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(LIST)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
-        return;
-      }
-      else if(mode == XFER_DIR_MLSD)
-      {
-        /* specified file instead of directory for MLSD */
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
-        return;
-      }
-      else if(mode == XFER_DIR_NLST)
-      {
-        /* NLST uses full path name */
-        len = session->buffersize;
-        buffer = encode_path(session->buffer, &len, false);
-      }
-      else
-      {
-        /* everything else uses base name */
-        const char *base = strrchr(session->buffer, '/') + 1;
+  /* open the path in LIST mode */
+  ftp_xfer_dir(session, args, XFER_DIR_LIST, true);
+}
 
-        len = strlen(base);
-        buffer = encode_path(base, &len, false);
-      }
+/*! @fn static void MDTM(ftp_session_t *session, const char *args)
+ *
+ *  @brief get last modification time
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(MDTM)
+{
+  int         rc;
+#ifdef _3DS
+  uint64_t    mtime;
+#else
+  struct stat st;
+#endif
+  time_t      t_mtime;
+  struct tm   *tm;
 
-      if(buffer)
-      {
-        rc = ftp_session_fill_dirent(session, &st, buffer, len);
-        free(buffer);
-      }
-      else
-        rc = ENOMEM;
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-      if(rc != 0)
-      {
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
-        return;
-      }
-    }
-    else
-    {
-      /* it was a directory, so set it as the lwd */
-      memcpy(session->lwd, session->buffer, session->buffersize);
-      session->lwd[session->buffersize] = 0;
-      session->buffersize = 0;
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-      if(session->dir_mode == XFER_DIR_MLSD
-      && (session->mlst_flags & SESSION_MLST_TYPE))
-      {
-        /* send this directory as type=cdir */
-        rc = ftp_session_fill_dirent_cdir(session, session->lwd);
-        if(rc != 0)
-        {
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 550, "%s\r\n", strerror(rc));
-          return;
-        }
-      }
-    }
+  /* build the path */
+  if(build_path(session, session->cwd, args) != 0)
+  {
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    return;
   }
-  else if(ftp_session_open_cwd(session) != 0)
+
+#ifdef _3DS
+  rc = sdmc_getmtime(session->buffer, &mtime);
+  if(rc != 0)
   {
-    /* no argument, but opening cwd failed */
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    ftp_send_response(session, 550, "Error getting mtime\r\n");
     return;
   }
-  else
+  t_mtime = mtime;
+#else
+  rc = ftp_file_stat(session->buffer, &st, true);
+  if(rc != 0)
   {
-    /* set the cwd as the lwd */
-    strcpy(session->lwd, session->cwd);
-    session->buffersize = 0;
-
-    if(session->dir_mode == XFER_DIR_MLSD
-    && (session->mlst_flags & SESSION_MLST_TYPE))
-    {
-      /* send this directory as type=cdir */
-      rc = ftp_session_fill_dirent_cdir(session, session->lwd);
-      if(rc != 0)
-      {
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
-        return;
-      }
-    }
+    ftp_send_response(session, 550, "Error getting mtime\r\n");
+    return;
   }
+  t_mtime = st.st_mtime;
+#endif
 
-  if(mode == XFER_DIR_MLST || mode == XFER_DIR_STAT)
+  tm = gmtime(&t_mtime);
+  if(tm == NULL)
   {
-    /* this is a little different; we have to send the data over the command socket */
-    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV | CLOSE_DATA);
-    session->data_fd = session->cmd_fd;
-    session->flags  |= SESSION_SEND;
-    ftp_send_response(session, -213, "Status\r\n");
+    ftp_send_response(session, 550, "Error getting mtime\r\n");
     return;
   }
-  else if(session->flags & (SESSION_PORT|SESSION_PASV))
+
+  session->buffersize = strftime(session->buffer, sizeof(session->buffer), "%Y%m%d%H%M%S", tm);
+  if(session->buffersize == 0)
   {
-    ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
+    ftp_send_response(session, 550, "Error getting mtime\r\n");
+    return;
+  }
 
-    if(session->flags & SESSION_PORT)
-    {
-      /* setup connection */
-      rc = ftp_session_connect(session);
-      if(rc != 0)
-      {
-        /* error connecting */
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 425, "can't open data connection\r\n");
-      }
-    }
+  session->buffer[session->buffersize] = 0;
+
+  ftp_send_response(session, 213, "%s\r\n", session->buffer);
+}
+/*! @fn static void MKD(ftp_session_t *session, const char *args)
+ *
+ *  @brief create a directory
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(MKD)
+{
+  int rc;
 
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* build the path */
+  if(build_path(session, session->cwd, args) != 0)
+  {
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
     return;
   }
 
-  /* we must have got LIST/MLSD/MLST/NLST without a preceding PORT or PASV */
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-  ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+  /* try to create the directory */
+  rc = mkdir(session->buffer, 0755);
+  if(rc != 0 && errno != EEXIST)
+  {
+    /* mkdir failure */
+    console_error(RED "mkdir: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 550, "failed to create directory\r\n");
+    return;
+  }
+
+  update_free_space();
+  ftp_send_response(session, 250, "OK\r\n");
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- *                                                                           *
- *                          F T P   C O M M A N D S                          *
- *                                                                           *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/*! @fn static void MLSD(ftp_session_t *session, const char *args)
+ *
+ *  @brief set transfer mode
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(MLSD)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-/*! @fn static void ABOR(ftp_session_t *session, const char *args)
+  /* open the path in MLSD mode */
+  ftp_xfer_dir(session, args, XFER_DIR_MLSD, true);
+}
+
+/*! @fn static void MLST(ftp_session_t *session, const char *args)
  *
- *  @brief abort a transfer
+ *  @brief set transfer mode
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(ABOR)
+FTP_DECLARE(MLST)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  struct stat st;
+  int         rc;
+  char        *path;
+  size_t      len;
 
-  if(session->state == COMMAND_STATE)
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* build the path */
+  if(build_path(session, session->cwd, args) != 0)
   {
-    ftp_send_response(session, 225, "No transfer to abort\r\n");
+    ftp_send_response(session, 501, "%s\r\n", strerror(errno));
     return;
   }
 
-  /* abort the transfer */
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  /* stat path */
+  rc = ftp_file_stat(session->buffer, &st, false);
+  if(rc != 0)
+  {
+    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    return;
+  }
 
-  /* send response for this request */
-  ftp_send_response(session, 225, "Aborted\r\n");
+  /* encode \n in path */
+  len = session->buffersize;
+  path = encode_path(session->buffer, &len, true);
+  if(!path)
+  {
+    ftp_send_response(session, 550, "%s\r\n", strerror(ENOMEM));
+    return;
+  }
 
-  /* send response for transfer */
-  ftp_send_response(session, 425, "Transfer aborted\r\n");
+  session->dir_mode = XFER_DIR_MLST;
+  rc = ftp_session_fill_dirent(session, &st, path, len);
+  free(path);
+  if(rc != 0)
+  {
+    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    return;
+  }
+
+  path = malloc(session->buffersize + 1);
+  if(!path)
+  {
+    ftp_send_response(session, 550, "%s\r\n", strerror(ENOMEM));
+    return;
+  }
+
+  memcpy(path, session->buffer, session->buffersize);
+  path[session->buffersize] = 0;
+  ftp_send_response(session, -250, "Status\r\n%s250 End\r\n", path);
+  free(path);
 }
 
-/*! @fn static void ALLO(ftp_session_t *session, const char *args)
+/*! @fn static void MODE(ftp_session_t *session, const char *args)
  *
- *  @brief allocate space
+ *  @brief set transfer mode
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(ALLO)
+FTP_DECLARE(MODE)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  ftp_send_response(session, 202, "superfluous command\r\n");
+  /* we only accept S (stream) mode */
+  if(strcasecmp(args, "S") == 0)
+  {
+    ftp_send_response(session, 200, "OK\r\n");
+    return;
+  }
+
+  ftp_send_response(session, 504, "unavailable\r\n");
 }
 
-/*! @fn static void APPE(ftp_session_t *session, const char *args)
+/*! @fn static void NLST(ftp_session_t *session, const char *args)
  *
- *  @brief append data to a file
+ *  @brief retrieve a name list
  *
- *  @note requires a PASV or PORT connection
+ *  @note Requires a PASV or PORT connection
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(APPE)
+FTP_DECLARE(NLST)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* open the file in append mode */
-  ftp_xfer_file(session, args, XFER_FILE_APPE);
+  /* open the path in NLST mode */
+  return ftp_xfer_dir(session, args, XFER_DIR_NLST, false);
 }
 
-/*! @fn static void CDUP(ftp_session_t *session, const char *args)
+/*! @fn static void NOOP(ftp_session_t *session, const char *args)
  *
- *  @brief CWD to parent directory
+ *  @brief no-op
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(CDUP)
+FTP_DECLARE(NOOP)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  ftp_session_set_state(session, COMMAND_STATE, 0);
-
-  /* change to parent directory */
-  cd_up(session);
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
+  /* this is a no-op */
   ftp_send_response(session, 200, "OK\r\n");
 }
 
-/*! @fn static void CWD(ftp_session_t *session, const char *args)
+/*! @fn static void OPTS(ftp_session_t *session, const char *args)
  *
- *  @brief change working directory
+ *  @brief set options
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(CWD)
+FTP_DECLARE(OPTS)
 {
-  struct stat st;
-  int         rc;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* .. is equivalent to CDUP */
-  if(strcmp(args, "..") == 0)
+  /* we accept the following UTF8 options */
+  if(strcasecmp(args, "UTF8") == 0
+  || strcasecmp(args, "UTF8 ON") == 0
+  || strcasecmp(args, "UTF8 NLST") == 0)
   {
-    cd_up(session);
     ftp_send_response(session, 200, "OK\r\n");
     return;
   }
 
-  /* build the new cwd path */
-  if(build_path(session, session->cwd, args) != 0)
+  /* check HASH options */
+  if(strcasecmp(args, "HASH") == 0)
   {
-    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    ftp_send_response(session, 200, "%s\r\n", hash_name(session->hash_algo));
     return;
   }
-
-  /* get the path status */
-  rc = stat(session->buffer, &st);
-  if(rc != 0)
+  if(strncasecmp(args, "HASH ", 5) == 0)
   {
-    console_print(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    ftp_send_response(session, 550, "unavailable\r\n");
-    return;
-  }
+    hash_algo_t algo;
 
-  /* make sure it is a directory */
-  if(!S_ISDIR(st.st_mode))
-  {
-    ftp_send_response(session, 553, "not a directory\r\n");
+    if(hash_lookup(args + 5, &algo) != 0)
+    {
+      ftp_send_response(session, 501, "unknown algorithm\r\n");
+      return;
+    }
+
+    session->hash_algo = algo;
+    ftp_send_response(session, 200, "%s\r\n", hash_name(algo));
     return;
   }
 
-  /* copy the path into the cwd */
-  strncpy(session->cwd, session->buffer, sizeof(session->cwd));
-  session->cwd[sizeof(session->cwd)-1] = '\0';
-  ftp_send_response(session, 200, "OK\r\n");
-}
-
-/*! @fn static void DELE(ftp_session_t *session, const char *args)
- *
- *  @brief delete a file
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(DELE)
-{
-  int rc;
+  /* check MLST options */
+  if(strncasecmp(args, "MLST ", 5) == 0)
+  {
+    static const struct
+    {
+      const char           *name;
+      session_mlst_flags_t flag;
+    } mlst_flags[] =
+    {
+      { "Type;",      SESSION_MLST_TYPE,      },
+      { "Size;",      SESSION_MLST_SIZE,      },
+      { "Modify;",    SESSION_MLST_MODIFY,    },
+      { "Perm;",      SESSION_MLST_PERM,      },
+      { "UNIX.mode;", SESSION_MLST_UNIX_MODE, },
+      { "X.hash;",    SESSION_MLST_HASH,      },
+    };
+    static const size_t num_mlst_flags = sizeof(mlst_flags)/sizeof(mlst_flags[0]);
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+    session_mlst_flags_t flags = 0;
+    args += 5;
+    const char *p = args;
+    while(*p)
+    {
+      for(size_t i = 0; i < num_mlst_flags; ++i)
+      {
+        if(strncasecmp(mlst_flags[i].name, p, strlen(mlst_flags[i].name)) == 0)
+        {
+          flags |= mlst_flags[i].flag;
+          p += strlen(mlst_flags[i].name)-1;
+          break;
+        }
+      }
 
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+      while(*p && *p != ';')
+        ++p;
 
-  /* build the file path */
-  if(build_path(session, session->cwd, args) != 0)
-  {
-    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
-    return;
-  }
+      if(*p == ';')
+        ++p;
+    }
 
-  /* try to unlink the path */
-  rc = unlink(session->buffer);
-  if(rc != 0)
-  {
-    /* error unlinking the file */
-    console_print(RED "unlink: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 550, "failed to delete file\r\n");
+    session->mlst_flags = flags;
+    ftp_send_response(session, 200, "MLST OPTS%s%s%s%s%s%s%s\r\n",
+                      flags ? " " : "",
+                      flags & SESSION_MLST_TYPE      ? "Type;"      : "",
+                      flags & SESSION_MLST_SIZE      ? "Size;"      : "",
+                      flags & SESSION_MLST_MODIFY    ? "Modify;"    : "",
+                      flags & SESSION_MLST_PERM      ? "Perm;"      : "",
+                      flags & SESSION_MLST_UNIX_MODE ? "UNIX.mode;" : "",
+                      flags & SESSION_MLST_HASH      ? "X.hash;"    : "");
     return;
   }
 
-  update_free_space();
-  ftp_send_response(session, 250, "OK\r\n");
+  ftp_send_response(session, 504, "invalid argument\r\n");
 }
 
-/*! @fn static void FEAT(ftp_session_t *session, const char *args)
+/*! @fn static void PASS(ftp_session_t *session, const char *args)
  *
- *  @brief list server features
+ *  @brief provide password
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(FEAT)
+FTP_DECLARE(PASS)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
+  /* we accept any password */
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* list our features */
-  ftp_send_response(session, -211, "\r\n"
-    " MDTM\r\n"
-    " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;\r\n"
-    " PASV\r\n"
-    " SIZE\r\n"
-    " TVFS\r\n"
-    " UTF8\r\n"
-    "\r\n"
-    "211 End\r\n",
-    session->mlst_flags & SESSION_MLST_TYPE      ? "*" : "",
-    session->mlst_flags & SESSION_MLST_SIZE      ? "*" : "",
-    session->mlst_flags & SESSION_MLST_MODIFY    ? "*" : "",
-    session->mlst_flags & SESSION_MLST_PERM      ? "*" : "",
-    session->mlst_flags & SESSION_MLST_UNIX_MODE ? "*" : "");
+  ftp_send_response(session, 230, "OK\r\n");
 }
 
-/*! @fn static void HELP(ftp_session_t *session, const char *args)
+/*! @fn static void PASV(ftp_session_t *session, const char *args)
  *
- *  @brief print server help
+ *  @brief request an address to connect to
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(HELP)
+FTP_DECLARE(PASV)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  int       rc;
+  char      buffer[INET_ADDRSTRLEN + 10];
+  char      *p;
+  in_port_t port;
+  uint64_t  filepos, rangeend;
 
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* list our accepted commands */
-  ftp_send_response(session, -214,
-      "The following commands are recognized\r\n"
-      " ABOR ALLO APPE CDUP CWD DELE FEAT HELP LIST MDTM MKD MLSD MLST MODE\r\n"
-      " NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO STAT\r\n"
-      " STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
-      "214 End\r\n");
-}
+  memset(buffer, 0, sizeof(buffer));
 
-/*! @fn static void LIST(ftp_session_t *session, const char *args)
- *
- *  @brief retrieve a directory listing
- *
- *  @note Requires a PORT or PASV connection
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(LIST)
-{
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  /* reset the state, but keep a preceding REST/RANG */
+  filepos  = session->filepos;
+  rangeend = session->rangeend;
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  session->flags &= ~(SESSION_PASV|SESSION_PORT);
+  session->filepos  = filepos;
+  session->rangeend = rangeend;
 
-  /* open the path in LIST mode */
-  ftp_xfer_dir(session, args, XFER_DIR_LIST, true);
+  /* create a socket to listen on */
+  session->pasv_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(session->pasv_fd < 0)
+  {
+    console_error(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 451, "\r\n");
+    return;
+  }
+
+  /* set the socket options */
+  rc = ftp_set_socket_options(session->pasv_fd);
+  if(rc != 0)
+  {
+    /* failed to set socket options */
+    ftp_session_close_pasv(session);
+    ftp_send_response(session, 451, "\r\n");
+    return;
+  }
+
+  /* grab a new port */
+  session->pasv_addr.sin_port = htons(next_data_port());
+
+#if defined(_3DS) || defined(__SWITCH__)
+  console_warn(YELLOW "binding to %s:%u\n" RESET,
+               inet_ntoa(session->pasv_addr.sin_addr),
+               ntohs(session->pasv_addr.sin_port));
+#endif
+
+  /* bind to the port */
+  rc = bind(session->pasv_fd, (struct sockaddr*)&session->pasv_addr,
+            sizeof(session->pasv_addr));
+  if(rc != 0)
+  {
+    /* failed to bind */
+    console_error(RED "bind: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_pasv(session);
+    ftp_send_response(session, 451, "\r\n");
+    return;
+  }
+
+  /* listen on the socket */
+  rc = listen(session->pasv_fd, 1);
+  if(rc != 0)
+  {
+    /* failed to listen */
+    console_error(RED "listen: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_pasv(session);
+    ftp_send_response(session, 451, "\r\n");
+    return;
+  }
+
+#ifndef _3DS
+  {
+    /* get the socket address since we requested an ephemeral port */
+    socklen_t addrlen = sizeof(session->pasv_addr);
+    rc = getsockname(session->pasv_fd, (struct sockaddr*)&session->pasv_addr,
+                     &addrlen);
+    if(rc != 0)
+    {
+      /* failed to get socket address */
+      console_error(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_close_pasv(session);
+      ftp_send_response(session, 451, "\r\n");
+      return;
+    }
+  }
+#endif
+
+  /* we are now listening on the socket */
+  console_warn(YELLOW "listening on %s:%u\n" RESET,
+               inet_ntoa(session->pasv_addr.sin_addr),
+               ntohs(session->pasv_addr.sin_port));
+  session->flags |= SESSION_PASV;
+
+  /* print the address in the ftp format */
+  port = ntohs(session->pasv_addr.sin_port);
+  strcpy(buffer, inet_ntoa(session->pasv_addr.sin_addr));
+  sprintf(buffer+strlen(buffer), ",%u,%u",
+          port >> 8, port & 0xFF);
+  for(p = buffer; *p; ++p)
+  {
+    if(*p == '.')
+      *p = ',';
+  }
+
+  ftp_send_response(session, 227, "%s\r\n", buffer);
 }
 
-/*! @fn static void MDTM(ftp_session_t *session, const char *args)
+/*! @fn static void PORT(ftp_session_t *session, const char *args)
  *
- *  @brief get last modification time
+ *  @brief provide an address for the server to connect to
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(MDTM)
+FTP_DECLARE(PORT)
 {
-  int         rc;
-#ifdef _3DS
-  uint64_t    mtime;
-#else
-  struct stat st;
-#endif
-  time_t      t_mtime;
-  struct tm   *tm;
+  char               *addrstr, *p, *portstr;
+  int                commas = 0, rc;
+  short              port = 0;
+  unsigned long      val;
+  struct sockaddr_in addr;
+  uint64_t           filepos, rangeend;
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+  /* reset the state, but keep a preceding REST/RANG */
+  filepos  = session->filepos;
+  rangeend = session->rangeend;
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  session->flags &= ~(SESSION_PASV|SESSION_PORT);
+  session->filepos  = filepos;
+  session->rangeend = rangeend;
 
-  /* build the path */
-  if(build_path(session, session->cwd, args) != 0)
+  /* dup the args since they are const and we need to change it */
+  addrstr = strdup(args);
+  if(addrstr == NULL)
   {
-    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    ftp_send_response(session, 425, "%s\r\n", strerror(ENOMEM));
     return;
   }
 
-#ifdef _3DS
-  rc = sdmc_getmtime(session->buffer, &mtime);
-  if(rc != 0)
+  /* replace a,b,c,d,e,f with a.b.c.d\0e.f */
+  for(p = addrstr; *p; ++p)
   {
-    ftp_send_response(session, 550, "Error getting mtime\r\n");
-    return;
+    if(*p == ',')
+    {
+      if(commas != 3)
+        *p = '.';
+      else
+      {
+        *p = 0;
+        portstr = p+1;
+      }
+      ++commas;
+    }
   }
-  t_mtime = mtime;
-#else
-  rc = stat(session->buffer, &st);
-  if(rc != 0)
+
+  /* make sure we got the right number of values */
+  if(commas != 5)
   {
-    ftp_send_response(session, 550, "Error getting mtime\r\n");
+    free(addrstr);
+    ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
     return;
   }
-  t_mtime = st.st_mtime;
-#endif
 
-  tm = gmtime(&t_mtime);
-  if(tm == NULL)
+  /* parse the address */
+  rc = inet_aton(addrstr, &addr.sin_addr);
+  if(rc == 0)
   {
-    ftp_send_response(session, 550, "Error getting mtime\r\n");
+    free(addrstr);
+    ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
     return;
   }
 
-  session->buffersize = strftime(session->buffer, sizeof(session->buffer), "%Y%m%d%H%M%S", tm);
-  if(session->buffersize == 0)
+  /* parse the port */
+  val  = 0;
+  port = 0;
+  for(p = portstr; *p; ++p)
   {
-    ftp_send_response(session, 550, "Error getting mtime\r\n");
+    if(!isdigit((int)*p))
+    {
+      if(p == portstr || *p != '.' || val > 0xFF)
+      {
+        free(addrstr);
+        ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
+        return;
+      }
+      port <<= 8;
+      port  += val;
+      val    = 0;
+    }
+    else
+    {
+      val *= 10;
+      val += *p - '0';
+    }
+  }
+
+  /* validate the port */
+  if(val > 0xFF || port > 0xFF)
+  {
+    free(addrstr);
+    ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
     return;
   }
+  port <<= 8;
+  port  += val;
 
-  session->buffer[session->buffersize] = 0;
+  /* fill in the address port and family */
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons(port);
 
-  ftp_send_response(session, 213, "%s\r\n", session->buffer);
+  free(addrstr);
+
+  memcpy(&session->peer_addr, &addr, sizeof(addr));
+
+  /* we are ready to connect to the client */
+  session->flags |= SESSION_PORT;
+  ftp_send_response(session, 200, "OK\r\n");
 }
-/*! @fn static void MKD(ftp_session_t *session, const char *args)
+
+/*! @fn static void PWD(ftp_session_t *session, const char *args)
  *
- *  @brief create a directory
+ *  @brief print working directory
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(MKD)
+FTP_DECLARE(PWD)
 {
-  int rc;
+  static char buffer[CMD_BUFFERSIZE];
+  size_t      len = sizeof(buffer), i;
+  char        *path;
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* build the path */
-  if(build_path(session, session->cwd, args) != 0)
+  /* encode the cwd */
+  len = strlen(session->cwd);
+  path = encode_path(session->cwd, &len, true);
+  if(path != NULL)
   {
-    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
-    return;
-  }
+    i = sprintf(buffer, "257 \"");
+    if(i + len + 3 > sizeof(buffer))
+    {
+      /* buffer will overflow */
+      free(path);
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 550, "unavailable\r\n");
+      ftp_send_response(session, 425, "%s\r\n", strerror(EOVERFLOW));
+      return;
+    }
+    memcpy(buffer+i, path, len);
+    free(path);
+    len += i;
+    buffer[len++] = '"';
+    buffer[len++] = '\r';
+    buffer[len++] = '\n';
 
-  /* try to create the directory */
-  rc = mkdir(session->buffer, 0755);
-  if(rc != 0 && errno != EEXIST)
-  {
-    /* mkdir failure */
-    console_print(RED "mkdir: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 550, "failed to create directory\r\n");
+    ftp_send_response_buffer(session, buffer, len);
     return;
   }
 
-  update_free_space();
-  ftp_send_response(session, 250, "OK\r\n");
+  ftp_send_response(session, 425, "%s\r\n", strerror(ENOMEM));
 }
 
-/*! @fn static void MLSD(ftp_session_t *session, const char *args)
+/*! @fn static void QUIT(ftp_session_t *session, const char *args)
  *
- *  @brief set transfer mode
+ *  @brief terminate ftp session
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(MLSD)
+FTP_DECLARE(QUIT)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* open the path in MLSD mode */
-  ftp_xfer_dir(session, args, XFER_DIR_MLSD, true);
+  /* disconnect from the client */
+  ftp_send_response(session, 221, "disconnecting\r\n");
+  ftp_session_close_cmd(session);
 }
 
-/*! @fn static void MLST(ftp_session_t *session, const char *args)
+/*! @fn static void RANG(ftp_session_t *session, const char *args)
  *
- *  @brief set transfer mode
+ *  @brief set a byte range
+ *
+ *  @note sets start and inclusive end positions for a subsequent RETR or
+ *        HASH operation; "RANG 1 0" resets the range
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(MLST)
+FTP_DECLARE(RANG)
 {
-  struct stat st;
-  int         rc;
-  char        *path;
-  size_t      len;
+  const char *p = args;
+  uint64_t   start, end;
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* build the path */
-  if(build_path(session, session->cwd, args) != 0)
-  {
-    ftp_send_response(session, 501, "%s\r\n", strerror(errno));
-    return;
-  }
-
-  /* stat path */
-  rc = lstat(session->buffer, &st);
-  if(rc != 0)
-  {
-    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
-    return;
-  }
-
-  /* encode \n in path */
-  len = session->buffersize;
-  path = encode_path(session->buffer, &len, true);
-  if(!path)
+  /* parse the start and end points */
+  if(parse_offset(&p, &start) != 0 || *p++ != ' '
+  || parse_offset(&p, &end) != 0 || *p != 0)
   {
-    ftp_send_response(session, 550, "%s\r\n", strerror(ENOMEM));
+    ftp_send_response(session, 501, "invalid argument\r\n");
     return;
   }
 
-  session->dir_mode = XFER_DIR_MLST;
-  rc = ftp_session_fill_dirent(session, &st, path, len);
-  free(path);
-  if(rc != 0)
+  if(start == 1 && end == 0)
   {
-    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    /* reset the range */
+    ftp_send_response(session, 350, "Restarting at 0. End byte range at EOF\r\n");
     return;
   }
 
-  path = malloc(session->buffersize + 1);
-  if(!path)
+  if(end < start || end == UINT64_MAX)
   {
-    ftp_send_response(session, 550, "%s\r\n", strerror(ENOMEM));
+    ftp_send_response(session, 501, "invalid byte range\r\n");
     return;
   }
 
-  memcpy(path, session->buffer, session->buffersize);
-  path[session->buffersize] = 0;
-  ftp_send_response(session, -250, "Status\r\n%s250 End\r\n", path);
-  free(path);
+  /* set the range */
+  session->filepos  = start;
+  session->rangeend = end + 1;
+  ftp_send_response(session, 350, "Restarting at %" PRIu64 ". End byte range at %" PRIu64 "\r\n",
+                    start, end);
 }
 
-/*! @fn static void MODE(ftp_session_t *session, const char *args)
+/*! @fn static void REST(ftp_session_t *session, const char *args)
  *
- *  @brief set transfer mode
+ *  @brief restart a transfer
+ *
+ *  @note sets file position for a subsequent STOR operation
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(MODE)
+FTP_DECLARE(REST)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  const char *p;
+  uint64_t   pos = 0;
+
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* we only accept S (stream) mode */
-  if(strcasecmp(args, "S") == 0)
+  /* make sure an argument is provided */
+  if(args == NULL)
   {
-    ftp_send_response(session, 200, "OK\r\n");
+    ftp_send_response(session, 504, "invalid argument\r\n");
     return;
   }
 
-  ftp_send_response(session, 504, "unavailable\r\n");
-}
+  /* parse the offset */
+  for(p = args; *p; ++p)
+  {
+    if(!isdigit((int)*p))
+    {
+      ftp_send_response(session, 504, "invalid argument\r\n");
+      return;
+    }
 
-/*! @fn static void NLST(ftp_session_t *session, const char *args)
- *
- *  @brief retrieve a name list
- *
- *  @note Requires a PASV or PORT connection
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(NLST)
-{
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+    if(UINT64_MAX / 10 < pos)
+    {
+      ftp_send_response(session, 504, "invalid argument\r\n");
+      return;
+    }
 
-  /* open the path in NLST mode */
-  return ftp_xfer_dir(session, args, XFER_DIR_NLST, false);
+    pos *= 10;
+
+    if(UINT64_MAX - (*p - '0') < pos)
+    {
+      ftp_send_response(session, 504, "invalid argument\r\n");
+      return;
+    }
+
+    pos += (*p - '0');
+  }
+
+  /* set the restart offset */
+  session->filepos = pos;
+  ftp_send_response(session, 200, "OK\r\n");
 }
 
-/*! @fn static void NOOP(ftp_session_t *session, const char *args)
+/*! @fn static void RETR(ftp_session_t *session, const char *args)
  *
- *  @brief no-op
+ *  @brief retrieve a file
+ *
+ *  @note Requires a PASV or PORT connection
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(NOOP)
+FTP_DECLARE(RETR)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* this is a no-op */
-  ftp_send_response(session, 200, "OK\r\n");
+  /* open the file to retrieve */
+  return ftp_xfer_file(session, args, XFER_FILE_RETR);
 }
 
-/*! @fn static void OPTS(ftp_session_t *session, const char *args)
+/*! @fn static void RMD(ftp_session_t *session, const char *args)
  *
- *  @brief set options
+ *  @brief remove a directory
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(OPTS)
+FTP_DECLARE(RMD)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  int rc;
+
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* we accept the following UTF8 options */
-  if(strcasecmp(args, "UTF8") == 0
-  || strcasecmp(args, "UTF8 ON") == 0
-  || strcasecmp(args, "UTF8 NLST") == 0)
+  /* build the path to remove */
+  if(build_path(session, session->cwd, args) != 0)
   {
-    ftp_send_response(session, 200, "OK\r\n");
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
     return;
   }
 
-  /* check MLST options */
-  if(strncasecmp(args, "MLST ", 5) == 0)
-  {
-    static const struct
-    {
-      const char           *name;
-      session_mlst_flags_t flag;
-    } mlst_flags[] =
-    {
-      { "Type;",      SESSION_MLST_TYPE,      },
-      { "Size;",      SESSION_MLST_SIZE,      },
-      { "Modify;",    SESSION_MLST_MODIFY,    },
-      { "Perm;",      SESSION_MLST_PERM,      },
-      { "UNIX.mode;", SESSION_MLST_UNIX_MODE, },
-    };
-    static const size_t num_mlst_flags = sizeof(mlst_flags)/sizeof(mlst_flags[0]);
-
-    session_mlst_flags_t flags = 0;
-    args += 5;
-    const char *p = args;
-    while(*p)
-    {
-      for(size_t i = 0; i < num_mlst_flags; ++i)
-      {
-        if(strncasecmp(mlst_flags[i].name, p, strlen(mlst_flags[i].name)) == 0)
-        {
-          flags |= mlst_flags[i].flag;
-          p += strlen(mlst_flags[i].name)-1;
-          break;
-        }
-      }
-
-      while(*p && *p != ';')
-        ++p;
-
-      if(*p == ';')
-        ++p;
-    }
+  /* forget cached metadata of the path */
+  ftp_file_invalidate(session->buffer);
 
-    session->mlst_flags = flags;
-    ftp_send_response(session, 200, "MLST OPTS%s%s%s%s%s%s\r\n",
-                      flags ? " " : "",
-                      flags & SESSION_MLST_TYPE      ? "Type;"      : "",
-                      flags & SESSION_MLST_SIZE      ? "Size;"      : "",
-                      flags & SESSION_MLST_MODIFY    ? "Modify;"    : "",
-                      flags & SESSION_MLST_PERM      ? "Perm;"      : "",
-                      flags & SESSION_MLST_UNIX_MODE ? "UNIX.mode;" : "");
+  /* remove the directory */
+  rc = rmdir(session->buffer);
+  if(rc != 0)
+  {
+    /* rmdir error */
+    console_error(RED "rmdir: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 550, "failed to delete directory\r\n");
     return;
   }
 
-  ftp_send_response(session, 504, "invalid argument\r\n");
+  update_free_space();
+  ftp_send_response(session, 250, "OK\r\n");
 }
 
-/*! @fn static void PASS(ftp_session_t *session, const char *args)
+/*! @fn static void RNFR(ftp_session_t *session, const char *args)
  *
- *  @brief provide password
+ *  @brief rename from
+ *
+ *  @note Must be followed by RNTO
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(PASS)
+FTP_DECLARE(RNFR)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  int         rc;
+  struct stat st;
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* we accept any password */
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  ftp_send_response(session, 230, "OK\r\n");
+  /* build the path to rename from */
+  if(build_path(session, session->cwd, args) != 0)
+  {
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    return;
+  }
+
+  /* make sure the path exists */
+  rc = lstat(session->buffer, &st);
+  if(rc != 0)
+  {
+    /* error getting path status */
+    console_error(RED "lstat: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 450, "no such file or directory\r\n");
+    return;
+  }
+
+  /* we are ready for RNTO */
+  session->flags |= SESSION_RENAME;
+  ftp_send_response(session, 350, "OK\r\n");
 }
 
-/*! @fn static void PASV(ftp_session_t *session, const char *args)
+/*! @fn static void RNTO(ftp_session_t *session, const char *args)
  *
- *  @brief request an address to connect to
+ *  @brief rename to
+ *
+ *  @note Must be preceded by RNFR
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(PASV)
+FTP_DECLARE(RNTO)
 {
-  int       rc;
-  char      buffer[INET_ADDRSTRLEN + 10];
-  char      *p;
-  in_port_t port;
+  static char rnfr[XFER_BUFFERSIZE]; // rename-from buffer
+  int  rc;
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  memset(buffer, 0, sizeof(buffer));
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* reset the state */
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-  session->flags &= ~(SESSION_PASV|SESSION_PORT);
+  /* make sure the previous command was RNFR */
+  if(!(session->flags & SESSION_RENAME))
+  {
+    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+    return;
+  }
 
-  /* create a socket to listen on */
-  session->pasv_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(session->pasv_fd < 0)
+  /* clear the rename state */
+  session->flags &= ~SESSION_RENAME;
+
+  /* copy the RNFR path */
+  memcpy(rnfr, session->buffer, XFER_BUFFERSIZE);
+
+  /* build the path to rename to */
+  if(build_path(session, session->cwd, args) != 0)
   {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 451, "\r\n");
+    ftp_send_response(session, 554, "%s\r\n", strerror(errno));
     return;
   }
 
-  /* set the socket options */
-  rc = ftp_set_socket_options(session->pasv_fd);
+  /* forget cached metadata of both paths */
+  ftp_file_invalidate(rnfr);
+  ftp_file_invalidate(session->buffer);
+
+  /* rename the file */
+  rc = rename(rnfr, session->buffer);
   if(rc != 0)
   {
-    /* failed to set socket options */
-    ftp_session_close_pasv(session);
-    ftp_send_response(session, 451, "\r\n");
+    /* rename failure */
+    console_error(RED "rename: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 550, "failed to rename file/directory\r\n");
     return;
   }
 
-  /* grab a new port */
-  session->pasv_addr.sin_port = htons(next_data_port());
+  update_free_space();
+  ftp_send_response(session, 250, "OK\r\n");
+}
 
-#if defined(_3DS) || defined(__SWITCH__)
-  console_print(YELLOW "binding to %s:%u\n" RESET,
-                inet_ntoa(session->pasv_addr.sin_addr),
-                ntohs(session->pasv_addr.sin_port));
-#endif
+/*! @fn static void SITE(ftp_session_t *session, const char *args)
+ *
+ *  @brief run a site-specific command
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(SITE)
+{
+  char          name[16];
+  size_t        len;
+  ftp_command_t key, *command;
 
-  /* bind to the port */
-  rc = bind(session->pasv_fd, (struct sockaddr*)&session->pasv_addr,
-            sizeof(session->pasv_addr));
-  if(rc != 0)
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  /* split the site command from its arguments */
+  len = strcspn(args, " ");
+  if(len == 0 || len >= sizeof(name))
   {
-    /* failed to bind */
-    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_pasv(session);
-    ftp_send_response(session, 451, "\r\n");
+    ftp_send_response(session, 501, "invalid argument\r\n");
     return;
   }
+  memcpy(name, args, len);
+  name[len] = 0;
 
-  /* listen on the socket */
-  rc = listen(session->pasv_fd, 1);
-  if(rc != 0)
+  args += len;
+  while(*args == ' ')
+    ++args;
+
+  /* look up the site command */
+  key.name = name;
+  command = bsearch(&key, site_commands,
+                    num_site_commands, sizeof(ftp_command_t),
+                    ftp_command_cmp);
+
+  /* clear COPY flag for all site commands except CPTO */
+  if(command == NULL || strcasecmp(command->name, "CPTO") != 0)
+    session->flags &= ~SESSION_COPY;
+
+  if(command == NULL)
   {
-    /* failed to listen */
-    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_pasv(session);
-    ftp_send_response(session, 451, "\r\n");
+    ftp_send_response(session, 502, "Invalid SITE command\r\n");
     return;
   }
 
-#ifndef _3DS
+  command->handler(session, args);
+}
+
+/*! @fn static void SIZE(ftp_session_t *session, const char *args)
+ *
+ *  @brief get file size
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(SIZE)
+{
+  int         rc;
+  struct stat st;
+
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* build the path to stat */
+  if(build_path(session, session->cwd, args) != 0)
   {
-    /* get the socket address since we requested an ephemeral port */
-    socklen_t addrlen = sizeof(session->pasv_addr);
-    rc = getsockname(session->pasv_fd, (struct sockaddr*)&session->pasv_addr,
-                     &addrlen);
-    if(rc != 0)
-    {
-      /* failed to get socket address */
-      console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_close_pasv(session);
-      ftp_send_response(session, 451, "\r\n");
-      return;
-    }
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    return;
   }
-#endif
-
-  /* we are now listening on the socket */
-  console_print(YELLOW "listening on %s:%u\n" RESET,
-                inet_ntoa(session->pasv_addr.sin_addr),
-                ntohs(session->pasv_addr.sin_port));
-  session->flags |= SESSION_PASV;
 
-  /* print the address in the ftp format */
-  port = ntohs(session->pasv_addr.sin_port);
-  strcpy(buffer, inet_ntoa(session->pasv_addr.sin_addr));
-  sprintf(buffer+strlen(buffer), ",%u,%u",
-          port >> 8, port & 0xFF);
-  for(p = buffer; *p; ++p)
+  rc = ftp_file_stat(session->buffer, &st, true);
+  if(rc != 0 || !S_ISREG(st.st_mode))
   {
-    if(*p == '.')
-      *p = ',';
+    ftp_send_response(session, 550, "Could not get file size.\r\n");
+    return;
   }
 
-  ftp_send_response(session, 227, "%s\r\n", buffer);
+  ftp_send_response(session, 213, "%" PRIu64 "\r\n",
+                    (uint64_t)st.st_size);
 }
 
-/*! @fn static void PORT(ftp_session_t *session, const char *args)
+/*! @fn static void STAT(ftp_session_t *session, const char *args)
  *
- *  @brief provide an address for the server to connect to
+ *  @brief get status
+ *
+ *  @note If no argument is supplied, and a transfer is occurring, get the
+ *        current transfer status. If no argument is supplied, and no transfer
+ *        is occurring, get the server status. If an argument is supplied, this
+ *        is equivalent to LIST, except the data is sent over the command
+ *        socket.
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(PORT)
+FTP_DECLARE(STAT)
 {
-  char               *addrstr, *p, *portstr;
-  int                commas = 0, rc;
-  short              port = 0;
-  unsigned long      val;
-  struct sockaddr_in addr;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  /* reset the state */
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-  session->flags &= ~(SESSION_PASV|SESSION_PORT);
+  time_t uptime  = time(NULL) - start_time;
+  int    hours   = uptime / 3600;
+  int    minutes = (uptime / 60) % 60;
+  int    seconds = uptime % 60;
+  int    queued  = 0;
+  time_t elapsed = time(NULL) - session->state_time;
+  char   limit[16] = "none";
+#ifdef __linux__
+  struct tcp_info info;
+  socklen_t       len = sizeof(info);
+  char            eta[128] = "";
+  uint64_t        now, current, average, end;
+
+  /* a listening socket reports its accept queue depth as unacked */
+  if(getsockopt(listenfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    queued = info.tcpi_unacked;
+#endif
 
-  /* dup the args since they are const and we need to change it */
-  addrstr = strdup(args);
-  if(addrstr == NULL)
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  if(session->state == DATA_CONNECT_STATE)
   {
-    ftp_send_response(session, 425, "%s\r\n", strerror(ENOMEM));
+    /* we are waiting to connect to the client */
+    ftp_send_response(session, -211, "FTP server status\r\n"
+                                     " Waiting for data connection for %lds\r\n"
+                                     "211 End\r\n",
+                                     (long)elapsed);
     return;
   }
-
-  /* replace a,b,c,d,e,f with a.b.c.d\0e.f */
-  for(p = addrstr; *p; ++p)
+  else if(session->state == DATA_TRANSFER_STATE)
   {
-    if(*p == ',')
+    if(session->transfer == copy_transfer)
     {
-      if(commas != 3)
-        *p = '.';
-      else
-      {
-        *p = 0;
-        portstr = p+1;
-      }
-      ++commas;
+      /* we are in the middle of a server-side copy */
+      ftp_send_response(session, -211, "FTP server status\r\n"
+                                       " Copied %" PRIu64 " of %" PRIu64 " bytes\r\n"
+                                       "211 End\r\n",
+                                       session->filepos, session->filesize);
+      return;
     }
-  }
-
-  /* make sure we got the right number of values */
-  if(commas != 5)
-  {
-    free(addrstr);
-    ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
-    return;
-  }
 
-  /* parse the address */
-  rc = inet_aton(addrstr, &addr.sin_addr);
-  if(rc == 0)
-  {
-    free(addrstr);
-    ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
-    return;
-  }
-
-  /* parse the port */
-  val  = 0;
-  port = 0;
-  for(p = portstr; *p; ++p)
-  {
-    if(!isdigit((int)*p))
+    if(session->transfer == rmtree_transfer)
     {
-      if(p == portstr || *p != '.' || val > 0xFF)
-      {
-        free(addrstr);
-        ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
-        return;
-      }
-      port <<= 8;
-      port  += val;
-      val    = 0;
+      /* we are in the middle of removing a tree */
+      ftp_send_response(session, -211, "FTP server status\r\n"
+                                       " Removed %" PRIu64 " files and %" PRIu64 " directories\r\n"
+                                       "211 End\r\n",
+                                       session->tree->files, session->tree->removed);
+      return;
     }
-    else
+
+#ifdef __linux__
+    now     = ftp_file_now();
+    average = 0;
+    if(now > session->rate_start)
+      average = session->account_bytes * 1000 / (now - session->rate_start);
+
+    current = ftp_session_rate(session, now);
+
+    /* only files have a known end; an upload only if ALLO announced one */
+    end = 0;
+    if(session->transfer == retrieve_transfer)
+      end = session->rangeend != 0 ? session->rangeend : session->filesize;
+    else if(session->flags & SESSION_RECV)
+      end = session->allocsize;
+
+    if(end > session->filepos && current != 0)
     {
-      val *= 10;
-      val += *p - '0';
+      uint64_t remaining = (end - session->filepos) / current;
+
+      snprintf(eta, sizeof(eta),
+               " Remaining: %" PRIu64 " bytes, ETA %02" PRIu64 ":%02d:%02d\r\n",
+               end - session->filepos, remaining / 3600,
+               (int)(remaining / 60 % 60), (int)(remaining % 60));
     }
+
+    /* we are in the middle of a transfer */
+    ftp_send_response(session, -211, "FTP server status\r\n"
+                                     " Transferred %" PRIu64 " bytes in %lds\r\n"
+                                     " Rate: %" PRIu64 " bytes/s current,"
+                                     " %" PRIu64 " bytes/s average\r\n"
+                                     "%s"
+                                     "211 End\r\n",
+                                     session->filepos, (long)elapsed,
+                                     current, average, eta);
+#else
+    /* we are in the middle of a transfer */
+    ftp_send_response(session, -211, "FTP server status\r\n"
+                                     " Transferred %" PRIu64 " bytes in %lds\r\n"
+                                     "211 End\r\n",
+                                     session->filepos, (long)elapsed);
+#endif
+    return;
   }
 
-  /* validate the port */
-  if(val > 0xFF || port > 0xFF)
+  if(strlen(args) == 0)
   {
-    free(addrstr);
-    ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
+    if(MAX_SESSIONS != 0)
+      snprintf(limit, sizeof(limit), "%u", MAX_SESSIONS);
+
+    /* no argument provided, send the server status */
+    ftp_send_response(session, -211, "FTP server status\r\n"
+                                     " Uptime: %02d:%02d:%02d\r\n"
+                                     " Cache: %" PRIu64 " hits, %" PRIu64 " misses,"
+                                     " %" PRIu64 " bytes\r\n"
+                                     " Sessions: %u (peak %u, limit %s),"
+                                     " %d queued\r\n"
+                                     " Connections: %" PRIu64 " accepted,"
+                                     " %" PRIu64 " too many users,"
+                                     " %" PRIu64 " per-host limit,"
+                                     " %" PRIu64 " per-subnet limit\r\n"
+                                     "211 End\r\n",
+                                     hours, minutes, seconds,
+                                     cache_hits, cache_misses, cache_bytes,
+                                     num_sessions, peak_sessions, limit,
+                                     queued, sessions_accepted, rejected_full,
+                                     rejected_host, rejected_subnet);
     return;
   }
-  port <<= 8;
-  port  += val;
-
-  /* fill in the address port and family */
-  addr.sin_family = AF_INET;
-  addr.sin_port   = htons(port);
 
-  free(addrstr);
+  /* argument provided, open the path in STAT mode */
+  ftp_xfer_dir(session, args, XFER_DIR_STAT, false);
+}
 
-  memcpy(&session->peer_addr, &addr, sizeof(addr));
+/*! @fn static void STOR(ftp_session_t *session, const char *args)
+ *
+ *  @brief store a file
+ *
+ *  @note Requires a PASV or PORT connection
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(STOR)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* we are ready to connect to the client */
-  session->flags |= SESSION_PORT;
-  ftp_send_response(session, 200, "OK\r\n");
+  /* open the file to store */
+  return ftp_xfer_file(session, args, XFER_FILE_STOR);
 }
 
-/*! @fn static void PWD(ftp_session_t *session, const char *args)
+/*! @fn static void STOU(ftp_session_t *session, const char *args)
  *
- *  @brief print working directory
+ *  @brief store a unique file
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(PWD)
+FTP_DECLARE(STOU)
 {
-  static char buffer[CMD_BUFFERSIZE];
-  size_t      len = sizeof(buffer), i;
-  char        *path;
+  struct stat st;
+  const char  *base = "ftpd";
+  char        name[sizeof(session->xfer_path)];
+  unsigned    n;
+  int         rc;
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+  /* use the requested name as a base if there is one */
+  if(strlen(args) != 0)
+    base = args;
 
-  /* encode the cwd */
-  len = strlen(session->cwd);
-  path = encode_path(session->cwd, &len, true);
-  if(path != NULL)
+  /* find a name that is not taken */
+  for(n = 0; n < 1000; ++n)
   {
-    i = sprintf(buffer, "257 \"");
-    if(i + len + 3 > sizeof(buffer))
+    if(n == 0 && base != args)
+      continue;
+
+    if(n == 0)
+      rc = snprintf(name, sizeof(name), "%s", base);
+    else
+      rc = snprintf(name, sizeof(name), "%s.%u", base, n);
+    if(rc < 0 || (size_t)rc >= sizeof(name))
+      break;
+
+    if(build_path(session, session->cwd, name) != 0)
+      break;
+
+    if(lstat(session->buffer, &st) != 0 && errno == ENOENT)
     {
-      /* buffer will overflow */
-      free(path);
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 550, "unavailable\r\n");
-      ftp_send_response(session, 425, "%s\r\n", strerror(EOVERFLOW));
+      /* store the file; publishing fails rather than replace a newcomer */
+      strcpy(session->xfer_path, name);
+      session->filepos  = 0;
+      session->flags   |= SESSION_UNIQUE;
+      ftp_xfer_file(session, name, XFER_FILE_STOR);
       return;
     }
-    memcpy(buffer+i, path, len);
-    free(path);
-    len += i;
-    buffer[len++] = '"';
-    buffer[len++] = '\r';
-    buffer[len++] = '\n';
+  }
 
-    ftp_send_response_buffer(session, buffer, len);
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  ftp_send_response(session, 553, "cannot find a unique name\r\n");
+}
+
+/*! @fn static void STRU(ftp_session_t *session, const char *args)
+ *
+ *  @brief set file structure
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(STRU)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* we only support F (no structure) mode */
+  if(strcasecmp(args, "F") == 0)
+  {
+    ftp_send_response(session, 200, "OK\r\n");
     return;
   }
 
-  ftp_send_response(session, 425, "%s\r\n", strerror(ENOMEM));
+  ftp_send_response(session, 504, "unavailable\r\n");
 }
 
-/*! @fn static void QUIT(ftp_session_t *session, const char *args)
+/*! @fn static void SYST(ftp_session_t *session, const char *args)
  *
- *  @brief terminate ftp session
+ *  @brief identify system
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(QUIT)
+FTP_DECLARE(SYST)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* disconnect from the client */
-  ftp_send_response(session, 221, "disconnecting\r\n");
-  ftp_session_close_cmd(session);
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* we are UNIX compliant with 8-bit characters */
+  ftp_send_response(session, 215, "UNIX Type: L8\r\n");
 }
 
-/*! @fn static void REST(ftp_session_t *session, const char *args)
+/*! @fn static void TYPE(ftp_session_t *session, const char *args)
  *
- *  @brief restart a transfer
+ *  @brief set transfer mode
  *
- *  @note sets file position for a subsequent STOR operation
+ *  @note transfer mode is always binary; the requested type is only
+ *        recorded for the transfer log
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(REST)
+FTP_DECLARE(TYPE)
 {
-  const char *p;
-  uint64_t   pos = 0;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* make sure an argument is provided */
-  if(args == NULL)
-  {
-    ftp_send_response(session, 504, "invalid argument\r\n");
-    return;
-  }
+  if(args[0] == 'A' || args[0] == 'a')
+    session->flags &= ~SESSION_BINARY;
+  else
+    session->flags |= SESSION_BINARY;
 
-  /* parse the offset */
-  for(p = args; *p; ++p)
-  {
-    if(!isdigit((int)*p))
-    {
-      ftp_send_response(session, 504, "invalid argument\r\n");
-      return;
-    }
+  /* we always transfer in binary mode */
+  ftp_send_response(session, 200, "OK\r\n");
+}
 
-    if(UINT64_MAX / 10 < pos)
-    {
-      ftp_send_response(session, 504, "invalid argument\r\n");
-      return;
-    }
+/*! @fn static void USER(ftp_session_t *session, const char *args)
+ *
+ *  @brief provide user name
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(USER)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-    pos *= 10;
+  ftp_session_set_state(session, COMMAND_STATE, 0);
 
-    if(UINT64_MAX - (*p - '0') < pos)
-    {
-      ftp_send_response(session, 504, "invalid argument\r\n");
-      return;
-    }
+  /* we accept any user name */
+  ftp_send_response(session, 230, "OK\r\n");
+}
 
-    pos += (*p - '0');
-  }
+/*! @fn static void XCRC(ftp_session_t *session, const char *args)
+ *
+ *  @brief get CRC-32 of a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(XCRC)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* set the restart offset */
-  session->filepos = pos;
-  ftp_send_response(session, 200, "OK\r\n");
+  ftp_xhash(session, args, HASH_CRC32);
 }
 
-/*! @fn static void RETR(ftp_session_t *session, const char *args)
+/*! @fn static void XMD5(ftp_session_t *session, const char *args)
  *
- *  @brief retrieve a file
+ *  @brief get MD5 of a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(XMD5)
+{
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_xhash(session, args, HASH_MD5);
+}
+
+/*! @fn static void XSHA1(ftp_session_t *session, const char *args)
  *
- *  @note Requires a PASV or PORT connection
+ *  @brief get SHA-1 of a file
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(RETR)
+FTP_DECLARE(XSHA1)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* open the file to retrieve */
-  return ftp_xfer_file(session, args, XFER_FILE_RETR);
+  ftp_xhash(session, args, HASH_SHA1);
 }
 
-/*! @fn static void RMD(ftp_session_t *session, const char *args)
+/*! @fn static void XSHA256(ftp_session_t *session, const char *args)
  *
- *  @brief remove a directory
+ *  @brief get SHA-256 of a file
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(RMD)
+FTP_DECLARE(XSHA256)
 {
-  int rc;
+  console_debug(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  ftp_session_set_state(session, COMMAND_STATE, 0);
-
-  /* build the path to remove */
-  if(build_path(session, session->cwd, args) != 0)
-  {
-    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
-    return;
-  }
+  ftp_xhash(session, args, HASH_SHA256);
+}
 
-  /* remove the directory */
-  rc = rmdir(session->buffer);
-  if(rc != 0)
-  {
-    /* rmdir error */
-    console_print(RED "rmdir: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 550, "failed to delete directory\r\n");
-    return;
-  }
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *                         S I T E   C O M M A N D S                         *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-  update_free_space();
-  ftp_send_response(session, 250, "OK\r\n");
+/*! @fn static void SITE_ALLO(ftp_session_t *session, const char *args)
+ *
+ *  @brief give a size hint for the next upload
+ *
+ *  @note same as ALLO, for clients that can only send SITE commands
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+SITE_DECLARE(ALLO)
+{
+  ALLO(session, args);
 }
 
-/*! @fn static void RNFR(ftp_session_t *session, const char *args)
+/*! @fn static void SITE_CPFR(ftp_session_t *session, const char *args)
  *
- *  @brief rename from
+ *  @brief copy from
  *
- *  @note Must be followed by RNTO
+ *  @note Must be followed by SITE CPTO
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(RNFR)
+SITE_DECLARE(CPFR)
 {
   int         rc;
   struct stat st;
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* build the path to rename from */
+  /* build the path to copy from */
   if(build_path(session, session->cwd, args) != 0)
   {
     ftp_send_response(session, 553, "%s\r\n", strerror(errno));
@@ -3849,266 +9038,345 @@ FTP_DECLARE(RNFR)
   }
 
   /* make sure the path exists */
-  rc = lstat(session->buffer, &st);
+  rc = stat(session->buffer, &st);
   if(rc != 0)
   {
     /* error getting path status */
-    console_print(RED "lstat: %d %s\n" RESET, errno, strerror(errno));
+    console_error(RED "stat: %d %s\n" RESET, errno, strerror(errno));
     ftp_send_response(session, 450, "no such file or directory\r\n");
     return;
   }
 
-  /* we are ready for RNTO */
-  session->flags |= SESSION_RENAME;
+  /* we can only copy regular files */
+  if(!S_ISREG(st.st_mode))
+  {
+    ftp_send_response(session, 550, "not a regular file\r\n");
+    return;
+  }
+
+  /* we are ready for CPTO */
+  session->flags |= SESSION_COPY;
   ftp_send_response(session, 350, "OK\r\n");
 }
 
-/*! @fn static void RNTO(ftp_session_t *session, const char *args)
+/*! @fn static void SITE_CPTO(ftp_session_t *session, const char *args)
  *
- *  @brief rename to
+ *  @brief copy to
  *
- *  @note Must be preceded by RNFR
+ *  @note Must be preceded by SITE CPFR. The copy is a reflink if the
+ *        filesystem supports it; otherwise it runs between other sessions
+ *        and its progress is reported by STAT.
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(RNTO)
+SITE_DECLARE(CPTO)
 {
-  static char rnfr[XFER_BUFFERSIZE]; // rename-from buffer
-  int  rc;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  int         rc;
+  struct stat st, dst_st;
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* make sure the previous command was RNFR */
-  if(!(session->flags & SESSION_RENAME))
+  /* make sure the previous command was CPFR */
+  if(!(session->flags & SESSION_COPY))
   {
     ftp_send_response(session, 503, "Bad sequence of commands\r\n");
     return;
   }
 
-  /* clear the rename state */
-  session->flags &= ~SESSION_RENAME;
-
-  /* copy the RNFR path */
-  memcpy(rnfr, session->buffer, XFER_BUFFERSIZE);
+  /* clear the copy state */
+  session->flags &= ~SESSION_COPY;
 
-  /* build the path to rename to */
-  if(build_path(session, session->cwd, args) != 0)
+  /* open the CPFR path */
+  session->copy_src = open(session->buffer, O_RDONLY);
+  if(session->copy_src < 0)
   {
-    ftp_send_response(session, 554, "%s\r\n", strerror(errno));
+    console_error(RED "open '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_send_response(session, 450, "failed to open file\r\n");
     return;
   }
 
-  /* rename the file */
-  rc = rename(rnfr, session->buffer);
+  rc = fstat(session->copy_src, &st);
   if(rc != 0)
   {
-    /* rename failure */
-    console_print(RED "rename: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 550, "failed to rename file/directory\r\n");
+    console_error(RED "fstat: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_file(session);
+    ftp_send_response(session, 450, "failed to open file\r\n");
     return;
   }
 
-  update_free_space();
-  ftp_send_response(session, 250, "OK\r\n");
-}
-
-/*! @fn static void SIZE(ftp_session_t *session, const char *args)
- *
- *  @brief get file size
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(SIZE)
-{
-  int         rc;
-  struct stat st;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  ftp_session_set_state(session, COMMAND_STATE, 0);
-
-  /* build the path to stat */
+  /* build the path to copy to */
   if(build_path(session, session->cwd, args) != 0)
   {
-    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    rc = errno;
+    ftp_session_close_file(session);
+    ftp_send_response(session, 554, "%s\r\n", strerror(rc));
     return;
   }
 
-  rc = stat(session->buffer, &st);
-  if(rc != 0 || !S_ISREG(st.st_mode))
+  /* don't truncate the source */
+  if(stat(session->buffer, &dst_st) == 0
+  && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino)
   {
-    ftp_send_response(session, 550, "Could not get file size.\r\n");
+    ftp_session_close_file(session);
+    ftp_send_response(session, 553, "source and destination are the same file\r\n");
     return;
   }
 
-  ftp_send_response(session, 213, "%" PRIu64 "\r\n",
-                    (uint64_t)st.st_size);
-}
-
-/*! @fn static void STAT(ftp_session_t *session, const char *args)
- *
- *  @brief get status
- *
- *  @note If no argument is supplied, and a transfer is occurring, get the
- *        current transfer status. If no argument is supplied, and no transfer
- *        is occurring, get the server status. If an argument is supplied, this
- *        is equivalent to LIST, except the data is sent over the command
- *        socket.
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(STAT)
-{
-  time_t uptime  = time(NULL) - start_time;
-  int    hours   = uptime / 3600;
-  int    minutes = (uptime / 60) % 60;
-  int    seconds = uptime % 60;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  /* the destination is about to change */
+  ftp_file_invalidate(session->buffer);
 
-  if(session->state == DATA_CONNECT_STATE)
-  {
-    /* we are waiting to connect to the client */
-    ftp_send_response(session, -211, "FTP server status\r\n"
-                                     " Waiting for data connection\r\n"
-                                     "211 End\r\n");
-    return;
-  }
-  else if(session->state == DATA_TRANSFER_STATE)
+  session->copy_dst = open(session->buffer, O_WRONLY | O_CREAT | O_TRUNC,
+                           st.st_mode & 0777);
+  if(session->copy_dst < 0)
   {
-    /* we are in the middle of a transfer */
-    ftp_send_response(session, -211, "FTP server status\r\n"
-                                     " Transferred %" PRIu64 " bytes\r\n"
-                                     "211 End\r\n",
-                                     session->filepos);
+    console_error(RED "open '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_session_close_file(session);
+    ftp_send_response(session, 553, "failed to create file\r\n");
     return;
   }
 
-  if(strlen(args) == 0)
+#ifdef __linux__
+  /* share the extents if the filesystem supports it */
+  if(ioctl(session->copy_dst, FICLONE, session->copy_src) == 0)
   {
-    /* no argument provided, send the server status */
-    ftp_send_response(session, -211, "FTP server status\r\n"
-                                     " Uptime: %02d:%02d:%02d\r\n"
-                                     "211 End\r\n",
-                                     hours, minutes, seconds);
+    ftp_session_close_file(session);
+    update_free_space();
+    ftp_send_response(session, 250, "OK, cloned %" PRIu64 " bytes\r\n",
+                      (uint64_t)st.st_size);
     return;
   }
 
-  /* argument provided, open the path in STAT mode */
-  ftp_xfer_dir(session, args, XFER_DIR_STAT, false);
+  session->copy_range = true;
+#endif
+
+  session->filepos  = 0;
+  session->filesize = st.st_size;
+
+  /* copy over the command socket so that we are polled every iteration */
+  ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_DATA);
+  session->data_fd  = session->cmd_fd;
+  session->flags   |= SESSION_SEND;
+  session->transfer = copy_transfer;
+  session->deficit  = 0;
 }
 
-/*! @fn static void STOR(ftp_session_t *session, const char *args)
+/*! @fn static void SITE_HELP(ftp_session_t *session, const char *args)
  *
- *  @brief store a file
- *
- *  @note Requires a PASV or PORT connection
+ *  @brief list site commands
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(STOR)
+SITE_DECLARE(HELP)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  /* open the file to store */
-  return ftp_xfer_file(session, args, XFER_FILE_STOR);
+  ftp_send_response(session, -214,
+      "The following SITE commands are recognized\r\n"
+      " ALLO CPFR CPTO HELP RMTREE STATS\r\n"
+      "214 End\r\n");
 }
 
-/*! @fn static void STOU(ftp_session_t *session, const char *args)
+/*! @fn static void SITE_RMTREE(ftp_session_t *session, const char *args)
  *
- *  @brief store a unique file
+ *  @brief remove a directory and everything below it
+ *
+ *  @note The tree is removed between other sessions and the progress is
+ *        reported by STAT.
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(STOU)
+SITE_DECLARE(RMTREE)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  int         rc;
+  struct stat st;
 
-  /* we do not support this yet */
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  ftp_send_response(session, 502, "unavailable\r\n");
-}
+  /* build the path to remove */
+  if(build_path(session, session->cwd, args) != 0)
+  {
+    ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+    return;
+  }
 
-/*! @fn static void STRU(ftp_session_t *session, const char *args)
- *
- *  @brief set file structure
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(STRU)
-{
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  /* refuse to remove everything */
+  if(strcmp(session->buffer, "/") == 0)
+  {
+    ftp_send_response(session, 550, "cannot remove root directory\r\n");
+    return;
+  }
 
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+  rc = lstat(session->buffer, &st);
+  if(rc != 0)
+  {
+    console_error(RED "lstat: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 550, "no such file or directory\r\n");
+    return;
+  }
+  if(!S_ISDIR(st.st_mode))
+  {
+    ftp_send_response(session, 550, "not a directory\r\n");
+    return;
+  }
 
-  /* we only support F (no structure) mode */
-  if(strcasecmp(args, "F") == 0)
+  /* forget cached metadata of everything in the tree */
+  ftp_file_invalidate(session->buffer);
+
+  session->tree = (ftp_tree_t*)calloc(1, sizeof(ftp_tree_t));
+  if(session->tree == NULL)
   {
-    ftp_send_response(session, 200, "OK\r\n");
+    console_error(RED "failed to allocate tree\n" RESET);
+    ftp_send_response(session, 451, "%s\r\n", strerror(ENOMEM));
     return;
   }
 
-  ftp_send_response(session, 504, "unavailable\r\n");
+  if(ftp_session_push_tree(session) != 0)
+  {
+    rc = errno;
+    console_error(RED "opendir '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_session_close_cwd(session);
+    ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+    return;
+  }
+
+  /* remove over the command socket so that we are polled every iteration */
+  ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_DATA);
+  session->data_fd  = session->cmd_fd;
+  session->flags   |= SESSION_SEND;
+  session->transfer = rmtree_transfer;
+  session->deficit  = 0;
 }
 
-/*! @fn static void SYST(ftp_session_t *session, const char *args)
+#ifdef __linux__
+/*! add a latency histogram to a SITE STATS reply
  *
- *  @brief identify system
+ *  @param[in] text  text buffer
+ *  @param[in] name  command name
+ *  @param[in] width width of the command name column
+ *  @param[in] label what was timed
+ *  @param[in] hist  histogram in microseconds
  *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
+ *  @returns -1 for failure
  */
-FTP_DECLARE(SYST)
+static int
+ftp_stats_line(ftp_text_t   *text,
+               const char   *name,
+               int          width,
+               const char   *label,
+               const hist_t *hist)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+  if(hist->count == 0)
+    return 0;
 
-  /* we are UNIX compliant with 8-bit characters */
-  ftp_send_response(session, 215, "UNIX Type: L8\r\n");
+  return ftp_text_printf(text,
+                         " %-*s %-10s n=%" PRIu64 " p50=%.3f p90=%.3f p99=%.3f"
+                         " p99.9=%.3f max=%.3f\r\n",
+                         width, name, label, hist->count,
+                         hist_percentile(hist, 50) / 1e3,
+                         hist_percentile(hist, 90) / 1e3,
+                         hist_percentile(hist, 99) / 1e3,
+                         hist_percentile(hist, 99.9) / 1e3,
+                         hist->max / 1e3);
 }
+#endif
 
-/*! @fn static void TYPE(ftp_session_t *session, const char *args)
+/*! @fn static void SITE_STATS(ftp_session_t *session, const char *args)
  *
- *  @brief set transfer mode
+ *  @brief show server statistics and command latency percentiles
  *
- *  @note transfer mode is always binary
+ *  @note With an argument, latency is only shown for that command
  *
  *  @param[in] session ftp session
  *  @param[in] args    arguments
  */
-FTP_DECLARE(TYPE)
+SITE_DECLARE(STATS)
 {
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+  ftp_session_t *it;
+  time_t         uptime  = time(NULL) - start_time;
+  unsigned       uploads = 0, downloads = 0, waiting = 0;
+#ifdef __linux__
+  ftp_text_t     text = { NULL, 0, 0 };
+  uint64_t       now  = ftp_file_now();
+  uint64_t       rate = 0;
+  size_t         i;
+  int            rc, width = 0;
+#endif
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* we always transfer in binary mode */
-  ftp_send_response(session, 200, "OK\r\n");
-}
+  /* count the transfers in progress */
+  for(it = sessions; it != NULL; it = it->next)
+  {
+    if(it->state == DATA_CONNECT_STATE)
+      ++waiting;
+    else if(it->state == DATA_TRANSFER_STATE && (it->flags & SESSION_RECV))
+      ++uploads;
+    else if(it->state == DATA_TRANSFER_STATE && it->transfer == retrieve_transfer)
+      ++downloads;
 
-/*! @fn static void USER(ftp_session_t *session, const char *args)
- *
- *  @brief provide user name
- *
- *  @param[in] session ftp session
- *  @param[in] args    arguments
- */
-FTP_DECLARE(USER)
-{
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+#ifdef __linux__
+    if(it->state == DATA_TRANSFER_STATE)
+      rate += ftp_session_rate(it, now);
+#endif
+  }
 
-  ftp_session_set_state(session, COMMAND_STATE, 0);
+#ifdef __linux__
+  rc = ftp_text_printf(&text, "211-Server statistics\r\n"
+                              " Uptime: %02d:%02d:%02d\r\n"
+                              " Sessions: %u (peak %u), %" PRIu64 " accepted\r\n"
+                              " Transfers: %u uploads, %u downloads,"
+                              " %u waiting for data connection\r\n"
+                              " Rate: %" PRIu64 " bytes/s\r\n"
+                              " Bytes: %" PRIu64 " received, %" PRIu64 " sent\r\n"
+                              " Listings: %" PRIu64 " entries\r\n"
+                              " Command latency in milliseconds:\r\n",
+                              (int)(uptime / 3600), (int)(uptime / 60 % 60),
+                              (int)(uptime % 60),
+                              num_sessions, peak_sessions, sessions_accepted,
+                              uploads, downloads, waiting, rate,
+                              bytes_in, bytes_out, listing_entries);
 
-  /* we accept any user name */
-  ftp_send_response(session, 230, "OK\r\n");
+  /* line up the columns after the longest command name */
+  for(i = 0; i < num_ftp_commands; ++i)
+  {
+    if((int)strlen(ftp_commands[i].name) > width)
+      width = strlen(ftp_commands[i].name);
+  }
+
+  for(i = 0; i < num_ftp_commands; ++i)
+  {
+    if(strlen(args) != 0 && strcasecmp(args, ftp_commands[i].name) != 0)
+      continue;
+
+    rc |= ftp_stats_line(&text, ftp_commands[i].name, width, "reply",
+                         &command_latency[i]);
+    rc |= ftp_stats_line(&text, ftp_commands[i].name, width, "first byte",
+                         &transfer_ttfb[i]);
+    rc |= ftp_stats_line(&text, ftp_commands[i].name, width, "transfer",
+                         &transfer_time[i]);
+  }
+
+  if(rc != 0)
+  {
+    free(text.data);
+    ftp_send_response(session, 451, "%s\r\n", strerror(ENOMEM));
+    return;
+  }
+
+  ftp_send_response_buffer(session, text.data, text.len);
+  free(text.data);
+  ftp_send_response(session, 211, "End\r\n");
+#else
+  ftp_send_response(session, -211, "Server statistics\r\n"
+                                   " Uptime: %02d:%02d:%02d\r\n"
+                                   " Sessions: %u (peak %u), %" PRIu64 " accepted\r\n"
+                                   " Transfers: %u uploads, %u downloads,"
+                                   " %u waiting for data connection\r\n"
+                                   "211 End\r\n",
+                                   (int)(uptime / 3600), (int)(uptime / 60 % 60),
+                                   (int)(uptime % 60),
+                                   num_sessions, peak_sessions, sessions_accepted,
+                                   uploads, downloads, waiting);
+#endif
 }
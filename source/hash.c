@@ -0,0 +1,560 @@
+/* Portable incremental digests for the HASH/XCRC/XMD5/XSHA commands.
+ *
+ * CRC-32 uses slicing-by-8 tables so that eight bytes are folded per step;
+ * MD5 (RFC 1321), SHA-1 and SHA-256 (FIPS 180-4) are straightforward block
+ * implementations that avoid any platform specific intrinsics so that they
+ * build for the 3DS and Switch as well.
+ */
+#include "hash.h"
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+/*! digest sizes */
+static const size_t hash_sizes[HASH_NUM_ALGOS] =
+{
+  [HASH_CRC32]  = 4,
+  [HASH_MD5]    = 16,
+  [HASH_SHA1]   = 20,
+  [HASH_SHA256] = 32,
+};
+
+/*! algorithm names as registered for the HASH command */
+static const char *hash_names[HASH_NUM_ALGOS] =
+{
+  [HASH_CRC32]  = "CRC32",
+  [HASH_MD5]    = "MD5",
+  [HASH_SHA1]   = "SHA-1",
+  [HASH_SHA256] = "SHA-256",
+};
+
+/*! slicing-by-8 crc tables */
+static uint32_t crc_table[8][256];
+/*! whether crc_table has been built */
+static bool     crc_table_ready = false;
+
+/*! build crc tables */
+static void
+crc32_build_table(void)
+{
+  uint32_t crc;
+  size_t   i, j;
+
+  for(i = 0; i < 256; ++i)
+  {
+    crc = i;
+    for(j = 0; j < 8; ++j)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    crc_table[0][i] = crc;
+  }
+
+  for(i = 0; i < 256; ++i)
+  {
+    crc = crc_table[0][i];
+    for(j = 1; j < 8; ++j)
+    {
+      crc = crc_table[0][crc & 0xFF] ^ (crc >> 8);
+      crc_table[j][i] = crc;
+    }
+  }
+
+  crc_table_ready = true;
+}
+
+/*! update crc
+ *
+ *  @param[in] crc  current crc
+ *  @param[in] p    data to hash
+ *  @param[in] len  data length
+ *
+ *  @returns updated crc
+ */
+static uint32_t
+crc32_update(uint32_t      crc,
+             const uint8_t *p,
+             size_t        len)
+{
+  uint32_t lo, hi;
+
+  /* fold eight bytes per step */
+  while(len >= 8)
+  {
+    lo = crc ^ ((uint32_t)p[0]       | (uint32_t)p[1] << 8
+             |  (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    hi =        (uint32_t)p[4]       | (uint32_t)p[5] << 8
+             |  (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+
+    crc = crc_table[7][lo & 0xFF]         ^ crc_table[6][(lo >> 8) & 0xFF]
+        ^ crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24]
+        ^ crc_table[3][hi & 0xFF]         ^ crc_table[2][(hi >> 8) & 0xFF]
+        ^ crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+
+    p   += 8;
+    len -= 8;
+  }
+
+  /* remaining bytes */
+  while(len-- > 0)
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+  return crc;
+}
+
+/*! rotate left */
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+/*! rotate right */
+#define ROR(x,n) (((x) >> (n)) | ((x) << (32-(n))))
+
+/*! load big-endian word */
+static inline uint32_t
+load_be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+       | (uint32_t)p[2] << 8  | (uint32_t)p[3];
+}
+
+/*! load little-endian word */
+static inline uint32_t
+load_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0]       | (uint32_t)p[1] << 8
+       | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*! MD5 block transform
+ *
+ *  @param[in,out] s     chaining state
+ *  @param[in]     block 64-byte input block
+ */
+static void
+md5_transform(uint32_t      s[4],
+              const uint8_t block[64])
+{
+  static const uint32_t K[64] =
+  {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+  static const uint8_t R[64] =
+  {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+  };
+  uint32_t M[16], a, b, c, d, f, t;
+  size_t   i, g;
+
+  for(i = 0; i < 16; ++i)
+    M[i] = load_le32(block + 4*i);
+
+  a = s[0];
+  b = s[1];
+  c = s[2];
+  d = s[3];
+
+  for(i = 0; i < 64; ++i)
+  {
+    if(i < 16)
+    {
+      f = (b & c) | (~b & d);
+      g = i;
+    }
+    else if(i < 32)
+    {
+      f = (d & b) | (~d & c);
+      g = (5*i + 1) % 16;
+    }
+    else if(i < 48)
+    {
+      f = b ^ c ^ d;
+      g = (3*i + 5) % 16;
+    }
+    else
+    {
+      f = c ^ (b | ~d);
+      g = (7*i) % 16;
+    }
+
+    t = d;
+    d = c;
+    c = b;
+    b = b + ROL(a + f + K[i] + M[g], R[i]);
+    a = t;
+  }
+
+  s[0] += a;
+  s[1] += b;
+  s[2] += c;
+  s[3] += d;
+}
+
+/*! SHA-1 block transform
+ *
+ *  @param[in,out] s     chaining state
+ *  @param[in]     block 64-byte input block
+ */
+static void
+sha1_transform(uint32_t      s[5],
+               const uint8_t block[64])
+{
+  uint32_t W[80], a, b, c, d, e, f, k, t;
+  size_t   i;
+
+  for(i = 0; i < 16; ++i)
+    W[i] = load_be32(block + 4*i);
+  for(; i < 80; ++i)
+    W[i] = ROL(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1);
+
+  a = s[0];
+  b = s[1];
+  c = s[2];
+  d = s[3];
+  e = s[4];
+
+  for(i = 0; i < 80; ++i)
+  {
+    if(i < 20)
+    {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    }
+    else if(i < 40)
+    {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    }
+    else if(i < 60)
+    {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    }
+    else
+    {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+
+    t = ROL(a, 5) + f + e + k + W[i];
+    e = d;
+    d = c;
+    c = ROL(b, 30);
+    b = a;
+    a = t;
+  }
+
+  s[0] += a;
+  s[1] += b;
+  s[2] += c;
+  s[3] += d;
+  s[4] += e;
+}
+
+/*! SHA-256 block transform
+ *
+ *  @param[in,out] s     chaining state
+ *  @param[in]     block 64-byte input block
+ */
+static void
+sha256_transform(uint32_t      s[8],
+                 const uint8_t block[64])
+{
+  static const uint32_t K[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
+  uint32_t W[64], v[8], s0, s1, t1, t2;
+  size_t   i;
+
+  for(i = 0; i < 16; ++i)
+    W[i] = load_be32(block + 4*i);
+  for(; i < 64; ++i)
+  {
+    s0 = ROR(W[i-15], 7) ^ ROR(W[i-15], 18) ^ (W[i-15] >> 3);
+    s1 = ROR(W[i-2], 17) ^ ROR(W[i-2], 19)  ^ (W[i-2] >> 10);
+    W[i] = W[i-16] + s0 + W[i-7] + s1;
+  }
+
+  memcpy(v, s, sizeof(v));
+
+  for(i = 0; i < 64; ++i)
+  {
+    s1 = ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25);
+    t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + K[i] + W[i];
+    s0 = ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22);
+    t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+    v[7] = v[6];
+    v[6] = v[5];
+    v[5] = v[4];
+    v[4] = v[3] + t1;
+    v[3] = v[2];
+    v[2] = v[1];
+    v[1] = v[0];
+    v[0] = t1 + t2;
+  }
+
+  for(i = 0; i < 8; ++i)
+    s[i] += v[i];
+}
+
+/*! run the block transform for the context's algorithm
+ *
+ *  @param[in,out] ctx   hash context
+ *  @param[in]     block 64-byte input block
+ */
+static void
+hash_transform(hash_ctx_t    *ctx,
+               const uint8_t *block)
+{
+  switch(ctx->algo)
+  {
+    case HASH_MD5:
+      md5_transform(ctx->state, block);
+      break;
+
+    case HASH_SHA1:
+      sha1_transform(ctx->state, block);
+      break;
+
+    case HASH_SHA256:
+      sha256_transform(ctx->state, block);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*! initialize hash context
+ *
+ *  @param[out] ctx  hash context
+ *  @param[in]  algo hash algorithm
+ */
+void
+hash_init(hash_ctx_t  *ctx,
+          hash_algo_t algo)
+{
+  static const uint32_t md5_iv[4] =
+  {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+  };
+  static const uint32_t sha1_iv[5] =
+  {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0,
+  };
+  static const uint32_t sha256_iv[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->algo = algo;
+
+  switch(algo)
+  {
+    case HASH_CRC32:
+      if(!crc_table_ready)
+        crc32_build_table();
+      ctx->state[0] = 0xFFFFFFFF;
+      break;
+
+    case HASH_MD5:
+      memcpy(ctx->state, md5_iv, sizeof(md5_iv));
+      break;
+
+    case HASH_SHA1:
+      memcpy(ctx->state, sha1_iv, sizeof(sha1_iv));
+      break;
+
+    case HASH_SHA256:
+      memcpy(ctx->state, sha256_iv, sizeof(sha256_iv));
+      break;
+  }
+}
+
+/*! feed data into a hash context
+ *
+ *  @param[in,out] ctx  hash context
+ *  @param[in]     data data to hash
+ *  @param[in]     len  data length
+ */
+void
+hash_update(hash_ctx_t *ctx,
+            const void *data,
+            size_t     len)
+{
+  const uint8_t *p = (const uint8_t*)data;
+  size_t        used, n;
+
+  if(ctx->algo == HASH_CRC32)
+  {
+    ctx->state[0]  = crc32_update(ctx->state[0], p, len);
+    ctx->length   += len;
+    return;
+  }
+
+  used         = ctx->length % sizeof(ctx->block);
+  ctx->length += len;
+
+  /* top up a partial block first */
+  if(used != 0)
+  {
+    n = sizeof(ctx->block) - used;
+    if(n > len)
+      n = len;
+
+    memcpy(ctx->block + used, p, n);
+    p   += n;
+    len -= n;
+
+    if(used + n < sizeof(ctx->block))
+      return;
+
+    hash_transform(ctx, ctx->block);
+  }
+
+  /* hash whole blocks straight from the input */
+  while(len >= sizeof(ctx->block))
+  {
+    hash_transform(ctx, p);
+    p   += sizeof(ctx->block);
+    len -= sizeof(ctx->block);
+  }
+
+  /* save the tail for later */
+  memcpy(ctx->block, p, len);
+}
+
+/*! finish a hash and render it as lowercase hex
+ *
+ *  @param[in,out] ctx hash context
+ *  @param[out]    hex hex digest (nul-terminated)
+ *
+ *  @returns length of hex digest
+ */
+size_t
+hash_final(hash_ctx_t *ctx,
+           char       hex[HASH_MAX_HEX])
+{
+  static const char digits[] = "0123456789abcdef";
+  uint8_t           digest[HASH_MAX_DIGEST];
+  uint64_t          bits;
+  size_t            used, i, size = hash_sizes[ctx->algo];
+
+  if(ctx->algo == HASH_CRC32)
+  {
+    uint32_t crc = ctx->state[0] ^ 0xFFFFFFFF;
+    for(i = 0; i < 4; ++i)
+      digest[i] = crc >> (24 - 8*i);
+  }
+  else
+  {
+    /* append the 1 bit and pad to 56 bytes mod 64 */
+    bits = ctx->length * 8;
+    used = ctx->length % sizeof(ctx->block);
+    ctx->block[used++] = 0x80;
+    if(used > 56)
+    {
+      memset(ctx->block + used, 0, sizeof(ctx->block) - used);
+      hash_transform(ctx, ctx->block);
+      used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+
+    /* append the message length */
+    for(i = 0; i < 8; ++i)
+    {
+      if(ctx->algo == HASH_MD5)
+        ctx->block[56 + i] = bits >> (8*i);
+      else
+        ctx->block[63 - i] = bits >> (8*i);
+    }
+    hash_transform(ctx, ctx->block);
+
+    /* serialize the state */
+    for(i = 0; i < size; ++i)
+    {
+      if(ctx->algo == HASH_MD5)
+        digest[i] = ctx->state[i/4] >> (8*(i%4));
+      else
+        digest[i] = ctx->state[i/4] >> (24 - 8*(i%4));
+    }
+  }
+
+  for(i = 0; i < size; ++i)
+  {
+    hex[2*i]   = digits[digest[i] >> 4];
+    hex[2*i+1] = digits[digest[i] & 0xF];
+  }
+  hex[2*size] = 0;
+
+  return 2*size;
+}
+
+/*! get hash algorithm name
+ *
+ *  @param[in] algo hash algorithm
+ *
+ *  @returns algorithm name
+ */
+const char*
+hash_name(hash_algo_t algo)
+{
+  return hash_names[algo];
+}
+
+/*! look up hash algorithm by name
+ *
+ *  @param[in]  name algorithm name
+ *  @param[out] algo hash algorithm
+ *
+ *  @returns -1 if not found
+ */
+int
+hash_lookup(const char  *name,
+            hash_algo_t *algo)
+{
+  size_t i;
+
+  for(i = 0; i < HASH_NUM_ALGOS; ++i)
+  {
+    if(strcasecmp(name, hash_names[i]) == 0)
+    {
+      *algo = (hash_algo_t)i;
+      return 0;
+    }
+  }
+
+  return -1;
+}
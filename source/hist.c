@@ -0,0 +1,131 @@
+/* High dynamic range histograms for latency tracking.
+ *
+ * Values are kept with two significant digits of precision in the same
+ * log-linear layout as HdrHistogram: the first HIST_SUB_BUCKETS values each
+ * have a counter, and every following power of two shares HIST_SUB_BUCKETS/2
+ * counters, so recording and percentile queries never allocate beyond the
+ * fixed counter array.
+ */
+#include "hist.h"
+#include <stdlib.h>
+
+/*! get the counter index of a value
+ *
+ *  @param[in] value value
+ *
+ *  @returns counter index
+ */
+static unsigned
+hist_index(uint64_t value)
+{
+  unsigned shift = 0;
+
+  /* small values are exact */
+  if(value < HIST_SUB_BUCKETS)
+    return value;
+
+  /* halve until the value fits the sub-buckets */
+  while((value >> shift) >= HIST_SUB_BUCKETS)
+    ++shift;
+
+  return shift * (HIST_SUB_BUCKETS/2) + (value >> shift);
+}
+
+/*! get the largest value that shares a counter
+ *
+ *  @param[in] index counter index
+ *
+ *  @returns largest value counted by index
+ */
+static uint64_t
+hist_value(unsigned index)
+{
+  unsigned shift;
+
+  if(index < HIST_SUB_BUCKETS)
+    return index;
+
+  shift = index / (HIST_SUB_BUCKETS/2) - 1;
+  return ((uint64_t)(index - shift * (HIST_SUB_BUCKETS/2)) << shift)
+       + ((uint64_t)1 << shift) - 1;
+}
+
+/*! record a value
+ *
+ *  @param[in] hist  histogram
+ *  @param[in] value value to record
+ *
+ *  @returns -1 for failure
+ */
+int
+hist_record(hist_t   *hist,
+            uint64_t value)
+{
+  if(hist->counts == NULL)
+  {
+    hist->counts = (uint32_t*)calloc(HIST_COUNTS, sizeof(uint32_t));
+    if(hist->counts == NULL)
+      return -1;
+  }
+
+  if(value > HIST_MAX)
+    value = HIST_MAX;
+
+  ++hist->counts[hist_index(value)];
+  ++hist->count;
+  hist->sum += value;
+  if(value > hist->max)
+    hist->max = value;
+
+  return 0;
+}
+
+/*! get a percentile
+ *
+ *  @param[in] hist       histogram
+ *  @param[in] percentile percentile, 0 to 100
+ *
+ *  @returns value at or below which percentile of the values are
+ */
+uint64_t
+hist_percentile(const hist_t *hist,
+                double       percentile)
+{
+  uint64_t want, seen = 0;
+  unsigned i;
+
+  if(hist->count == 0 || hist->counts == NULL)
+    return 0;
+
+  want = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+  if(want < 1)
+    want = 1;
+  if(want > hist->count)
+    want = hist->count;
+
+  for(i = 0; i < HIST_COUNTS; ++i)
+  {
+    seen += hist->counts[i];
+    if(seen >= want)
+      break;
+  }
+
+  /* never report more than was actually seen */
+  if(i == HIST_COUNTS || hist_value(i) > hist->max)
+    return hist->max;
+  return hist_value(i);
+}
+
+/*! release a histogram's counters
+ *
+ *  @param[in] hist histogram
+ */
+void
+hist_free(hist_t *hist)
+{
+  free(hist->counts);
+  hist->counts = NULL;
+  hist->count  = 0;
+  hist->sum    = 0;
+  hist->max    = 0;
+}